@@ -0,0 +1,588 @@
+// Micro-benchmarks of the intersection and traversal kernels. Rays are
+// recorded from scene() and cornell_box(), the camera rays and the rays that
+// scatter off whatever those hit first, and every kernel is timed over them on
+// its own as well as the whole scene at once. For the noise kernels a "ray" is
+// one lookup at a point the camera rays hit.
+//
+// Every benchmark is warmed up, then repeated and reported with the mean,
+// median and a 95% confidence interval of the time per ray. Cycles per node
+// are the cycles per ray over the tree nodes tested per ray, so for bvh_node
+// they include the primitive tests in its leaves. Results can be
+// written as JSON and compared against such a file from another commit.
+//
+//   Benchmark [--reps N] [--warmup N] [--min-time ms] [--size W H]
+//             [--filter text] [--json out.json] [--compare base.json]
+//             [--save-rays file] [--load-rays file]
+//
+// Build it like the renderer, from this directory:
+//   g++ -O2 -std=c++17 -pthread -I../vendor/stb_image Benchmark.cpp ../vendor/stb_image/stb_image.cpp
+
+#include "../src/Scenes.h"
+#include "../src/Camera.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#if defined(_MSC_VER)
+	#include <intrin.h>
+	#define RT_BENCH_TSC
+#elif defined(__x86_64__) || defined(__i386__)
+	#include <x86intrin.h>
+	#define RT_BENCH_TSC
+#endif
+
+// Time stamp counter ticks. On current x86 parts it runs at the nominal clock
+// whatever the core's actual frequency, so "cycles" are nominal cycles.
+static uint64_t read_cycles()
+{
+#if defined(RT_BENCH_TSC)
+	return __rdtsc();
+#else
+	return 0;
+#endif
+}
+
+// Results are folded into this so the compiler cannot drop the kernels
+static volatile float g_Sink = 0.0f;
+
+// Makes value count as used and memory as changed, so neither a kernel's
+// result nor the kernel called again over the same rays can be optimized out
+static void keep(size_t value)
+{
+#if defined(_MSC_VER)
+	g_Sink = g_Sink + static_cast<float>(value & 1);
+	_ReadWriteBarrier();
+#else
+	asm volatile("" : : "r"(value) : "memory");
+#endif
+}
+
+struct ray_set
+{
+	std::string name;
+	std::vector<ray> rays;
+};
+
+struct bench_settings
+{
+	int warmup = 3;
+	int reps = 20;
+	double minTimeMs = 20.0; // Each repetition loops over its rays at least this long
+	int width = 128;
+	int height = 128;
+	std::string filter;
+	std::string json;
+	std::string compare;
+	std::string saveRays;
+	std::string loadRays;
+};
+
+struct bench_result
+{
+	std::string name;
+	size_t rays = 0;
+	double nsMean = 0.0, nsMedian = 0.0, nsStddev = 0.0, nsCi95 = 0.0;
+	double cyclesPerRay = 0.0;
+	double nodesPerRay = 0.0; // Tree nodes tested per ray, 0 when not known
+	double hitRate = 0.0;
+};
+
+/////////////////////////////////////////////////////////////////////////////////////
+// Ray sets /////////////////////////////////////////////////////////////////////////
+/////////////////////////////////////////////////////////////////////////////////////
+
+// One jittered camera ray per pixel, keyed like the renderer's first sample,
+// and for every one that hits something the ray its material scatters.
+static void record_rays(const std::string& scene, const hittable& world, const material_table& materials,
+	const Camera& camera, int width, int height, ray_set& primary, ray_set& secondary)
+{
+	primary.name = scene + "/primary";
+	secondary.name = scene + "/secondary";
+
+	for (int j = 0; j < height; j++)
+		for (int i = 0; i < width; i++)
+		{
+			sampler s(j * width + i, 0);
+			float u = float(i + s.next()) / (width - 1.0f);
+			float v = float(j + s.next()) / (height - 1.0f);
+			ray r = camera.get_ray(u, v, s);
+			primary.rays.push_back(r);
+
+			hit_record rec;
+			if (!world.hit(r, 0.001f, INF, rec))
+				continue;
+
+			color attenuation;
+			ray scattered;
+			if (materials[rec.matId].scatter(r, rec, attenuation, scattered, s))
+				secondary.rays.push_back(scattered);
+		}
+}
+
+// A raw dump of the sets, for comparing commits that change what the rays
+// would be when recorded again. It is only meant to be read on the machine
+// that wrote it.
+static bool save_rays(const std::string& path, const std::vector<ray_set>& sets)
+{
+	std::ofstream out(path, std::ios::binary);
+	if (!out)
+		return false;
+
+	uint32_t count = static_cast<uint32_t>(sets.size());
+	out.write("RTRAYS1\n", 8);
+	out.write(reinterpret_cast<const char*>(&count), sizeof(count));
+	for (const auto& set : sets)
+	{
+		uint32_t length = static_cast<uint32_t>(set.name.size());
+		uint32_t rays = static_cast<uint32_t>(set.rays.size());
+		out.write(reinterpret_cast<const char*>(&length), sizeof(length));
+		out.write(set.name.data(), length);
+		out.write(reinterpret_cast<const char*>(&rays), sizeof(rays));
+		for (const ray& r : set.rays)
+		{
+			float values[7] = { r.GetOrigin().x(), r.GetOrigin().y(), r.GetOrigin().z(),
+				r.GetDirection().x(), r.GetDirection().y(), r.GetDirection().z(), r.GetTime() };
+			uint32_t seed = r.GetSeed();
+			out.write(reinterpret_cast<const char*>(values), sizeof(values));
+			out.write(reinterpret_cast<const char*>(&seed), sizeof(seed));
+		}
+	}
+	return static_cast<bool>(out);
+}
+
+static bool load_rays(const std::string& path, std::vector<ray_set>& sets)
+{
+	std::ifstream in(path, std::ios::binary);
+	char magic[8];
+	uint32_t count = 0;
+	if (!in.read(magic, 8) || std::memcmp(magic, "RTRAYS1\n", 8) != 0 || !in.read(reinterpret_cast<char*>(&count), sizeof(count)))
+		return false;
+
+	sets.clear();
+	for (uint32_t k = 0; k < count; k++)
+	{
+		ray_set set;
+		uint32_t length = 0, rays = 0;
+		if (!in.read(reinterpret_cast<char*>(&length), sizeof(length)))
+			return false;
+		set.name.resize(length);
+		if (!in.read(&set.name[0], length) || !in.read(reinterpret_cast<char*>(&rays), sizeof(rays)))
+			return false;
+
+		set.rays.reserve(rays);
+		for (uint32_t i = 0; i < rays; i++)
+		{
+			float values[7];
+			uint32_t seed;
+			if (!in.read(reinterpret_cast<char*>(values), sizeof(values)) || !in.read(reinterpret_cast<char*>(&seed), sizeof(seed)))
+				return false;
+			set.rays.push_back(ray(point3(values[0], values[1], values[2]), vec3(values[3], values[4], values[5]), values[6], seed));
+		}
+		sets.push_back(std::move(set));
+	}
+	return true;
+}
+
+static const ray_set* find_set(const std::vector<ray_set>& sets, const std::string& name)
+{
+	for (const auto& set : sets)
+		if (set.name == name)
+			return &set;
+	return nullptr;
+}
+
+/////////////////////////////////////////////////////////////////////////////////////
+// Measuring ////////////////////////////////////////////////////////////////////////
+/////////////////////////////////////////////////////////////////////////////////////
+
+// Two sided 95% quantile of Student's t for n - 1 degrees of freedom
+static double student_t95(int n)
+{
+	static const double table[] = { 0.0, 12.706, 4.303, 3.182, 2.776, 2.571, 2.447, 2.365, 2.306, 2.262, 2.228,
+		2.201, 2.179, 2.160, 2.145, 2.131, 2.120, 2.110, 2.101, 2.093, 2.086,
+		2.080, 2.074, 2.069, 2.064, 2.060, 2.056, 2.052, 2.048, 2.045, 2.042 };
+	int df = n - 1;
+	if (df < 1)
+		return 0.0;
+	return df <= 30 ? table[df] : 1.960;
+}
+
+// Times kernel(), which handles rays rays and returns how many of them hit.
+// It is called enough times per repetition to last settings.minTimeMs, which
+// the warm-up runs also decide.
+template<typename Kernel>
+static bench_result measure(const std::string& name, size_t rays, const bench_settings& settings, Kernel&& kernel)
+{
+	using clock = std::chrono::steady_clock;
+
+	bench_result result;
+	result.name = name;
+	result.rays = rays;
+	if (rays == 0)
+		return result;
+
+	size_t hits = 0;
+	int loops = 1;
+	for (int w = 0; w < std::max(1, settings.warmup); w++)
+	{
+		auto start = clock::now();
+		for (int l = 0; l < loops; l++)
+		{
+			hits = kernel();
+			keep(hits);
+		}
+		double ms = std::chrono::duration<double, std::milli>(clock::now() - start).count();
+		if (ms < settings.minTimeMs)
+			loops = std::max(loops + 1, static_cast<int>(loops * settings.minTimeMs / std::max(ms, 1e-3)));
+	}
+	result.hitRate = static_cast<double>(hits) / rays;
+
+	std::vector<double> ns;
+	double cycles = 0.0;
+	for (int rep = 0; rep < settings.reps; rep++)
+	{
+		auto start = clock::now();
+		uint64_t startCycles = read_cycles();
+		for (int l = 0; l < loops; l++)
+		{
+			hits = kernel();
+			keep(hits);
+		}
+		uint64_t endCycles = read_cycles();
+		double elapsed = std::chrono::duration<double, std::nano>(clock::now() - start).count();
+
+		ns.push_back(elapsed / (static_cast<double>(rays) * loops));
+		cycles += static_cast<double>(endCycles - startCycles) / (static_cast<double>(rays) * loops);
+	}
+
+	int n = static_cast<int>(ns.size());
+	double sum = 0.0;
+	for (double x : ns)
+		sum += x;
+	result.nsMean = sum / n;
+
+	double squares = 0.0;
+	for (double x : ns)
+		squares += (x - result.nsMean) * (x - result.nsMean);
+	result.nsStddev = n > 1 ? std::sqrt(squares / (n - 1)) : 0.0;
+	result.nsCi95 = student_t95(n) * result.nsStddev / std::sqrt(static_cast<double>(n));
+
+	std::sort(ns.begin(), ns.end());
+	result.nsMedian = n % 2 ? ns[n / 2] : 0.5 * (ns[n / 2 - 1] + ns[n / 2]);
+	result.cyclesPerRay = cycles / n;
+	return result;
+}
+
+/////////////////////////////////////////////////////////////////////////////////////
+// Reporting ////////////////////////////////////////////////////////////////////////
+/////////////////////////////////////////////////////////////////////////////////////
+
+static void print_header()
+{
+	std::printf("%-36s %8s %9s %9s %9s %9s %8s %8s %6s\n",
+		"benchmark", "rays", "ns/ray", "+-95%", "median", "Mrays/s", "cyc/ray", "cyc/node", "hits");
+}
+
+static void print_result(const bench_result& r)
+{
+	double mrays = r.nsMean > 0.0 ? 1000.0 / r.nsMean : 0.0;
+	char perNode[16] = "-";
+	if (r.nodesPerRay > 0.0)
+		std::snprintf(perNode, sizeof(perNode), "%.1f", r.cyclesPerRay / r.nodesPerRay);
+
+	std::printf("%-36s %8zu %9.2f %9.2f %9.2f %9.2f %8.1f %8s %5.1f%%\n", r.name.c_str(), r.rays,
+		r.nsMean, r.nsCi95, r.nsMedian, mrays, r.cyclesPerRay, perNode, 100.0 * r.hitRate);
+}
+
+// One result per line, which is what read_baseline relies on
+static bool write_json(const std::string& path, const bench_settings& settings, const std::vector<bench_result>& results)
+{
+	std::ofstream out(path);
+	if (!out)
+		return false;
+
+	out << "{\n";
+	out << "  \"settings\": {\"warmup\": " << settings.warmup << ", \"reps\": " << settings.reps
+		<< ", \"min_time_ms\": " << settings.minTimeMs << ", \"width\": " << settings.width << ", \"height\": " << settings.height
+		<< ", \"rays_loaded\": " << (settings.loadRays.empty() ? "false" : "true") << "},\n";
+	out << "  \"results\": [\n";
+	for (size_t k = 0; k < results.size(); k++)
+	{
+		const bench_result& r = results[k];
+		char line[512];
+		std::snprintf(line, sizeof(line),
+			"    {\"name\": \"%s\", \"rays\": %zu, \"ns_per_ray\": %.4f, \"ns_ci95\": %.4f, \"ns_median\": %.4f, \"ns_stddev\": %.4f, "
+			"\"mrays_per_s\": %.4f, \"cycles_per_ray\": %.2f, \"nodes_per_ray\": %.3f, \"cycles_per_node\": %.3f, \"hit_rate\": %.5f}%s\n",
+			r.name.c_str(), r.rays, r.nsMean, r.nsCi95, r.nsMedian, r.nsStddev,
+			r.nsMean > 0.0 ? 1000.0 / r.nsMean : 0.0, r.cyclesPerRay, r.nodesPerRay,
+			r.nodesPerRay > 0.0 ? r.cyclesPerRay / r.nodesPerRay : 0.0, r.hitRate, k + 1 < results.size() ? "," : "");
+		out << line;
+	}
+	out << "  ]\n}\n";
+	return static_cast<bool>(out);
+}
+
+static bool json_number(const std::string& line, const char* key, double& value)
+{
+	std::string pattern = std::string("\"") + key + "\": ";
+	size_t at = line.find(pattern);
+	if (at == std::string::npos)
+		return false;
+	value = std::strtod(line.c_str() + at + pattern.size(), nullptr);
+	return true;
+}
+
+// Reads back the results of a file written by write_json
+static std::vector<bench_result> read_baseline(const std::string& path)
+{
+	std::vector<bench_result> results;
+	std::ifstream in(path);
+	std::string line;
+	while (std::getline(in, line))
+	{
+		size_t at = line.find("\"name\": \"");
+		if (at == std::string::npos)
+			continue;
+
+		bench_result r;
+		size_t begin = at + 9;
+		r.name = line.substr(begin, line.find('"', begin) - begin);
+		if (json_number(line, "ns_per_ray", r.nsMean) && json_number(line, "ns_ci95", r.nsCi95))
+			results.push_back(r);
+	}
+	return results;
+}
+
+// A change counts when the confidence intervals of the two runs do not overlap
+static void print_comparison(const std::vector<bench_result>& baseline, const std::vector<bench_result>& results)
+{
+	std::printf("\n%-36s %10s %10s %8s\n", "compared to baseline", "base ns", "now ns", "change");
+	for (const auto& now : results)
+	{
+		for (const auto& base : baseline)
+		{
+			if (base.name != now.name)
+				continue;
+
+			double change = base.nsMean > 0.0 ? 100.0 * (now.nsMean - base.nsMean) / base.nsMean : 0.0;
+			const char* verdict = "same";
+			if (now.nsMean + now.nsCi95 < base.nsMean - base.nsCi95)
+				verdict = "faster";
+			else if (now.nsMean - now.nsCi95 > base.nsMean + base.nsCi95)
+				verdict = "slower";
+
+			std::printf("%-36s %10.2f %10.2f %+7.1f%% %s\n", now.name.c_str(), base.nsMean, now.nsMean, change, verdict);
+		}
+	}
+}
+
+/////////////////////////////////////////////////////////////////////////////////////
+// Main /////////////////////////////////////////////////////////////////////////////
+/////////////////////////////////////////////////////////////////////////////////////
+
+int main(int argc, char** argv)
+{
+	bench_settings settings;
+	for (int a = 1; a < argc; a++)
+	{
+		std::string arg = argv[a];
+		bool hasValue = a + 1 < argc;
+		if (arg == "--reps" && hasValue)
+			settings.reps = std::max(1, std::atoi(argv[++a]));
+		else if (arg == "--warmup" && hasValue)
+			settings.warmup = std::max(0, std::atoi(argv[++a]));
+		else if (arg == "--min-time" && hasValue)
+			settings.minTimeMs = std::atof(argv[++a]);
+		else if (arg == "--size" && a + 2 < argc)
+		{
+			settings.width = std::max(2, std::atoi(argv[++a]));
+			settings.height = std::max(2, std::atoi(argv[++a]));
+		}
+		else if (arg == "--filter" && hasValue)
+			settings.filter = argv[++a];
+		else if (arg == "--json" && hasValue)
+			settings.json = argv[++a];
+		else if (arg == "--compare" && hasValue)
+			settings.compare = argv[++a];
+		else if (arg == "--save-rays" && hasValue)
+			settings.saveRays = argv[++a];
+		else if (arg == "--load-rays" && hasValue)
+			settings.loadRays = argv[++a];
+		else
+		{
+			std::cerr << "Unknown argument '" << arg << "'.\n";
+			return 1;
+		}
+	}
+
+	// The scenes as the renderer builds them, with the cameras that view them
+	scene_arena arena;
+	material_table sceneMaterials, cornellMaterials;
+	light_list sceneLights, cornellLights;
+	hittable_list sceneWorld = scene(arena, sceneMaterials, sceneLights);
+	hittable_list cornellWorld = cornell_box(arena, cornellMaterials, cornellLights);
+
+	const float aspectRatio = float(settings.width) / settings.height;
+	Camera sceneCamera(point3(478, 278, -600), point3(278, 278, 0), vec3(0, 1, 0), 40.0f, aspectRatio, 0.0f, 10.0f, 0.0f, 1.0f);
+	Camera cornellCamera(point3(278, 278, -800), point3(278, 278, 0), vec3(0, 1, 0), 40.0f, aspectRatio, 0.0f, 10.0f, 0.0f, 1.0f);
+
+	// Single kernels, made with the values scene() uses for them
+	material_id anyMaterial = 0;
+	sphere glassSphere(point3(260, 150, 45), 50, anyMaterial);
+	xz_rect sceneLight(123, 423, 147, 412, 554, anyMaterial);
+	auto glassMesh = sphere_mesh(arena, point3(260, 150, 45), 50, 64, 128, anyMaterial); // The same sphere in 16256 triangles
+	hittable_list groundList = ground_boxes(arena, anyMaterial);
+	bvh_node ground(groundList, 0, 1);
+	aabb groundBounds;
+	ground.bounding_box(0, 1, groundBounds);
+	perlin noise;
+
+	std::vector<ray_set> sets;
+	if (!settings.loadRays.empty())
+	{
+		if (!load_rays(settings.loadRays, sets))
+		{
+			std::cerr << "ERROR: Could not read rays from '" << settings.loadRays << "'.\n";
+			return 1;
+		}
+	}
+	else
+	{
+		sets.resize(4);
+		record_rays("scene", sceneWorld, sceneMaterials, sceneCamera, settings.width, settings.height, sets[0], sets[1]);
+		record_rays("cornell", cornellWorld, cornellMaterials, cornellCamera, settings.width, settings.height, sets[2], sets[3]);
+	}
+
+	if (!settings.saveRays.empty() && !save_rays(settings.saveRays, sets))
+		std::cerr << "ERROR: Could not write rays to '" << settings.saveRays << "'.\n";
+
+	// Lookups at the scaled points where the scene's camera rays land, like
+	// the noise texture of scene() makes them
+	std::vector<float> noiseX, noiseY, noiseZ;
+	if (const ray_set* primary = find_set(sets, "scene/primary"))
+	{
+		for (const ray& r : primary->rays)
+		{
+			hit_record rec;
+			if (!sceneWorld.hit(r, 0.001f, INF, rec))
+				continue;
+			noiseX.push_back(0.1f * rec.p.x());
+			noiseY.push_back(0.1f * rec.p.y());
+			noiseZ.push_back(0.1f * rec.p.z());
+		}
+	}
+
+	std::vector<bench_result> results;
+	auto run = [&](const std::string& name, size_t rays, auto&& kernel, auto&& nodes) {
+		if (!settings.filter.empty() && name.find(settings.filter) == std::string::npos)
+			return;
+
+		bench_result result = measure(name, rays, settings, kernel);
+		result.nodesPerRay = nodes();
+		print_result(result);
+		std::fflush(stdout);
+		results.push_back(result);
+	};
+	auto noNodes = [] { return 0.0; };
+
+	// Closest hit of a hittable over a whole set
+	auto hitKernel = [](const hittable& object, const ray_set& set) {
+		return [&object, &set] {
+			size_t hits = 0;
+			float sum = 0.0f;
+			hit_record rec;
+			for (const ray& r : set.rays)
+			{
+				if (object.hit(r, 0.001f, INF, rec))
+				{
+					hits++;
+					sum += rec.t;
+				}
+			}
+			g_Sink = g_Sink + sum;
+			return hits;
+		};
+	};
+
+	print_header();
+	for (const auto& set : sets)
+	{
+		bool isScene = set.name.compare(0, 6, "scene/") == 0;
+		size_t n = set.rays.size();
+
+		if (isScene)
+		{
+			run("sphere::hit/" + set.name, n, hitKernel(glassSphere, set), noNodes);
+			run("xz_rect::hit/" + set.name, n, hitKernel(sceneLight, set), noNodes);
+			run("triangle_mesh::hit/" + set.name, n, hitKernel(*glassMesh, set), noNodes);
+
+			run("aabb::hit/" + set.name, n, [&] {
+				size_t hits = 0;
+				for (const ray& r : set.rays)
+					hits += groundBounds.hit(r, 0.001f, INF);
+				return hits;
+			}, [] { return 1.0; });
+
+			run("bvh_node::hit/" + set.name, n, hitKernel(ground, set), [&] {
+				int visits = 0;
+				hit_record rec;
+				for (const ray& r : set.rays)
+					ground.hit_counted(r, 0.001f, INF, rec, &visits);
+				return static_cast<double>(visits) / n;
+			});
+		}
+
+		run("world/" + set.name, n, hitKernel(isScene ? sceneWorld : cornellWorld, set), noNodes);
+	}
+
+	size_t lookups = noiseX.size();
+	run("perlin::noise/scene", lookups, [&] {
+		float sum = 0.0f;
+		for (size_t i = 0; i < lookups; i++)
+			sum += noise.noise(point3(noiseX[i], noiseY[i], noiseZ[i]));
+		g_Sink = g_Sink + sum;
+		return lookups;
+	}, noNodes);
+
+	std::vector<float> values(lookups);
+	run("perlin::noise[batch]/scene", lookups, [&] {
+		noise.noise(noiseX.data(), noiseY.data(), noiseZ.data(), values.data(), lookups);
+		g_Sink = g_Sink + values[lookups / 2];
+		return lookups;
+	}, noNodes);
+
+	run("perlin::turbulence/scene", lookups, [&] {
+		float sum = 0.0f;
+		for (size_t i = 0; i < lookups; i++)
+			sum += noise.turbulence(point3(noiseX[i], noiseY[i], noiseZ[i]));
+		g_Sink = g_Sink + sum;
+		return lookups;
+	}, noNodes);
+
+#if !defined(RT_BENCH_TSC)
+	std::printf("\nNo cycle counter on this platform, cycle columns are 0.\n");
+#endif
+
+	if (!settings.json.empty() && !write_json(settings.json, settings, results))
+		std::cerr << "ERROR: Could not write '" << settings.json << "'.\n";
+
+	if (!settings.compare.empty())
+	{
+		std::vector<bench_result> baseline = read_baseline(settings.compare);
+		if (baseline.empty())
+			std::cerr << "ERROR: No results in '" << settings.compare << "'.\n";
+		else
+			print_comparison(baseline, results);
+	}
+
+	return 0;
+}
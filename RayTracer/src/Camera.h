@@ -15,6 +15,7 @@ public:
 		float theta = degrees_to_radians(vfov);
 		float half_height = tan(theta / 2);
 		float half_width = aspect_ratio * half_height;
+		m_HalfHeight = half_height;
 
 		m_W = unit_vector(lookfrom - lookat);
 		m_U = unit_vector(cross(up, m_W));
@@ -29,16 +30,23 @@ public:
 		m_T1 = t1;
 	}
 
-	ray get_ray(float u, float v) const {
-		vec3 rd = m_LensRadius * random_in_unit_disk();
+	ray get_ray(float u, float v, sampler& s) const {
+		vec3 rd = m_LensRadius * random_in_unit_disk(s);
 		vec3 offset = m_U * rd.x() + v * rd.y();
 
 		return ray(m_Origin + offset,
 			m_Lower_left_corner + u * m_Horizontal + v * m_Vertical - m_Origin - offset, 
-			random_float(m_T0, m_T1)
+			s.next(m_T0, m_T1), s.next_seed()
 		);
 	}
 
+	// Angle between the rays through neighbouring pixels of an image that is
+	// image_height pixels tall, which is how fast a pixel's footprint widens
+	// with distance.
+	float pixel_spread(int image_height) const {
+		return 2.0f * m_HalfHeight / image_height;
+	}
+
 private:
 	point3 m_Origin;
 	point3 m_Lower_left_corner;
@@ -46,6 +54,7 @@ private:
 	vec3 m_Vertical;
 	vec3 m_U, m_V, m_W;
 	float m_LensRadius;
+	float m_HalfHeight; // Of the view plane at distance 1
 	float m_T0, m_T1; // Shutter open/close time
 };
 #endif
\ No newline at end of file
@@ -0,0 +1,360 @@
+#ifndef DISTRIBUTED_H
+#define DISTRIBUTED_H
+
+#include "Renderer.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <deque>
+#include <iostream>
+#include <vector>
+
+#if !defined(_WIN32)
+	#include <poll.h>
+	#include <sys/socket.h>
+	#include <sys/wait.h>
+	#include <unistd.h>
+#endif
+
+// Renders an image with worker processes. The coordinator cuts the image into
+// units, the pixels of a tile for a run of sample indices, and hands them to
+// its workers one at a time over a stream socket. A worker renders its unit
+// and sends back the unit's accumulated sums, which the coordinator adds into
+// the image. Sums of separate sample runs add up to the sum over all of them,
+// which weights every part by the samples it took.
+//
+// Every sample draws from a stream keyed on its pixel and sample index, so a
+// unit comes out the same whichever worker renders it. The coordinator adds
+// the units in a fixed order once all are back, so the image does not depend
+// on the number of workers or on which finished first. With whole tiles as
+// units it is the image a single process renders; splitting the samples of
+// a pixel only changes the order its sums are added in.
+//
+// Local workers are forked after the scene is built and share it read-only
+// with the coordinator. The protocol is plain structs over a byte stream
+// (see serve_units), for workers that run the same binary on the same
+// architecture, so the sockets could as well lead to another machine.
+
+// A part of the image for one worker. Zero samples tells the worker to stop.
+struct render_unit
+{
+	int32_t x0, y0, x1, y1;
+	int32_t firstSample, samples;
+};
+
+struct distributed_settings
+{
+	int workers = 0; // Processes, 0 for one per core
+	int tile_size = 32; // Pixels per side of a unit
+	int samples_per_unit = 0; // Sample indices per unit, 0 for all of a pixel's
+	unsigned threads_per_worker = 1;
+};
+
+namespace distributed
+{
+	// Floats sent back per pixel: the color, then the AOVs if rendered
+	const int s_ColorFloats = 3;
+	const int s_AovFloats = 7;
+
+#if !defined(_WIN32)
+	// Writing to a worker that died fails instead of raising SIGPIPE, which
+	// would end the coordinator. Where send has no flag for it the socket is
+	// set up not to raise it (see no_sigpipe).
+#if defined(MSG_NOSIGNAL)
+	const int s_SendFlags = MSG_NOSIGNAL;
+#else
+	const int s_SendFlags = 0;
+#endif
+
+	inline void no_sigpipe(int fd)
+	{
+#if defined(SO_NOSIGPIPE)
+		int on = 1;
+		setsockopt(fd, SOL_SOCKET, SO_NOSIGPIPE, &on, sizeof(on));
+#endif
+	}
+
+	inline bool write_all(int fd, const void* data, size_t size)
+	{
+		const char* bytes = static_cast<const char*>(data);
+		while (size > 0)
+		{
+			ssize_t written = ::send(fd, bytes, size, s_SendFlags);
+			if (written <= 0)
+				return false;
+			bytes += written;
+			size -= static_cast<size_t>(written);
+		}
+		return true;
+	}
+
+	inline bool read_all(int fd, void* data, size_t size)
+	{
+		char* bytes = static_cast<char*>(data);
+		while (size > 0)
+		{
+			ssize_t received = ::read(fd, bytes, size);
+			if (received <= 0)
+				return false;
+			bytes += received;
+			size -= static_cast<size_t>(received);
+		}
+		return true;
+	}
+#endif
+
+	// The sums of a unit's pixels row by row, as they travel back
+	inline std::vector<float> pack(const framebuffer& image)
+	{
+		int floats = s_ColorFloats + (image.HasAovs() ? s_AovFloats : 0);
+		std::vector<float> data;
+		data.reserve(static_cast<size_t>(image.GetWidth()) * image.GetHeight() * floats);
+
+		for (int y = image.GetY0(); y < image.GetY0() + image.GetHeight(); y++)
+			for (int x = image.GetX0(); x < image.GetX0() + image.GetWidth(); x++)
+			{
+				const color& c = image.at(x, y);
+				data.insert(data.end(), { c.x(), c.y(), c.z() });
+				if (image.HasAovs())
+				{
+					const pixel_aov& a = image.aov_at(x, y);
+					data.insert(data.end(), { a.albedo.x(), a.albedo.y(), a.albedo.z(), a.normal.x(), a.normal.y(), a.normal.z(), a.depth });
+				}
+			}
+		return data;
+	}
+
+	// Adds the sums of unit u, packed as above, into image
+	inline void add(framebuffer& image, const render_unit& u, const float* data)
+	{
+		for (int y = u.y0; y < u.y1; y++)
+			for (int x = u.x0; x < u.x1; x++)
+			{
+				image.at(x, y) += color(data[0], data[1], data[2]);
+				data += s_ColorFloats;
+				if (image.HasAovs())
+				{
+					pixel_aov a;
+					a.albedo = color(data[0], data[1], data[2]);
+					a.normal = vec3(data[3], data[4], data[5]);
+					a.depth = data[6];
+					image.aov_at(x, y).add(a);
+					data += s_AovFloats;
+				}
+			}
+	}
+
+	inline size_t packed_size(const render_unit& u, bool aovs)
+	{
+		return static_cast<size_t>(u.x1 - u.x0) * (u.y1 - u.y0) * (s_ColorFloats + (aovs ? s_AovFloats : 0));
+	}
+
+	// The units of an image, tile by tile in the Renderer's order, with the
+	// sample runs of a tile in increasing order
+	inline std::vector<render_unit> make_units(int width, int height, int samples_per_pixel, const distributed_settings& settings)
+	{
+		int run = settings.samples_per_unit > 0 ? settings.samples_per_unit : samples_per_pixel;
+		Renderer whole(width, height, settings.tile_size);
+		std::vector<render_unit> units;
+		for (const tile& t : whole.GetTiles())
+			for (int s = 0; s < samples_per_pixel; s += run)
+				units.push_back({ t.x0, t.y0, t.x1, t.y1, s, std::min(run, samples_per_pixel - s) });
+		return units;
+	}
+}
+
+#if !defined(_WIN32)
+// The worker side: renders the units read from fd with
+// render_region(renderer, samples) until told to stop, and writes back the
+// packed sums of each. Returns false if the coordinator went away.
+template<typename RenderFn>
+bool serve_units(int fd, bool aovs, unsigned threads, RenderFn&& render_region)
+{
+	render_unit u;
+	while (distributed::read_all(fd, &u, sizeof(u)))
+	{
+		if (u.samples <= 0)
+			return true;
+
+		Renderer renderer(tile{ u.x0, u.y0, u.x1, u.y1 }, u.firstSample, 16, threads);
+		framebuffer part = render_region(renderer, static_cast<int>(u.samples));
+		std::vector<float> data = distributed::pack(part);
+		if (part.HasAovs() != aovs || !distributed::write_all(fd, data.data(), data.size() * sizeof(float)))
+			return false;
+	}
+	return false;
+}
+#endif
+
+// Renders the whole image with local worker processes and returns the sums
+// of samples_per_pixel samples for every pixel, like Renderer::render.
+// render_region(renderer, samples) renders the part of the image a Renderer
+// covers, the same way for a worker as for a single process. Units of workers
+// that die are handed to the others. Without workers, or without fork on
+// Windows, the image is rendered in this process.
+template<typename RenderFn>
+framebuffer render_distributed(int width, int height, int samples_per_pixel, bool aovs, const distributed_settings& settings, RenderFn&& render_region)
+{
+	auto renderHere = [&]() {
+		return render_region(Renderer(width, height), samples_per_pixel);
+	};
+
+#if defined(_WIN32)
+	std::cerr << "Worker processes need fork, rendering in this process.\n";
+	return renderHere();
+#else
+	std::vector<render_unit> units = distributed::make_units(width, height, samples_per_pixel, settings);
+	int workerCount = settings.workers > 0 ? settings.workers : static_cast<int>(default_thread_count());
+	workerCount = std::min<int>(workerCount, static_cast<int>(units.size()));
+
+	struct worker
+	{
+		pid_t pid;
+		int fd;
+		int unit; // In flight, -1 when idle
+	};
+	std::vector<worker> workers;
+
+	std::cout.flush();
+	std::cerr.flush();
+
+	for (int w = 0; w < workerCount; w++)
+	{
+		int fds[2];
+		if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) != 0)
+			break;
+		distributed::no_sigpipe(fds[0]);
+		distributed::no_sigpipe(fds[1]);
+
+		pid_t pid = fork();
+		if (pid < 0)
+		{
+			close(fds[0]);
+			close(fds[1]);
+			break;
+		}
+
+		if (pid == 0)
+		{
+			// The other workers' sockets belong to the coordinator alone
+			for (const worker& other : workers)
+				close(other.fd);
+			close(fds[0]);
+			bool served = serve_units(fds[1], aovs, settings.threads_per_worker, render_region);
+			_exit(served ? 0 : 1);
+		}
+
+		close(fds[1]);
+		workers.push_back({ pid, fds[0], -1 });
+	}
+
+	if (workers.empty())
+	{
+		std::cerr << "Could not start worker processes, rendering in this process.\n";
+		return renderHere();
+	}
+
+	std::deque<int> pending;
+	for (int i = 0; i < static_cast<int>(units.size()); i++)
+		pending.push_back(i);
+
+	std::vector<std::vector<float>> results(units.size());
+	size_t remaining = units.size();
+	size_t alive = workers.size();
+
+	auto retire = [&](worker& w) {
+		// Its unit goes to the next idle worker
+		if (w.unit >= 0)
+			pending.push_front(w.unit);
+		close(w.fd);
+		w.fd = -1;
+		w.unit = -1;
+		alive--;
+	};
+
+	auto dispatch = [&](worker& w) {
+		if (pending.empty())
+			return;
+		w.unit = pending.front();
+		pending.pop_front();
+		if (!distributed::write_all(w.fd, &units[w.unit], sizeof(render_unit)))
+			retire(w);
+	};
+
+	for (worker& w : workers)
+		dispatch(w);
+
+	std::vector<pollfd> polls;
+	while (remaining > 0 && alive > 0)
+	{
+		polls.clear();
+		for (const worker& w : workers)
+			if (w.fd >= 0 && w.unit >= 0)
+				polls.push_back({ w.fd, POLLIN, 0 });
+
+		// Units left over from a worker that died while the others were idle
+		if (polls.empty())
+		{
+			for (worker& w : workers)
+				if (w.fd >= 0 && w.unit < 0)
+					dispatch(w);
+			continue;
+		}
+
+		if (poll(polls.data(), polls.size(), -1) < 0)
+			continue;
+
+		for (const pollfd& p : polls)
+		{
+			if (p.revents == 0)
+				continue;
+
+			worker& w = *std::find_if(workers.begin(), workers.end(), [&](const worker& candidate) { return candidate.fd == p.fd; });
+			std::vector<float>& data = results[w.unit];
+			data.resize(distributed::packed_size(units[w.unit], aovs));
+			if (!distributed::read_all(w.fd, data.data(), data.size() * sizeof(float)))
+			{
+				data.clear();
+				retire(w);
+				continue;
+			}
+
+			w.unit = -1;
+			std::cerr << "\rUnits remaining: " << --remaining << ' ' << std::flush;
+			dispatch(w);
+		}
+	}
+
+	render_unit stop = {};
+	for (worker& w : workers)
+	{
+		if (w.fd >= 0)
+		{
+			distributed::write_all(w.fd, &stop, sizeof(stop));
+			close(w.fd);
+		}
+		waitpid(w.pid, nullptr, 0);
+	}
+
+	if (remaining > 0)
+	{
+		std::cerr << "\nAll workers failed, rendering the rest in this process.\n";
+		for (size_t i = 0; i < units.size(); i++)
+		{
+			if (!results[i].empty())
+				continue;
+			const render_unit& u = units[i];
+			Renderer renderer(tile{ u.x0, u.y0, u.x1, u.y1 }, u.firstSample, 16, settings.threads_per_worker);
+			results[i] = distributed::pack(render_region(renderer, static_cast<int>(u.samples)));
+		}
+	}
+
+	// In unit order, which does not depend on the schedule
+	framebuffer image(width, height, aovs);
+	for (size_t i = 0; i < units.size(); i++)
+		distributed::add(image, units[i], results[i].data());
+	return image;
+#endif
+}
+
+#endif
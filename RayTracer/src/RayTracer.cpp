@@ -1,155 +1,80 @@
 #include "library/math.h"
 #include "library/color.h"
+#include "library/image_output.h"
+#include "library/heatmap.h"
 
-#include "library/hittable_list.h"
-#include "library/sphere.h"
-#include "library/material.h"
-#include "library/bvh.h"
-#include "library/aarect.h"
-#include "library/box.h"
-#include "library/constant_medium.h"
+#include "library/integrator.h"
+#include "library/wavefront.h"
+#include "library/scene_file.h"
 
 #include "Camera.h"
+#include "Renderer.h"
+#include "Distributed.h"
+#include "Scenes.h"
 
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
 #include <iostream>
+#include <string>
 
-color rayColor(const ray& r, const color& background, const hittable& world, int depth) {
-	// If we've exceeded the ray bounce limit, no more light is gathered.
-	if (depth <= 0)
-		return color(0, 0, 0);
-
+color rayColor(const ray& r, const color& background, const hittable& world, const material_table& materials,
+	const light_list* lights, int max_depth, int rr_depth, float spread, sampler& s, pixel_aov* aov = nullptr) {
 	hit_record rec;
-
-	// If the ray hits nothing, return the background color.
-	if (!world.hit(r, 0.001f, INF, rec))
-		return background;
-
-	ray scattered;
-	color attenuation;
-	color emitted = rec.matPtr->emitted(rec.u, rec.v, rec.p);
-
-	if (!rec.matPtr->scatter(r, rec, attenuation, scattered))
-		return emitted;
-
-	return emitted + attenuation * rayColor(scattered, background, world, depth - 1);
-}
-
-hittable_list scene() 
-{
-	hittable_list objects;
-
-	// Ground
-	hittable_list boxes1;
-	auto ground = std::make_shared<lambertian>(std::make_shared<solid_color>(0.48, 0.83, 0.53));
-
-	const int boxes_per_side = 20;
-	for (int i = 0; i < boxes_per_side; i++) {
-		for (int j = 0; j < boxes_per_side; j++) {
-			auto w = 100.0;
-			auto x0 = -1000.0 + i * w;
-			auto z0 = -1000.0 + j * w;
-			auto y0 = 0.0;
-			auto x1 = x0 + w;
-			auto y1 = random_float(1, 101);
-			auto z1 = z0 + w;
-
-			boxes1.add(std::make_shared<box>(point3(x0, y0, z0), point3(x1, y1, z1), ground));
-		}
-	}	
-	objects.add(std::make_shared<bvh_node>(boxes1, 0, 1));
-
-	// Light
-	auto light = std::make_shared<diffuse_light>(std::make_shared<solid_color>(7, 7, 7));
-	objects.add(std::make_shared<xz_rect>(123, 423, 147, 412, 554, light));
-
-	
-	// Moving Sphere
-	auto center1 = point3(400, 400, 200);
-	auto center2 = center1 + vec3(20, 0, 0);
-	auto moving_sphere_material =
-		std::make_shared<lambertian>(std::make_shared<solid_color>(0.7, 0.3, 0.1));
-	objects.add(std::make_shared<moving_sphere>(center1, center2, 0, 1, 50, moving_sphere_material));
-
-	// Metal and Dielectric spheres
-	objects.add(std::make_shared<sphere>(point3(260, 150, 45), 50, std::make_shared<dielectric>(color(1), 1.5)));
-	objects.add(std::make_shared<sphere>(
-		point3(0, 150, 145), 50, std::make_shared<metal>(color(0.8, 0.8, 0.9), 10.0)
-		));
-
-	// Fog Spheres
-	auto boundary = std::make_shared<sphere>(point3(360, 150, 145), 70, std::make_shared<dielectric>(color(1), 1.5));
-	objects.add(boundary);
-	objects.add(std::make_shared<constant_medium>(
-		boundary, 0.2, std::make_shared<solid_color>(0.2, 0.4, 0.9)
-		));
-	boundary = std::make_shared<sphere>(point3(0, 0, 0), 5000, std::make_shared<dielectric>(color(1), 1.5));
-	objects.add(std::make_shared<constant_medium>(
-		boundary, .0001, std::make_shared<solid_color>(1, 1, 1)));
-
-	// Noise Sphere
-	auto pertext = std::make_shared<noise_texture>(0.1);
-	objects.add(std::make_shared<sphere>(point3(220, 280, 300), 80, std::make_shared<lambertian>(pertext)));
-	
-
-	// Box made of Spheres
-	hittable_list boxes2;
-	auto white = std::make_shared<lambertian>(std::make_shared<solid_color>(.73, .73, .73));
-	int ns = 1000;
-	for (int j = 0; j < ns; j++) {
-		boxes2.add(std::make_shared<sphere>(point3::random(0, 165), 10, white));
-	}
-
-	objects.add(std::make_shared<translate>(
-		std::make_shared<rotate_y>(std::make_shared<bvh_node>(boxes2, 0.0, 1.0), 15), vec3(-100, 270, 395))
-	);
-
-	return objects;
-}
-
-hittable_list cornell_box() {
-	hittable_list objects;
-
-	auto red = std::make_shared<lambertian>(std::make_shared<solid_color>(.65, .05, .05));
-	auto white = std::make_shared<lambertian>(std::make_shared<solid_color>(.73, .73, .73));
-	auto green = std::make_shared<lambertian>(std::make_shared<solid_color>(.12, .45, .15));
-	auto light = std::make_shared<diffuse_light>(std::make_shared<solid_color>(7, 7, 7));
-
-	// Room
-	objects.add(std::make_shared<flip_face>(std::make_shared<yz_rect>(0, 555, 0, 555, 555, green)));
-	objects.add(std::make_shared<yz_rect>(0, 555, 0, 555, 0, red));
-	objects.add(std::make_shared<xz_rect>(113, 443, 127, 432, 554, light));
-	objects.add(std::make_shared<flip_face>(std::make_shared<xz_rect>(0, 555, 0, 555, 0, white)));
-	objects.add(std::make_shared<xz_rect>(0, 555, 0, 555, 555, white));
-	objects.add(std::make_shared<flip_face>(std::make_shared<xy_rect>(0, 555, 0, 555, 555, white)));
-
-	// Inside
-	std::shared_ptr<hittable> box1 = std::make_shared<box>(point3(0, 0, 0), point3(165, 330, 165), white);
-	box1 = std::make_shared<rotate_y>(box1, 15);
-	box1 = std::make_shared<translate>(box1, vec3(265, 0, 295));
-
-	std::shared_ptr<hittable> box2 = std::make_shared<box>(point3(0, 0, 0), point3(165, 165, 165), white);
-	box2 = std::make_shared<rotate_y>(box2, -18);
-	box2 = std::make_shared<translate>(box2, vec3(130, 0, 65));
-
-	objects.add(std::make_shared<constant_medium>(box1, 0.01, std::make_shared<solid_color>(0, 0, 0)));
-	objects.add(std::make_shared<constant_medium>(box2, 0.01, std::make_shared<solid_color>(1, 1, 1)));
-
-	return objects;
+	bool found = world.hit(r, 0.001f, INF, rec);
+	return tracePath(r, found, rec, background, world, materials, lights, max_depth, rr_depth, spread, s, aov);
 }
 
 /////////////////////////////////////////////////////////////////////////////////////
 // Main /////////////////////////////////////////////////////////////////////////////
 /////////////////////////////////////////////////////////////////////////////////////
 
-int main()
+int main(int argc, char** argv)
 {
 	const float aspectRatio = 9.0f / 9.0f;
 	const int image_width = 600;
 	const int image_height = static_cast<int>(image_width / aspectRatio);
 	const int samples_per_pixel = 300; // To make the edges not pixelated
 	const int max_depth = 50; // How many times the ray will bounce
-
-	std::cout << "P3\n" << image_width << ' ' << image_height << "\n255\n";
+	const int rr_depth = 3; // Bounces before Russian roulette may end a path
+	bool adaptive = false; // Spend the samples where the pixel error is highest, also set by --adaptive
+	Renderer::adaptive_settings adaptive_settings; // Threshold also set by --adaptive-threshold
+	const bool use_packets = true; // Trace camera rays in packets of neighbouring pixels
+	const bool sample_lights = true; // Next event estimation towards the scene's lights
+	bool wavefront = false; // Trace batches of paths a bounce at a time, also set by --wavefront
+	int workers = -1; // Worker processes rendering tiles, 0 for one per core, -1 for none, also set by --workers
+	const int samples_per_unit = 0; // Samples of a tile a worker renders at once, 0 for all of them
+	const int wavefront_batch = 4096; // Paths per wavefront batch
+	const std::string output_path = "image.ppm"; // .ppm, .pfm or .exr
+	const bool write_aovs = false; // Albedo, normal and depth channels, written to .exr only
+	const std::string stats_path = "stats.json"; // Render counters, written when built with RT_ENABLE_STATS
+	std::string heatmap_path; // Set by --heatmap, cost per pixel, .ppm in false color, needs RT_ENABLE_STATS
+	RT_STAT(const cost_heatmap::quantity heatmap_quantity = cost_heatmap::nodes); // BVH nodes visited or time spent
+
+	std::string scene_path; // Set by --scene, a .scene text file or one compiled from it
+	std::string mesh_path; // Set by --mesh, an OBJ file shown in the Cornell room
+
+	for (int a = 1; a < argc; a++)
+	{
+		if (std::strcmp(argv[a], "--wavefront") == 0)
+			wavefront = true;
+		else if (std::strcmp(argv[a], "--adaptive") == 0)
+			adaptive = true;
+		else if (std::strcmp(argv[a], "--adaptive-threshold") == 0 && a + 1 < argc)
+			adaptive_settings.threshold = static_cast<float>(std::atof(argv[++a]));
+		else if (std::strcmp(argv[a], "--workers") == 0 && a + 1 < argc)
+			workers = std::atoi(argv[++a]);
+		else if (std::strcmp(argv[a], "--scene") == 0 && a + 1 < argc)
+			scene_path = argv[++a];
+		else if (std::strcmp(argv[a], "--mesh") == 0 && a + 1 < argc)
+			mesh_path = argv[++a];
+		else if (std::strcmp(argv[a], "--heatmap") == 0 && a + 1 < argc)
+			heatmap_path = argv[++a];
+		else if (std::strcmp(argv[a], "--tile-cache") == 0 && a + 1 < argc)
+			tiled_image::SetCacheDirectory(argv[++a]);
+		else if (std::strcmp(argv[a], "--compile") == 0 && a + 2 < argc)
+			return compile_scene_file(argv[a + 1], argv[a + 2]) ? 0 : 1;
+	}
 
 	point3 lookfrom(478, 278, -600);
 	point3 lookat(278, 278, 0);
@@ -158,29 +83,176 @@ int main()
 	auto aperture = 0.0;
 	auto vfov = 40.0;
 
+	color background(0, 0, 0);
+	scene_arena arena; // Declared first so it goes last
+	material_table materials;
+	light_list lights;
+	hittable_list world;
+
+	if (!mesh_path.empty())
+	{
+		if (!cornell_mesh(arena, materials, lights, mesh_path, world))
+			return 1;
+		lookfrom = point3(278, 278, -800);
+	}
+	else if (scene_path.empty())
+	{
+		world = scene(arena, materials, lights);
+		arena.report(std::cerr);
+	}
+	else
+	{
+		auto file = arena.make<compiled_scene>();
+		if (!file->open(scene_path, materials, lights))
+			return 1;
+		world.add(file);
+		background = file->GetBackground();
+
+		if (file->has_camera())
+		{
+			scene_camera c = file->GetCamera();
+			lookfrom = c.lookfrom;
+			lookat = c.lookat;
+			vup = c.vup;
+			vfov = c.vfov;
+			aperture = c.aperture;
+			dist_to_focus = c.focus;
+		}
+		std::cerr << "Scene: " << file->size() << " primitives from " << scene_path << '\n';
+	}
+
 	Camera camera(lookfrom, lookat, vup, vfov, aspectRatio, aperture, dist_to_focus, 0.0, 1.0);
+	const float spread = camera.pixel_spread(image_height);
+	const light_list* sampledLights = sample_lights ? &lights : nullptr;
 
-	const color background(0, 0, 0);
-	hittable_list world = scene();
+	Renderer renderer(image_width, image_height);
+	framebuffer image(image_width, image_height);
+	bool aovs = write_aovs && image_output::ends_with(output_path, ".exr");
 
-	for (int j = image_height - 1; j >= 0; --j) 
+	// Generate a jittered ray through pixel (i, j). Every random number of the
+	// sample comes from a stream keyed on the pixel and sample index, which is
+	// left in stream for the rest of the path.
+	auto cameraRay = [&](int i, int j, int s, sampler& stream)
 	{
-		std::cerr << "\rScanlines remaining: " << j << ' ' << std::flush;
-		for (int i = 0; i < image_width; ++i)
-		{
-			// Iterate through each pixel and generate a ray
-			color pixelColor(0.0f, 0.0f, 0.0f);
+		stream = sampler(j * image_width + i, s);
+		float u = float(i + stream.next()) / (image_width - 1.0f);
+		float v = float(j + stream.next()) / (image_height - 1.0f);
+		return camera.get_ray(u, v, stream);
+	};
 
-			for (int s = 0; s < samples_per_pixel; s++) 
-			{
-				float u = float(i + random_float()) / (image_width - 1.0f);
-				float v = float(j + random_float()) / (image_height - 1.0f);
-				ray r = camera.get_ray(u, v);
-				pixelColor += rayColor(r, background, world, max_depth);
-			}
+	RT_STAT(cost_heatmap heatmap(image_width, image_height, heatmap_quantity));
+	RT_STAT(cost_heatmap* pixelCost = heatmap_path.empty() ? nullptr : &heatmap);
 
-			writeColor(std::cout, pixelColor, samples_per_pixel);
+	auto samplePixel = [&](int i, int j, int s, pixel_aov* aov)
+	{
+		RT_STAT(cost_heatmap::meter cost(pixelCost));
+		sampler sampler;
+		ray r = cameraRay(i, j, s, sampler);
+		color c = rayColor(r, background, world, materials, sampledLights, max_depth, rr_depth, spread, sampler, aov);
+		RT_STAT(if (pixelCost) pixelCost->add(i, j, cost.elapsed()));
+		return c;
+	};
+
+	int output_samples = samples_per_pixel;
+
+	// Renders the part of the image a renderer covers, in any of the modes
+	// below. Worker processes call it for their units as well.
+	auto renderRegion = [&](const Renderer& region, int samples)
+	{
+		if (wavefront)
+		{
+			// The same paths as below, traced a bounce at a time over batches of
+			// samples with the shading of each bounce grouped by material.
+			return region.render_wavefront(samples, aovs, wavefront_batch, [&](const Renderer::path_sample* paths, size_t count, color* out, pixel_aov* outAovs)
+			{
+				wavefront_integrator integrator(world, materials, sampledLights, background, max_depth, rr_depth, spread);
+				integrator.trace(count, [&](size_t k, sampler& stream) { return cameraRay(paths[k].x, paths[k].y, paths[k].s, stream); }, out, outAovs);
+			});
 		}
+		else if (use_packets)
+		{
+			// Camera rays of a pixel block share one traversal of the scene, the
+			// paths continue one ray at a time after the first hit.
+			return region.render_blocks(samples, aovs, [&](const int* xs, const int* ys, int count, int s, color* out, pixel_aov* outAovs)
+			{
+				sampler samplers[ray_packet::s_Size];
+				ray_packet packet;
+				packet.count = count;
+				float t_max[ray_packet::s_Size];
+				std::fill_n(t_max, ray_packet::s_Size, INF);
+				hit_record recs[ray_packet::s_Size];
+
+				for (int k = 0; k < count; k++)
+					packet.rays[k] = cameraRay(xs[k], ys[k], s, samplers[k]);
+
+				// The packet's traversal is shared evenly by its pixels
+				RT_STAT(cost_heatmap::meter packetCost(pixelCost));
+				int hits = world.hit_packet(packet, packet.mask(), 0.001f, t_max, recs);
+				RT_STAT(double shared = packetCost.elapsed() / count);
+
+				for (int k = 0; k < count; k++)
+				{
+					RT_STAT(cost_heatmap::meter cost(pixelCost));
+					bool found = (hits & (1 << k)) != 0;
+					out[k] = tracePath(packet.rays[k], found, recs[k], background, world, materials, sampledLights, max_depth, rr_depth, spread, samplers[k],
+						outAovs ? &outAovs[k] : nullptr);
+					RT_STAT(if (pixelCost) pixelCost->add(xs[k], ys[k], shared + cost.elapsed()));
+				}
+			});
+		}
+		return region.render(samples, aovs, samplePixel);
+	};
+
+	if (adaptive)
+	{
+		// Pixels sample at different rates, so they are traced one at a time
+		Renderer::adaptive_report report;
+		image = renderer.render_adaptive(samples_per_pixel, aovs, adaptive_settings, samplePixel, &report);
+		output_samples = 1; // The image already holds averages
+
+		std::cerr << "\nAdaptive: " << report.rounds << " rounds, " << report.average_samples << " spp on average, "
+			<< "error mean " << report.mean_error << " max " << report.max_error << ", "
+			<< report.converged << " of " << image_width * image_height << " pixels converged";
+	}
+	else if (workers >= 0)
+	{
+		// Statistics and heatmaps are counted in the workers and not gathered
+		distributed_settings settings;
+		settings.workers = workers;
+		settings.samples_per_unit = samples_per_unit;
+		image = render_distributed(image_width, image_height, samples_per_pixel, aovs, settings, renderRegion);
+	}
+	else
+	{
+		image = renderRegion(renderer, samples_per_pixel);
+	}
+
+	if (!write_image(output_path, image, output_samples))
+	{
+		std::cerr << "\nCould not write " << output_path << ".\n";
+		return 1;
+	}
+
+#if defined(RT_ENABLE_STATS)
+	// Worker processes count into their own copies, which are not sent back
+	bool in_workers = !adaptive && workers >= 0;
+	if (in_workers)
+		std::cerr << "\nNo statistics or heatmap for renders in worker processes.";
+	else if (!render_stats::total().write_json(stats_path))
+		std::cerr << "\nCould not write " << stats_path << ".\n";
+
+	// Paths of a wavefront batch share their traversals, so they are not
+	// attributed to pixels
+	if (pixelCost && !in_workers)
+	{
+		if (wavefront)
+			std::cerr << "\nNo heatmap for wavefront renders.";
+		else if (!heatmap.write(heatmap_path))
+			std::cerr << "\nCould not write " << heatmap_path << ".\n";
 	}
+#else
+	if (!heatmap_path.empty())
+		std::cerr << "\nNo heatmap without RT_ENABLE_STATS.";
+#endif
 	std::cerr << "\nDone.\n";
 }
\ No newline at end of file
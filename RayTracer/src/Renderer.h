@@ -0,0 +1,440 @@
+#ifndef RENDERER_H
+#define RENDERER_H
+
+#include "library/framebuffer.h"
+#include "library/parallel.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <iostream>
+#include <mutex>
+#include <vector>
+
+struct tile {
+	int x0, y0; // Inclusive
+	int x1, y1; // Exclusive
+};
+
+// Interleaves the bits of x and y so that sorting by the result walks tiles
+// along a Z-order curve.
+inline uint32_t morton_2d(uint32_t x, uint32_t y)
+{
+	auto spread = [](uint32_t v) {
+		v &= 0x0000ffff;
+		v = (v | (v << 8)) & 0x00ff00ff;
+		v = (v | (v << 4)) & 0x0f0f0f0f;
+		v = (v | (v << 2)) & 0x33333333;
+		v = (v | (v << 1)) & 0x55555555;
+		return v;
+	};
+	return spread(x) | (spread(y) << 1);
+}
+
+class Renderer {
+public:
+	Renderer(int width, int height, int tile_size = 16, unsigned threads = 0)
+		: Renderer(tile{ 0, 0, width, height }, 0, tile_size, threads)
+	{
+		m_Progress = true;
+	}
+
+	// Renders only the pixels of region, and numbers the samples of every
+	// pixel from first_sample on, so a part of an image rendered here adds up
+	// with the rest rendered elsewhere. Framebuffers cover just the region.
+	// Progress is not reported.
+	Renderer(const tile& region, int first_sample, int tile_size = 16, unsigned threads = 0)
+		: m_Region(region), m_Width(region.x1 - region.x0), m_Height(region.y1 - region.y0), m_FirstSample(first_sample), m_Threads(threads)
+	{
+		int tiles_x = (m_Width + tile_size - 1) / tile_size;
+		int tiles_y = (m_Height + tile_size - 1) / tile_size;
+
+		for (int ty = 0; ty < tiles_y; ty++)
+			for (int tx = 0; tx < tiles_x; tx++)
+			{
+				tile t;
+				t.x0 = region.x0 + tx * tile_size;
+				t.y0 = region.y0 + ty * tile_size;
+				t.x1 = std::min(t.x0 + tile_size, region.x1);
+				t.y1 = std::min(t.y0 + tile_size, region.y1);
+				m_Tiles.push_back(t);
+			}
+
+		// Neighbouring tiles in Z-order see mostly the same geometry, so keeping
+		// them on one worker keeps its caches warm.
+		std::sort(m_Tiles.begin(), m_Tiles.end(), [tile_size, region](const tile& a, const tile& b) {
+			return morton_2d((a.x0 - region.x0) / tile_size, (a.y0 - region.y0) / tile_size)
+				< morton_2d((b.x0 - region.x0) / tile_size, (b.y0 - region.y0) / tile_size);
+		});
+	}
+
+	// Calls sample(i, j, s, aov) for every pixel and sample index and accumulates
+	// the returned colors. With aovs set, aov points at a record the sample
+	// fills in for its first hit, otherwise it is null. Pixels are only ever
+	// touched by the worker owning the tile.
+	template<typename SampleFn>
+	framebuffer render(int samples_per_pixel, bool aovs, SampleFn&& sample) const
+	{
+		framebuffer image = make_framebuffer(aovs);
+
+		for_each_tile([&](const tile& t)
+		{
+			for (int j = t.y0; j < t.y1; ++j)
+				for (int i = t.x0; i < t.x1; ++i)
+				{
+					color pixelColor(0.0f, 0.0f, 0.0f);
+					pixel_aov pixelAov;
+
+					for (int s = m_FirstSample; s < m_FirstSample + samples_per_pixel; s++)
+					{
+						pixel_aov sampleAov;
+						pixelColor += sample(i, j, s, aovs ? &sampleAov : nullptr);
+						if (aovs)
+							pixelAov.add(sampleAov);
+					}
+
+					image.at(i, j) = pixelColor;
+					if (aovs)
+						image.aov_at(i, j) = pixelAov;
+				}
+		});
+
+		return image;
+	}
+
+	// Like render, but walks each tile in blocks of s_BlockWidth x s_BlockHeight
+	// pixels and calls sample_block(xs, ys, count, s, out, aovs) once per block
+	// and sample index, so the block's rays can be traced as one packet. aovs is
+	// an array of count records, or null.
+	static const int s_BlockWidth = 4;
+	static const int s_BlockHeight = 2;
+
+	template<typename BlockFn>
+	framebuffer render_blocks(int samples_per_pixel, bool aovs, BlockFn&& sample_block) const
+	{
+		framebuffer image = make_framebuffer(aovs);
+
+		for_each_tile([&](const tile& t)
+		{
+			const int blockSize = s_BlockWidth * s_BlockHeight;
+			int xs[blockSize];
+			int ys[blockSize];
+			color samples[blockSize];
+			pixel_aov sampleAovs[blockSize];
+
+			for (int by = t.y0; by < t.y1; by += s_BlockHeight)
+				for (int bx = t.x0; bx < t.x1; bx += s_BlockWidth)
+				{
+					int count = 0;
+					for (int j = by; j < std::min(by + s_BlockHeight, t.y1); ++j)
+						for (int i = bx; i < std::min(bx + s_BlockWidth, t.x1); ++i)
+						{
+							xs[count] = i;
+							ys[count] = j;
+							image.at(i, j) = color(0.0f, 0.0f, 0.0f);
+							count++;
+						}
+
+					for (int s = m_FirstSample; s < m_FirstSample + samples_per_pixel; s++)
+					{
+						if (aovs)
+							std::fill_n(sampleAovs, count, pixel_aov());
+
+						sample_block(xs, ys, count, s, samples, aovs ? sampleAovs : nullptr);
+						for (int k = 0; k < count; k++)
+						{
+							image.at(xs[k], ys[k]) += samples[k];
+							if (aovs)
+								image.aov_at(xs[k], ys[k]).add(sampleAovs[k]);
+						}
+					}
+				}
+		});
+
+		return image;
+	}
+
+	// A pixel sample inside a batch of render_wavefront
+	struct path_sample
+	{
+		int x, y;
+		int s;
+	};
+
+	// Like render, but hands the samples of each tile to
+	// trace_batch(samples, count, out, aovs) in batches of about batch_size, to
+	// be traced together. A batch holds every pixel of the tile for a range of
+	// sample indices, and results are accumulated in sample order, so the sums
+	// are the same as render's.
+	template<typename BatchFn>
+	framebuffer render_wavefront(int samples_per_pixel, bool aovs, int batch_size, BatchFn&& trace_batch) const
+	{
+		framebuffer image = make_framebuffer(aovs);
+
+		for_each_tile([&](const tile& t)
+		{
+			int pixels = (t.x1 - t.x0) * (t.y1 - t.y0);
+			int samplesPerBatch = std::max(1, batch_size / pixels);
+
+			std::vector<path_sample> batch;
+			std::vector<color> samples;
+			std::vector<pixel_aov> sampleAovs;
+
+			int end = m_FirstSample + samples_per_pixel;
+			for (int s0 = m_FirstSample; s0 < end; s0 += samplesPerBatch)
+			{
+				batch.clear();
+				for (int s = s0; s < std::min(s0 + samplesPerBatch, end); s++)
+					for (int j = t.y0; j < t.y1; ++j)
+						for (int i = t.x0; i < t.x1; ++i)
+							batch.push_back({ i, j, s });
+
+				samples.resize(batch.size());
+				if (aovs)
+					sampleAovs.assign(batch.size(), pixel_aov());
+
+				trace_batch(batch.data(), batch.size(), samples.data(), aovs ? sampleAovs.data() : nullptr);
+
+				for (size_t k = 0; k < batch.size(); k++)
+				{
+					image.at(batch[k].x, batch[k].y) += samples[k];
+					if (aovs)
+						image.aov_at(batch[k].x, batch[k].y).add(sampleAovs[k]);
+				}
+			}
+		});
+
+		return image;
+	}
+
+	// Settings of render_adaptive. A pixel stops once the standard error of its
+	// mean falls below threshold, measured after the approximate gamma of the
+	// output so dark and bright regions are held to the same visible noise.
+	struct adaptive_settings
+	{
+		int min_samples = 16; // Taken by every pixel before its error is trusted
+		int batch = 16; // Samples per selected pixel and round
+		float fraction = 0.5f; // Share of the active pixels, highest error first, sampled per round
+		int max_samples = 1024;
+		float threshold = 0.01f; // Standard error of the displayed value, 1.0 = white
+	};
+
+	static constexpr float s_PriorSamples = 4.0f;
+
+	struct adaptive_report
+	{
+		double average_samples = 0.0;
+		double mean_error = 0.0;
+		double max_error = 0.0;
+		size_t converged = 0; // Pixels that stopped below the threshold
+		int rounds = 0;
+	};
+
+	// Renders in rounds and only keeps sampling pixels whose error estimate is
+	// above the threshold, never spending more than samples_per_pixel on average.
+	// After the first round only the worst settings.fraction of the remaining
+	// pixels is sampled each round. The sample indices of a pixel are consecutive
+	// and all decisions are made between rounds or within a tile, so the image
+	// does not depend on the thread count.
+	// Unlike render, the returned framebuffer holds averages, not sums, so the
+	// regions of an image can be rendered apart but not the samples of a pixel.
+	// The samples of every pixel are still numbered from first_sample on.
+	template<typename SampleFn>
+	framebuffer render_adaptive(int samples_per_pixel, bool aovs, const adaptive_settings& settings,
+		SampleFn&& sample, adaptive_report* report = nullptr) const
+	{
+		framebuffer image = make_framebuffer(aovs);
+
+		// Welford running mean and variance of the luminance of every pixel
+		size_t pixels = static_cast<size_t>(m_Width) * m_Height;
+		std::vector<int> counts(pixels, 0);
+		std::vector<float> means(pixels, 0.0f);
+		std::vector<float> m2s(pixels, 0.0f);
+		std::vector<float> errors(pixels, INF);
+		std::vector<uint8_t> active(pixels, 1);
+
+		// Pixels sampled in the current round
+		std::vector<uint8_t> selected(pixels, 1);
+		std::vector<float> activeErrors;
+
+		// The last round is shortened so the total stays within the budget
+		const double budget = static_cast<double>(samples_per_pixel) * pixels;
+		double spent = 0.0;
+		size_t remaining = pixels;
+		int rounds = 0;
+
+		while (remaining > 0)
+		{
+			size_t selectedCount = remaining;
+			if (rounds > 0)
+			{
+				// Only the active pixels with the largest errors take part, so the
+				// budget keeps moving to where the image is worst.
+				activeErrors.clear();
+				for (size_t p = 0; p < pixels; p++)
+					if (active[p])
+						activeErrors.push_back(errors[p]);
+
+				size_t rank = static_cast<size_t>((1.0f - settings.fraction) * activeErrors.size());
+				rank = std::min(rank, activeErrors.size() - 1);
+				std::nth_element(activeErrors.begin(), activeErrors.begin() + rank, activeErrors.end());
+				float cutoff = activeErrors[rank];
+
+				selectedCount = 0;
+				for (size_t p = 0; p < pixels; p++)
+				{
+					selected[p] = active[p] && errors[p] >= cutoff;
+					selectedCount += selected[p];
+				}
+			}
+
+			int batch = rounds == 0 ? settings.min_samples : settings.batch;
+			batch = static_cast<int>(std::min<double>(batch, (budget - spent) / selectedCount));
+			if (batch <= 0)
+				break;
+
+			parallel_for(m_Tiles.size(), m_Threads, [&](size_t index)
+			{
+				const tile& t = m_Tiles[index];
+				for (int j = t.y0; j < t.y1; ++j)
+					for (int i = t.x0; i < t.x1; ++i)
+					{
+						size_t p = pixel_index(i, j);
+						if (!selected[p])
+							continue;
+
+						int end = std::min(counts[p] + batch, settings.max_samples);
+						for (int s = counts[p]; s < end; s++)
+						{
+							pixel_aov sampleAov;
+							color c = sample(i, j, m_FirstSample + s, aovs ? &sampleAov : nullptr);
+							image.at(i, j) += c;
+							if (aovs)
+								image.aov_at(i, j).add(sampleAov);
+
+							float luminance = 0.2126f * c.x() + 0.7152f * c.y() + 0.0722f * c.z();
+							int n = ++counts[p];
+							float delta = luminance - means[p];
+							means[p] += delta / n;
+							m2s[p] += delta * (luminance - means[p]);
+						}
+					}
+
+				// Rare paths, like the ones reaching a small light through fog, can
+				// leave a pixel with identical samples and no variance at all. The
+				// pooled variance of the tile sees far more samples and is mixed in
+				// as s_PriorSamples extra samples, which matters less as n grows.
+				float tileVariance = 0.0f;
+				int sampled = 0;
+				for (int j = t.y0; j < t.y1; ++j)
+					for (int i = t.x0; i < t.x1; ++i)
+					{
+						size_t p = pixel_index(i, j);
+						if (counts[p] >= 2)
+						{
+							tileVariance += m2s[p] / (counts[p] - 1);
+							sampled++;
+						}
+					}
+				tileVariance = sampled > 0 ? tileVariance / sampled : 0.0f;
+
+				for (int j = t.y0; j < t.y1; ++j)
+					for (int i = t.x0; i < t.x1; ++i)
+					{
+						size_t p = pixel_index(i, j);
+						if (!active[p] || counts[p] < 2)
+							continue;
+
+						// The output maps x to sqrt(x), so an error e of the mean shows up
+						// as e / (2 sqrt(mean)). Dark pixels are clamped to avoid dividing by 0.
+						float variance = (m2s[p] + s_PriorSamples * tileVariance) / (counts[p] - 1 + s_PriorSamples);
+						float standardError = sqrt(variance / counts[p]);
+						errors[p] = standardError / (2.0f * sqrt(fmax(means[p], 1e-3f)));
+
+						if (counts[p] >= settings.max_samples || errors[p] < settings.threshold)
+							active[p] = 0;
+					}
+			});
+
+			spent = 0.0;
+			for (int n : counts)
+				spent += n;
+			remaining = std::count(active.begin(), active.end(), 1);
+			rounds++;
+
+			std::cerr << "\rRound " << rounds << ", pixels remaining: " << remaining << ' ' << std::flush;
+		}
+
+		adaptive_report result;
+		result.rounds = rounds;
+		for (size_t p = 0; p < pixels; p++)
+		{
+			int x = m_Region.x0 + static_cast<int>(p % m_Width);
+			int y = m_Region.y0 + static_cast<int>(p / m_Width);
+			float scale = counts[p] > 0 ? 1.0f / counts[p] : 0.0f;
+			image.at(x, y) *= scale;
+			if (aovs)
+			{
+				image.aov_at(x, y).albedo *= scale;
+				image.aov_at(x, y).normal *= scale;
+			}
+
+			double e = std::min(errors[p], 1.0f);
+			result.average_samples += counts[p];
+			result.mean_error += e;
+			result.max_error = std::max(result.max_error, e);
+			if (e < settings.threshold)
+				result.converged++;
+		}
+		result.average_samples /= pixels;
+		result.mean_error /= pixels;
+
+		if (report)
+			*report = result;
+
+		return image;
+	}
+
+	const std::vector<tile>& GetTiles() const { return m_Tiles; }
+	const tile& GetRegion() const { return m_Region; }
+	int GetFirstSample() const { return m_FirstSample; }
+
+private:
+	framebuffer make_framebuffer(bool aovs) const
+	{
+		return framebuffer(m_Width, m_Height, aovs, m_Region.x0, m_Region.y0);
+	}
+
+	// Index of pixel (i, j) of the image within the region
+	size_t pixel_index(int i, int j) const
+	{
+		return static_cast<size_t>(j - m_Region.y0) * m_Width + (i - m_Region.x0);
+	}
+
+	template<typename TileFn>
+	void for_each_tile(TileFn&& render_tile) const
+	{
+		std::atomic<size_t> remaining(m_Tiles.size());
+		std::mutex progress;
+
+		parallel_for(m_Tiles.size(), m_Threads, [&](size_t index)
+		{
+			render_tile(m_Tiles[index]);
+
+			size_t left = --remaining;
+			if (!m_Progress)
+				return;
+			std::lock_guard<std::mutex> lock(progress);
+			std::cerr << "\rTiles remaining: " << left << ' ' << std::flush;
+		});
+	}
+
+	tile m_Region;
+	int m_Width, m_Height;
+	int m_FirstSample;
+	unsigned m_Threads;
+	bool m_Progress = false;
+	std::vector<tile> m_Tiles;
+};
+
+#endif
@@ -0,0 +1,219 @@
+#pragma once
+
+#ifndef SCENES_H
+#define SCENES_H
+
+#include "library/math.h"
+#include "library/arena.h"
+
+#include "library/hittable_list.h"
+#include "library/sphere.h"
+#include "library/sphere_set.h"
+#include "library/material.h"
+#include "library/bvh.h"
+#include "library/aarect.h"
+#include "library/box.h"
+#include "library/instance.h"
+#include "library/tlas.h"
+#include "library/constant_medium.h"
+#include "library/light_list.h"
+#include "library/triangle_mesh.h"
+
+#include <string>
+
+// The field of boxes of random height the main scene stands on
+inline hittable_list ground_boxes(scene_arena& arena, material_id ground)
+{
+	hittable_list boxes;
+
+	const int boxes_per_side = 20;
+	for (int i = 0; i < boxes_per_side; i++) {
+		for (int j = 0; j < boxes_per_side; j++) {
+			auto w = 100.0;
+			auto x0 = -1000.0 + i * w;
+			auto z0 = -1000.0 + j * w;
+			auto y0 = 0.0;
+			auto x1 = x0 + w;
+			auto y1 = random_float(1, 101);
+			auto z1 = z0 + w;
+
+			boxes.add(arena.make<box>(point3(x0, y0, z0), point3(x1, y1, z1), ground));
+		}
+	}
+
+	return boxes;
+}
+
+// The scenes add their materials and textures to the given table and return
+// geometry referring to them by id. Emissive shapes are also added to lights.
+// Everything they make lives in the arena, which has to outlive the scene.
+inline hittable_list scene(scene_arena& arena, material_table& materials, light_list& lights)
+{
+	hittable_list objects;
+
+	// Ground
+	auto ground = materials.add(arena.make<lambertian>(materials.add_texture(arena.make<solid_color>(0.48, 0.83, 0.53))));
+	hittable_list boxes1 = ground_boxes(arena, ground);
+	objects.add(arena.make<bvh_node>(boxes1, 0, 1));
+
+	// Light
+	auto light = materials.add(arena.make<diffuse_light>(materials.add_texture(arena.make<solid_color>(7, 7, 7))));
+	auto lightRect = arena.make<xz_rect>(123, 423, 147, 412, 554, light);
+	objects.add(lightRect);
+	lights.add(lightRect);
+
+	
+	// Moving Sphere
+	auto center1 = point3(400, 400, 200);
+	auto center2 = center1 + vec3(20, 0, 0);
+	auto moving_sphere_material =
+		materials.add(arena.make<lambertian>(materials.add_texture(arena.make<solid_color>(0.7, 0.3, 0.1))));
+	objects.add(arena.make<moving_sphere>(center1, center2, 0, 1, 50, moving_sphere_material));
+
+	// Metal and Dielectric spheres
+	auto glass = materials.add(arena.make<dielectric>(color(1), 1.5));
+	objects.add(arena.make<sphere>(point3(260, 150, 45), 50, glass));
+	objects.add(arena.make<sphere>(
+		point3(0, 150, 145), 50, materials.add(arena.make<metal>(color(0.8, 0.8, 0.9), 10.0))
+		));
+
+	// Fog Spheres
+	auto boundary = arena.make<sphere>(point3(360, 150, 145), 70, glass);
+	objects.add(boundary);
+	objects.add(arena.make<constant_medium>(
+		boundary, 0.2, materials.add(arena.make<isotropic>(materials.add_texture(arena.make<solid_color>(0.2, 0.4, 0.9))))
+		));
+	boundary = arena.make<sphere>(point3(0, 0, 0), 5000, glass);
+	objects.add(arena.make<constant_medium>(
+		boundary, .0001, materials.add(arena.make<isotropic>(materials.add_texture(arena.make<solid_color>(1, 1, 1))))));
+
+	// Noise Sphere
+	auto pertext = materials.add_texture(arena.make<noise_texture>(0.1));
+	objects.add(arena.make<sphere>(point3(220, 280, 300), 80, materials.add(arena.make<lambertian>(pertext))));
+	
+
+	// Box made of Spheres
+	auto boxes2 = arena.make<sphere_set>();
+	auto white = materials.add(arena.make<lambertian>(materials.add_texture(arena.make<solid_color>(.73, .73, .73))));
+	int ns = 1000;
+	for (int j = 0; j < ns; j++) {
+		boxes2->add(point3::random(0, 165), 10, white);
+	}
+	boxes2->build();
+
+	// The cluster is shared geometry, placed through the top level structure
+	auto cluster = arena.make<tlas>();
+	cluster->add(boxes2, affine_transform::translation(vec3(-100, 270, 395)) * affine_transform::rotation_y(15));
+	cluster->build();
+	objects.add(cluster);
+
+	return objects;
+}
+
+// The walls and light of the Cornell box, added to objects. Returns the
+// white of the walls for what stands in the room.
+inline material_id cornell_room(scene_arena& arena, material_table& materials, light_list& lights, hittable_list& objects)
+{
+	auto red = materials.add(arena.make<lambertian>(materials.add_texture(arena.make<solid_color>(.65, .05, .05))));
+	auto white = materials.add(arena.make<lambertian>(materials.add_texture(arena.make<solid_color>(.73, .73, .73))));
+	auto green = materials.add(arena.make<lambertian>(materials.add_texture(arena.make<solid_color>(.12, .45, .15))));
+	auto light = materials.add(arena.make<diffuse_light>(materials.add_texture(arena.make<solid_color>(7, 7, 7))));
+
+	objects.add(arena.make<flip_face>(arena.make<yz_rect>(0, 555, 0, 555, 555, green)));
+	objects.add(arena.make<yz_rect>(0, 555, 0, 555, 0, red));
+	auto lightRect = arena.make<xz_rect>(113, 443, 127, 432, 554, light);
+	objects.add(lightRect);
+	lights.add(lightRect);
+	objects.add(arena.make<flip_face>(arena.make<xz_rect>(0, 555, 0, 555, 0, white)));
+	objects.add(arena.make<xz_rect>(0, 555, 0, 555, 555, white));
+	objects.add(arena.make<flip_face>(arena.make<xy_rect>(0, 555, 0, 555, 555, white)));
+
+	return white;
+}
+
+inline hittable_list cornell_box(scene_arena& arena, material_table& materials, light_list& lights) {
+	hittable_list objects;
+	auto white = cornell_room(arena, materials, lights, objects);
+
+	// Inside
+	std::shared_ptr<hittable> box1 = arena.make<box>(point3(0, 0, 0), point3(165, 330, 165), white);
+	box1 = arena.make<rotate_y>(box1, 15);
+	box1 = arena.make<translate>(box1, vec3(265, 0, 295));
+
+	std::shared_ptr<hittable> box2 = arena.make<box>(point3(0, 0, 0), point3(165, 165, 165), white);
+	box2 = arena.make<rotate_y>(box2, -18);
+	box2 = arena.make<translate>(box2, vec3(130, 0, 65));
+
+	auto black_smoke = materials.add(arena.make<isotropic>(materials.add_texture(arena.make<solid_color>(0, 0, 0))));
+	auto white_smoke = materials.add(arena.make<isotropic>(materials.add_texture(arena.make<solid_color>(1, 1, 1))));
+	objects.add(arena.make<constant_medium>(box1, 0.01, black_smoke));
+	objects.add(arena.make<constant_medium>(box2, 0.01, white_smoke));
+
+	return objects;
+}
+
+// A sphere tessellated into rings and segments, with smooth normals and
+// texture coords around its y axis, for when a mesh is needed without a file
+inline std::shared_ptr<triangle_mesh> sphere_mesh(scene_arena& arena, const point3& center, float radius, int rings, int segments, material_id material)
+{
+	auto mesh = arena.make<triangle_mesh>(material);
+	for (int i = 0; i <= rings; i++)
+	{
+		for (int j = 0; j <= segments; j++)
+		{
+			// The seam repeats its vertices so u can run from 0 to 1
+			float theta = PI * i / rings;
+			float phi = 2 * PI * j / segments;
+			vec3 n(-cos(phi) * sin(theta), -cos(theta), sin(phi) * sin(theta));
+			mesh->add_vertex(center + radius * n);
+			mesh->add_normal(n);
+			mesh->add_uv(float(j) / segments, 1.0f - float(i) / rings);
+		}
+	}
+
+	for (int i = 0; i < rings; i++)
+	{
+		for (int j = 0; j < segments; j++)
+		{
+			uint32_t a = i * (segments + 1) + j, b = a + 1, c = a + segments + 1, d = c + 1;
+			if (i > 0)
+				mesh->add_triangle(a, b, c);
+			if (i < rings - 1)
+				mesh->add_triangle(b, d, c);
+		}
+	}
+
+	mesh->build();
+	return mesh;
+}
+
+// The Cornell room with the mesh of the OBJ file at path standing in its
+// middle, scaled to the height of the tall box. Returns false if the file
+// cannot be read.
+inline bool cornell_mesh(scene_arena& arena, material_table& materials, light_list& lights, const std::string& path, hittable_list& objects)
+{
+	auto white = cornell_room(arena, materials, lights, objects);
+
+	auto mesh = arena.make<triangle_mesh>(white);
+	if (!mesh->load_obj(path))
+		return false;
+
+	aabb bounds;
+	if (!mesh->bounding_box(0, 1, bounds))
+	{
+		std::cerr << "ERROR: Mesh file '" << path << "' has no triangles.\n";
+		return false;
+	}
+
+	vec3 extent = bounds.GetMax() - bounds.GetMin();
+	float scale = 330.0f / fmax(extent.x(), fmax(extent.y(), extent.z()));
+	point3 base(0.5f * (bounds.GetMin().x() + bounds.GetMax().x()), bounds.GetMin().y(), 0.5f * (bounds.GetMin().z() + bounds.GetMax().z()));
+	objects.add(arena.make<instance>(mesh, affine_transform::translation(vec3(278, 0, 278)) * affine_transform::scaling(vec3(scale, scale, scale))
+		* affine_transform::translation(-base)));
+
+	std::cerr << "Mesh: " << mesh->size() << " triangles, " << mesh->vertex_count() << " vertices, "
+		<< (mesh->buffer_bytes() + mesh->bvh_bytes()) / 1024 << " KiB\n";
+	return true;
+}
+
+#endif
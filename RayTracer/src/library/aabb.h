@@ -9,19 +9,47 @@ public:
 	aabb(const point3& a, const point3& b)
 		: m_Min(a), m_Max(b) {}
 
-	point3 GetMin() { return m_Min; }
-	point3 GetMax() { return m_Max; }
+	point3 GetMin() const { return m_Min; }
+	point3 GetMax() const { return m_Max; }
 
-	bool hit(const ray& r, float tmin, float tmax) const
+	// An inverted box that any expand() call replaces
+	static aabb empty() { return aabb(point3(INF), point3(-INF)); }
+
+	void expand(const aabb& b)
 	{
 		for (int a = 0; a < 3; a++)
 		{
-			float invD = 1.0f / r.GetDirection()[a];
-			float t0 = (m_Min[a] - r.GetOrigin()[a]) * invD;
-			float t1 = (m_Max[a] - r.GetOrigin()[a]) * invD;
+			m_Min[a] = m_Min[a] < b.m_Min[a] ? m_Min[a] : b.m_Min[a];
+			m_Max[a] = m_Max[a] > b.m_Max[a] ? m_Max[a] : b.m_Max[a];
+		}
+	}
+
+	void expand(const point3& p)
+	{
+		for (int a = 0; a < 3; a++)
+		{
+			m_Min[a] = m_Min[a] < p[a] ? m_Min[a] : p[a];
+			m_Max[a] = m_Max[a] > p[a] ? m_Max[a] : p[a];
+		}
+	}
 
-			if (invD < 0.0f)
-				std::swap(t0, t1);
+	float surface_area() const
+	{
+		vec3 d = m_Max - m_Min;
+		return 2.0f * (d.x() * d.y() + d.y() * d.z() + d.z() * d.x());
+	}
+
+	bool hit(const ray& r, float tmin, float tmax) const
+	{
+		const vec3 invDir = r.GetInvDirection();
+		const int octant = r.GetOctant();
+
+		for (int a = 0; a < 3; a++)
+		{
+			// The octant tells which slab plane the ray meets first
+			bool negative = (octant >> a) & 1;
+			float t0 = ((negative ? m_Max[a] : m_Min[a]) - r.GetOrigin()[a]) * invDir[a];
+			float t1 = ((negative ? m_Min[a] : m_Max[a]) - r.GetOrigin()[a]) * invDir[a];
 
 			tmin = t0 > tmin ? t0 : tmin;
 			tmax = t1 < tmax ? t1 : tmax;
@@ -8,11 +8,12 @@ class xy_rect : public hittable
 public:
 	xy_rect() {}
 
-	xy_rect(float x0, float x1, float y0, float y1, float k, std::shared_ptr<material> mat)
+	xy_rect(float x0, float x1, float y0, float y1, float k, material_id mat)
 		: m_X0(x0), m_X1(x1), m_Y0(y0), m_Y1(y1), m_K(k), m_Material(mat) {}
 
 	virtual bool hit(const ray& r, float t0, float t1, hit_record& rec) const override
 	{
+		RT_STAT(render_stats::local().tests[render_stats::prim_rect]++);
 		float t = (m_K - r.GetOrigin().z()) / r.GetDirection().z();
 
 		if (t < t0 || t > t1)
@@ -26,16 +27,26 @@ public:
 
 		rec.u = (x - m_X0) / (m_X1 - m_X0);
 		rec.v = (y - m_Y0) / (m_Y1 - m_Y0);
+		rec.footprint = 1.0f / fmin(m_X1 - m_X0, m_Y1 - m_Y0);
 		rec.t = t;
 		
 		vec3 outward_normal = vec3(0.0f, 0.0f, 1.0f);
 		rec.set_face_normal(r, outward_normal);
-		rec.matPtr = m_Material;
+		rec.matId = m_Material;
+		rec.primId = 0;
 		rec.p = r.at(t);
 
 		return true;
 	}
 
+	// A plane is crossed at most once
+	virtual void crossings(const ray& r, float t0, float t1, crossing_list& out) const override
+	{
+		hit_record rec;
+		if (hit(r, t0, t1, rec))
+			out.insert(rec.t);
+	}
+
 	virtual bool bounding_box(float t0, float t1, aabb& output_box) const override {
 		// The bounding box must have non-zero width in each dimension, so pad the Z
 		// dimension a small amount.
@@ -43,8 +54,27 @@ public:
 		return true;
 	}
 
+	virtual float pdf_value(const point3& o, const vec3& v) const override
+	{
+		hit_record rec;
+		if (!hit(ray(o, v), 0.001f, INF, rec))
+			return 0.0f;
+
+		float area = (m_X1 - m_X0) * (m_Y1 - m_Y0);
+		float distance_squared = rec.t * rec.t * v.length_squared();
+		float cosine = fabs(v.z() / v.length());
+		return distance_squared / (cosine * area);
+	}
+
+	virtual vec3 random(const point3& o, sampler& s) const override
+	{
+		float x = s.next(m_X0, m_X1);
+		float y = s.next(m_Y0, m_Y1);
+		return point3(x, y, m_K) - o;
+	}
+
 private:
-	std::shared_ptr<material> m_Material;
+	material_id m_Material;
 	float m_X0, m_X1, m_Y0, m_Y1, m_K;
 };
 
@@ -53,11 +83,12 @@ class xz_rect : public hittable
 public:
 	xz_rect() {}
 
-	xz_rect(float x0, float x1, float z0, float z1, float k, std::shared_ptr<material> mat)
+	xz_rect(float x0, float x1, float z0, float z1, float k, material_id mat)
 		: m_X0(x0), m_X1(x1), m_Z0(z0), m_Z1(z1), m_K(k), m_Material(mat) {}
 
 	virtual bool hit(const ray& r, float t0, float t1, hit_record& rec) const override
 	{
+		RT_STAT(render_stats::local().tests[render_stats::prim_rect]++);
 		float t = (m_K - r.GetOrigin().y()) / r.GetDirection().y();
 
 		if (t < t0 || t > t1)
@@ -71,16 +102,26 @@ public:
 
 		rec.u = (x - m_X0) / (m_X1 - m_X0);
 		rec.v = (z - m_Z0) / (m_Z1 - m_Z0);
+		rec.footprint = 1.0f / fmin(m_X1 - m_X0, m_Z1 - m_Z0);
 		rec.t = t;
 
 		vec3 outward_normal = vec3(0.0f, 1.0f, 0.0f);
 		rec.set_face_normal(r, outward_normal);
-		rec.matPtr = m_Material;
+		rec.matId = m_Material;
+		rec.primId = 0;
 		rec.p = r.at(t);
 
 		return true;
 	}
 
+	// A plane is crossed at most once
+	virtual void crossings(const ray& r, float t0, float t1, crossing_list& out) const override
+	{
+		hit_record rec;
+		if (hit(r, t0, t1, rec))
+			out.insert(rec.t);
+	}
+
 	virtual bool bounding_box(float t0, float t1, aabb& output_box) const override {
 		// The bounding box must have non-zero width in each dimension, so pad the Z
 		// dimension a small amount.
@@ -88,8 +129,27 @@ public:
 		return true;
 	}
 
+	virtual float pdf_value(const point3& o, const vec3& v) const override
+	{
+		hit_record rec;
+		if (!hit(ray(o, v), 0.001f, INF, rec))
+			return 0.0f;
+
+		float area = (m_X1 - m_X0) * (m_Z1 - m_Z0);
+		float distance_squared = rec.t * rec.t * v.length_squared();
+		float cosine = fabs(v.y() / v.length());
+		return distance_squared / (cosine * area);
+	}
+
+	virtual vec3 random(const point3& o, sampler& s) const override
+	{
+		float x = s.next(m_X0, m_X1);
+		float z = s.next(m_Z0, m_Z1);
+		return point3(x, m_K, z) - o;
+	}
+
 private:
-	std::shared_ptr<material> m_Material;
+	material_id m_Material;
 	float m_X0, m_X1, m_Z0, m_Z1, m_K;
 };
 
@@ -98,11 +158,12 @@ class yz_rect : public hittable
 public:
 	yz_rect() {}
 
-	yz_rect(float y0, float y1, float z0, float z1, float k, std::shared_ptr<material> mat)
+	yz_rect(float y0, float y1, float z0, float z1, float k, material_id mat)
 		: m_Z0(z0), m_Z1(z1), m_Y0(y0), m_Y1(y1), m_K(k), m_Material(mat) {}
 
 	virtual bool hit(const ray& r, float t0, float t1, hit_record& rec) const override
 	{
+		RT_STAT(render_stats::local().tests[render_stats::prim_rect]++);
 		float t = (m_K - r.GetOrigin().x()) / r.GetDirection().x();
 
 		if (t < t0 || t > t1)
@@ -116,16 +177,26 @@ public:
 
 		rec.u = (y - m_Y0) / (m_Y1 - m_Y0);
 		rec.v = (z - m_Z0) / (m_Z1 - m_Z0);
+		rec.footprint = 1.0f / fmin(m_Y1 - m_Y0, m_Z1 - m_Z0);
 		rec.t = t;
 
 		vec3 outward_normal = vec3(1.0f, 0.0f, 0.0f);
 		rec.set_face_normal(r, outward_normal);
-		rec.matPtr = m_Material;
+		rec.matId = m_Material;
+		rec.primId = 0;
 		rec.p = r.at(t);
 
 		return true;
 	}
 
+	// A plane is crossed at most once
+	virtual void crossings(const ray& r, float t0, float t1, crossing_list& out) const override
+	{
+		hit_record rec;
+		if (hit(r, t0, t1, rec))
+			out.insert(rec.t);
+	}
+
 	virtual bool bounding_box(float t0, float t1, aabb& output_box) const override {
 		// The bounding box must have non-zero width in each dimension, so pad the Z
 		// dimension a small amount.
@@ -133,7 +204,26 @@ public:
 		return true;
 	}
 
+	virtual float pdf_value(const point3& o, const vec3& v) const override
+	{
+		hit_record rec;
+		if (!hit(ray(o, v), 0.001f, INF, rec))
+			return 0.0f;
+
+		float area = (m_Y1 - m_Y0) * (m_Z1 - m_Z0);
+		float distance_squared = rec.t * rec.t * v.length_squared();
+		float cosine = fabs(v.x() / v.length());
+		return distance_squared / (cosine * area);
+	}
+
+	virtual vec3 random(const point3& o, sampler& s) const override
+	{
+		float y = s.next(m_Y0, m_Y1);
+		float z = s.next(m_Z0, m_Z1);
+		return point3(m_K, y, z) - o;
+	}
+
 private:
-	std::shared_ptr<material> m_Material;
+	material_id m_Material;
 	float m_Z0, m_Z1, m_Y0, m_Y1, m_K;
 };
\ No newline at end of file
@@ -0,0 +1,126 @@
+#pragma once
+
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <new>
+#include <ostream>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+class hittable;
+class material;
+class texture;
+
+// Owns the memory of everything a scene is built from. Objects are placed one
+// after the other in large blocks in the order they are made, so the shapes of
+// a scene end up next to each other instead of scattered over the heap, and
+// nothing is returned to the system until the arena goes away, all at once.
+//
+// make<T> hands out an ordinary shared_ptr whose object and reference count
+// both live in the arena, so it works anywhere the scene code takes one.
+// Destructors still run when the last reference goes, only the memory stays.
+// The arena must therefore outlive every pointer it handed out.
+class scene_arena
+{
+public:
+	enum category { geometry, materials, textures, other, category_count };
+
+	static const size_t s_BlockSize = size_t(64) << 10;
+
+	scene_arena() {}
+	scene_arena(const scene_arena&) = delete;
+	scene_arena& operator=(const scene_arena&) = delete;
+
+	// Makes a T in the arena, counted under the category its base class
+	// suggests.
+	template<typename T, typename... Args>
+	std::shared_ptr<T> make(Args&&... args)
+	{
+		return std::allocate_shared<T>(allocator<T>(this, category_of<T>()), std::forward<Args>(args)...);
+	}
+
+	void* allocate(size_t bytes, size_t alignment, category c)
+	{
+		uintptr_t start = (m_Cursor + alignment - 1) & ~(uintptr_t(alignment) - 1);
+		if (m_Blocks.empty() || start + bytes > m_End)
+		{
+			// Oversized requests get a block of their own
+			size_t size = bytes + alignment > s_BlockSize ? bytes + alignment : s_BlockSize;
+			m_Blocks.emplace_back(new unsigned char[size]);
+			m_Reserved += size;
+			m_Cursor = reinterpret_cast<uintptr_t>(m_Blocks.back().get());
+			m_End = m_Cursor + size;
+			start = (m_Cursor + alignment - 1) & ~(uintptr_t(alignment) - 1);
+		}
+
+		m_Cursor = start + bytes;
+		m_Used[c] += bytes;
+		m_Count[c]++;
+		return reinterpret_cast<void*>(start);
+	}
+
+	size_t used(category c) const { return m_Used[c]; }
+	size_t count(category c) const { return m_Count[c]; }
+	size_t reserved() const { return m_Reserved; }
+
+	// Bytes and allocations per category, and the size of the blocks
+	void report(std::ostream& out) const
+	{
+		static const char* names[category_count] = { "geometry", "materials", "textures", "other" };
+		out << "Scene arena: " << m_Reserved / 1024 << " KiB in " << m_Blocks.size() << " blocks\n";
+		for (int c = 0; c < category_count; c++)
+			out << "  " << names[c] << ": " << m_Used[c] << " bytes in " << m_Count[c] << " objects\n";
+	}
+
+	// Allocator that places a container's memory, or a shared_ptr's object
+	// and count, in the arena. Freeing is left to the arena.
+	template<typename T>
+	struct allocator
+	{
+		using value_type = T;
+
+		allocator(scene_arena* a, category c) : arena(a), cat(c) {}
+
+		template<typename U>
+		allocator(const allocator<U>& other) : arena(other.arena), cat(other.cat) {}
+
+		T* allocate(size_t n) { return static_cast<T*>(arena->allocate(n * sizeof(T), alignof(T), cat)); }
+		void deallocate(T*, size_t) {}
+
+		template<typename U>
+		bool operator==(const allocator<U>& other) const { return arena == other.arena; }
+		template<typename U>
+		bool operator!=(const allocator<U>& other) const { return arena != other.arena; }
+
+		scene_arena* arena;
+		category cat;
+	};
+
+private:
+	template<typename T>
+	static category category_of()
+	{
+		if (std::is_base_of<hittable, T>::value)
+			return geometry;
+		if (std::is_base_of<material, T>::value)
+			return materials;
+		if (std::is_base_of<texture, T>::value)
+			return textures;
+		return other;
+	}
+
+	std::vector<std::unique_ptr<unsigned char[]>> m_Blocks;
+	uintptr_t m_Cursor = 0;
+	uintptr_t m_End = 0;
+	size_t m_Reserved = 0;
+	size_t m_Used[category_count] = {};
+	size_t m_Count[category_count] = {};
+};
+
+#endif
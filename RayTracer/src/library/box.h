@@ -1,38 +1,124 @@
 #pragma once
 
-#include "hittable_list.h"
-#include "aarect.h"
+#include "hittable.h"
 
+#include <utility>
+
+// Axis aligned box intersected with a single slab test. Faces give the same
+// records as the six rectangles the box used to be made of: the normal is the
+// face's outward normal flipped towards the ray, and u, v run along the face
+// the way they do on the matching xy_rect, xz_rect or yz_rect.
 class box : public hittable
 {
 public:
 	box() {}
-	box(const point3& p0, const point3& p1, std::shared_ptr<material> ptr)
-		: m_Min(p0), m_Max(p1)
+	box(const point3& p0, const point3& p1, material_id mat)
+		: m_Min(p0), m_Max(p1), m_Material(mat) {}
+
+	virtual bool hit(const ray& r, float t0, float t1, hit_record& rec) const override
 	{
-		m_Sides.add(std::make_shared<xy_rect>(p0.x(), p1.x(), p0.y(), p1.y(), p1.z(), ptr));
-		m_Sides.add(std::make_shared<flip_face>(std::make_shared<xy_rect>(p0.x(), p1.x(), p0.y(), p1.y(), p0.z(), ptr)));
+		RT_STAT(render_stats::local().tests[render_stats::prim_box]++);
+		float tEnter, tExit;
+		int enterAxis, exitAxis;
+		if (!slabs(r, tEnter, tExit, enterAxis, exitAxis))
+			return false;
+
+		// The entry face when it lies in range, otherwise the ray starts inside and
+		// leaves through the exit face.
+		float t;
+		int axis;
+		bool entering = tEnter >= t0 && tEnter <= t1;
+		if (entering)
+		{
+			t = tEnter;
+			axis = enterAxis;
+		}
+		else if (tExit >= t0 && tExit <= t1)
+		{
+			t = tExit;
+			axis = exitAxis;
+		}
+		else
+			return false;
 
-		m_Sides.add(std::make_shared<xz_rect>(p0.x(), p1.x(), p0.z(), p1.z(), p1.y(), ptr));
-		m_Sides.add(std::make_shared<flip_face>(std::make_shared<xz_rect>(p0.x(), p1.x(), p0.z(), p1.z(), p0.y(), ptr)));
+		// The two face axes in the order the rectangles use for u and v
+		int uAxis = axis == 0 ? 1 : 0;
+		int vAxis = axis == 2 ? 1 : 2;
+		float u = r.GetOrigin()[uAxis] + t * r.GetDirection()[uAxis];
+		float v = r.GetOrigin()[vAxis] + t * r.GetDirection()[vAxis];
 
-		m_Sides.add(std::make_shared<yz_rect>(p0.y(), p1.y(), p0.z(), p1.z(), p1.x(), ptr));
-		m_Sides.add(std::make_shared<flip_face>(std::make_shared<yz_rect>(p0.y(), p1.y(), p0.z(), p1.z(), p0.x(), ptr)));
+		rec.u = (u - m_Min[uAxis]) / (m_Max[uAxis] - m_Min[uAxis]);
+		rec.v = (v - m_Min[vAxis]) / (m_Max[vAxis] - m_Min[vAxis]);
+		rec.footprint = 1.0f / fmin(m_Max[uAxis] - m_Min[uAxis], m_Max[vAxis] - m_Min[vAxis]);
+		rec.t = t;
+
+		// Whether the face is the min or max plane of the axis follows from the
+		// direction, the ray enters against it and leaves along it.
+		bool towardsMax = r.GetDirection()[axis] > 0.0f;
+		bool maxFace = entering ? !towardsMax : towardsMax;
+		vec3 outward_normal(0.0f, 0.0f, 0.0f);
+		outward_normal[axis] = maxFace ? 1.0f : -1.0f;
+		rec.set_face_normal(r, outward_normal);
+		rec.matId = m_Material;
+		rec.primId = 0;
+		rec.p = r.at(t);
+
+		return true;
 	}
 
-	virtual bool hit(const ray& r, float t0, float t1, hit_record& rec) const override
+	virtual void crossings(const ray& r, float t0, float t1, crossing_list& out) const override
 	{
-		return m_Sides.hit(r, t0, t1, rec);
+		float tEnter, tExit;
+		int enterAxis, exitAxis;
+		if (!slabs(r, tEnter, tExit, enterAxis, exitAxis))
+			return;
+
+		if (tEnter >= t0 && tEnter <= t1)
+			out.insert(tEnter);
+		if (tExit >= t0 && tExit <= t1)
+			out.insert(tExit);
 	}
 
-	virtual bool bounding_box(float t0, float t1, aabb& output_box) const override 
+	virtual bool bounding_box(float t0, float t1, aabb& output_box) const override
 	{
 		output_box = aabb(m_Min, m_Max);
 		return true;
 	}
 
 private:
+	// Where the line of r enters and leaves the box, and through which axis'
+	// faces. Returns false if it misses.
+	bool slabs(const ray& r, float& tEnter, float& tExit, int& enterAxis, int& exitAxis) const
+	{
+		// Distances are divided rather than multiplied with the inverse direction,
+		// matching the rectangles so existing scenes render the same.
+		tEnter = -INF;
+		tExit = INF;
+		enterAxis = exitAxis = 0;
+
+		for (int a = 0; a < 3; a++)
+		{
+			float tLo = (m_Min[a] - r.GetOrigin()[a]) / r.GetDirection()[a];
+			float tHi = (m_Max[a] - r.GetOrigin()[a]) / r.GetDirection()[a];
+			if (tLo > tHi)
+				std::swap(tLo, tHi);
+
+			if (tLo > tEnter)
+			{
+				tEnter = tLo;
+				enterAxis = a;
+			}
+			if (tHi < tExit)
+			{
+				tExit = tHi;
+				exitAxis = a;
+			}
+		}
+
+		return tEnter <= tExit;
+	}
+
 	point3 m_Min;
 	point3 m_Max;
-	hittable_list m_Sides;
-};
\ No newline at end of file
+	material_id m_Material;
+};
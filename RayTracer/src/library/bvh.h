@@ -3,98 +3,963 @@
 #include "hittable_list.h"
 
 #include <algorithm>
+#include <cstdint>
+#include <future>
 
-inline bool box_compare(const std::shared_ptr<hittable> a, const std::shared_ptr<hittable> b, int axis) {
-	aabb box_a;
-	aabb box_b;
+// Width of the traversal nodes, fixed at compile time by the available
+// instruction set. Define RT_BVH_SCALAR to force the portable slab test.
+#if !defined(RT_BVH_SCALAR) && defined(__AVX2__)
+	#define RT_BVH_AVX 1
+	#define RT_BVH_WIDTH 8
+#elif !defined(RT_BVH_SCALAR) && (defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2))
+	#define RT_BVH_SSE 1
+	#define RT_BVH_WIDTH 4
+#else
+	#define RT_BVH_WIDTH 4
+#endif
 
-	if (!a->bounding_box(0, 0, box_a) || !b->bounding_box(0, 0, box_b))
-		std::cerr << "No bounding box in bvh_node constructor.\n";
+#if defined(RT_BVH_AVX) || defined(RT_BVH_SSE)
+	#include <immintrin.h>
+#endif
 
-	return box_a.GetMin().e[axis] < box_b.GetMin().e[axis];
-}
+// One node of the binary tree the builder produces. Children of an interior
+// node are stored depth first, so the left child always directly follows its
+// parent and only the right child's index is kept. Two nodes share a 64 byte
+// cache line.
+struct alignas(32) linear_bvh_node
+{
+	float bmin[3];
+	union {
+		int32_t primitivesOffset; // Leaf
+		int32_t secondChildOffset; // Interior
+	};
+	float bmax[3];
+	uint16_t primitiveCount; // 0 for interior nodes
+	uint8_t axis; // Split axis of interior nodes
+	uint8_t pad;
+};
 
-bool box_x_compare(const std::shared_ptr<hittable> a, const std::shared_ptr<hittable> b) {
-	return box_compare(a, b, 0);
-}
+static_assert(sizeof(linear_bvh_node) == 32, "linear_bvh_node should fill half a cache line");
 
-bool box_y_compare(const std::shared_ptr<hittable> a, const std::shared_ptr<hittable> b) {
-	return box_compare(a, b, 1);
-}
+// Traversal node with RT_BVH_WIDTH children, collapsed from the binary tree.
+// Child bounds are stored per axis so one slab test covers every child.
+// Unused slots have inverted bounds and can never be hit.
+struct alignas(64) wide_bvh_node
+{
+	float bmin[3][RT_BVH_WIDTH];
+	float bmax[3][RT_BVH_WIDTH];
+	int32_t child[RT_BVH_WIDTH]; // Node index, or first primitive of a leaf
+	uint8_t count[RT_BVH_WIDTH]; // Primitives in a leaf child, 0 for interior children
+};
 
-bool box_z_compare(const std::shared_ptr<hittable> a, const std::shared_ptr<hittable> b) {
-	return box_compare(a, b, 2);
-}
+// Bounds of one primitive, computed once before the build
+struct bvh_primitive_info
+{
+	size_t index;
+	aabb bounds;
+	point3 centroid;
+};
 
-class bvh_node : public hittable
+// A pointer-free bounding volume hierarchy over an indexed set of primitives.
+// It only knows primitive bounds, the owner intersects its leaves, so the same
+// tree serves lists of hittables as well as specialised primitive sets.
+class bvh_tree
 {
 public:
-	bvh_node() {}
-	bvh_node(hittable_list& list, float time0, float time1)
-		: bvh_node(list.m_Objects, 0, list.GetObjects().size(), time0, time1)
-	{}
+	// Subtrees at least this large are built on their own thread, down to
+	// s_ParallelDepth levels below the root.
+	static const size_t s_ParallelThreshold = 4096;
+	static const int s_ParallelDepth = 4;
+	static const int s_BinCount = 16;
 
-	// Randomly choose an axis, sort it, and then put half in each subtree
-	bvh_node(std::vector<std::shared_ptr<hittable>>& objects,
-		size_t start, size_t end, double time0, double time1)
+	// Deepest leaf of the binary tree. Below the depth at which SAH splits could
+	// run past it, primitives are split at the median instead. Traversal pushes
+	// at most RT_BVH_WIDTH - 1 more entries per level, which bounds its stack.
+	static const int s_MaxDepth = 64;
+	static const int s_StackSize = s_MaxDepth * (RT_BVH_WIDTH - 1) + 1;
+
+	// Relative costs of a node visit and a primitive test used by the SAH
+	static constexpr float s_TraversalCost = 1.0f;
+	static constexpr float s_IntersectionCost = 1.0f;
+
+	// Builds the tree and reorders info so that every leaf covers a contiguous
+	// run of it. Leaves refer to primitives by their position in info. Owners
+	// that test a whole leaf in one SIMD pass can pass a lower cost per
+	// primitive, which makes the builder fill their leaves further.
+	void build(std::vector<bvh_primitive_info>& info, int maxLeafSize, float intersectionCost = s_IntersectionCost)
+	{
+		m_Nodes.clear();
+		m_External = nullptr;
+		m_ExternalCount = 0;
+		m_SahCost = 0.0f;
+
+		if (info.empty())
+			return;
+
+		std::vector<linear_bvh_node> binary = build_binary(info, 0, info.size(), maxLeafSize, intersectionCost, 0);
+		m_Bounds = node_bounds(binary[0]);
+
+		float rootArea = m_Bounds.surface_area();
+		for (const auto& node : binary)
+		{
+			float p = rootArea > 0.0f ? node_bounds(node).surface_area() / rootArea : 1.0f;
+			m_SahCost += p * (node.primitiveCount > 0 ? intersectionCost * node.primitiveCount : s_TraversalCost);
+		}
+
+		m_Nodes.reserve(binary.size() / (RT_BVH_WIDTH - 1) + 1);
+		collapse(binary, 0);
+	}
+
+	// Uses count nodes kept elsewhere, such as in a mapped compiled scene,
+	// instead of building them. They must outlive the tree or the next build.
+	void attach(const wide_bvh_node* nodes, size_t count, const aabb& bounds)
+	{
+		m_Nodes.clear();
+		m_External = nodes;
+		m_ExternalCount = count;
+		m_Bounds = bounds;
+		m_SahCost = 0.0f;
+	}
+
+	bool empty() const { return node_count() == 0; }
+	const aabb& bounds() const { return m_Bounds; }
+	size_t node_count() const { return m_External ? m_ExternalCount : m_Nodes.size(); }
+	const wide_bvh_node* nodes() const { return m_External ? m_External : m_Nodes.data(); }
+
+	// Expected cost of tracing a random ray through the binary tree, weighting
+	// every node by the probability its bounds are hit given the root was.
+	float sah_cost() const { return m_SahCost; }
+
+	// Walks the tree front to back and calls intersect(first, count, t_max) for
+	// every leaf the ray reaches. It returns true when one of the primitives was
+	// hit closer than t_max, which it then shrinks to the new distance. When
+	// given, visits is increased by the number of nodes whose children were
+	// tested.
+	template<typename LeafFn>
+	bool traverse(const ray& r, float t_min, float t_max, LeafFn&& intersect, int* visits = nullptr) const
+	{
+		if (empty())
+			return false;
+
+		const wide_bvh_node* nodes = this->nodes();
+
+		struct stack_entry
+		{
+			int32_t child;
+			int32_t count;
+			float tnear;
+		};
+
+		stack_entry stack[s_StackSize];
+		int stackSize = 0;
+		stack[stackSize++] = { 0, 0, t_min };
+		RT_STAT(render_stats& stats = render_stats::local());
+
+		bool hit_anything = false;
+		alignas(32) float tnear[RT_BVH_WIDTH];
+
+		while (stackSize > 0)
+		{
+			const stack_entry entry = stack[--stackSize];
+
+			// Something closer than this whole subtree was found in the meantime
+			if (entry.tnear >= t_max)
+				continue;
+
+			if (entry.count > 0)
+			{
+				if (intersect(entry.child, entry.count, t_max))
+					hit_anything = true;
+				continue;
+			}
+
+			const wide_bvh_node& node = nodes[entry.child];
+			int mask = intersect_children(node, r, t_min, t_max, tnear);
+			if (visits)
+				++*visits;
+			RT_STAT(stats.nodes++);
+
+			// Push the hit children farthest first so the nearest is popped next
+			int first = stackSize;
+			for (int i = 0; i < RT_BVH_WIDTH; i++)
+			{
+				if (!(mask & (1 << i)))
+					continue;
+
+				stack_entry child = { node.child[i], node.count[i], tnear[i] };
+				int j = stackSize++;
+				while (j > first && stack[j - 1].tnear < child.tnear)
+				{
+					stack[j] = stack[j - 1];
+					j--;
+				}
+				stack[j] = child;
+			}
+		}
+
+		return hit_anything;
+	}
+
+	// Packet version of traverse. Every node is fetched once for all rays of
+	// the packet that are still active, and intersect(first, count, rayMask, t_max)
+	// returns the mask of rays that hit a primitive of the leaf.
+	template<typename LeafFn>
+	int traverse_packet(const ray_packet& packet, int mask, float t_min, float* t_max, LeafFn&& intersect) const
+	{
+		if (empty() || mask == 0)
+			return 0;
+
+		const wide_bvh_node* nodes = this->nodes();
+
+		struct stack_entry
+		{
+			int32_t parent; // Node holding the bounds of this entry, -1 for the root
+			int32_t slot;
+			int32_t rays;
+			float tnear;
+		};
+
+#if !defined(RT_BVH_AVX)
+		packet_bounds bounds(packet, mask);
+#endif
+		packet_rays rays_soa(packet);
+
+		stack_entry stack[s_StackSize];
+		int stackSize = 0;
+		stack[stackSize++] = { -1, 0, mask, t_min };
+		RT_STAT(render_stats& stats = render_stats::local());
+
+		int hits = 0;
+
+		while (stackSize > 0)
+		{
+			const stack_entry entry = stack[--stackSize];
+
+			int32_t child = entry.parent < 0 ? 0 : nodes[entry.parent].child[entry.slot];
+			int32_t count = entry.parent < 0 ? 0 : nodes[entry.parent].count[entry.slot];
+
+			if (count > 0)
+			{
+				// Primitives cost more than a box, so test the leaf bounds again
+				// against the distances the rays have found since it was pushed.
+				float nearest;
+				int rays = rays_soa.intersect_box(nodes[entry.parent], entry.slot, t_min, t_max, entry.rays, nearest);
+				if (rays != 0)
+					hits |= intersect(child, count, rays, t_max);
+				continue;
+			}
+
+			const wide_bvh_node& node = nodes[child];
+			RT_STAT(stats.nodes++);
+
+#if defined(RT_BVH_AVX)
+			// One AVX slab test already covers the whole packet, a conservative
+			// pre-test would only add work.
+			const int candidates = ~0;
+#else
+			// Conservative test of the whole packet first, so subtrees that no ray
+			// can reach cost one test instead of one per ray.
+			int candidates = bounds.intersect_children(node, t_min, t_max, entry.rays, packet.count);
+			if (candidates == 0)
+				continue;
+#endif
+
+			int childRays[RT_BVH_WIDTH] = {};
+			float childNear[RT_BVH_WIDTH];
+
+			for (int c = 0; c < RT_BVH_WIDTH; c++)
+			{
+				// Unused slots are skipped explicitly, the min/max form of the
+				// packet slab test does not reject their inverted bounds
+				if (!(candidates & (1 << c)) || node.child[c] < 0)
+					continue;
+
+				childRays[c] = rays_soa.intersect_box(node, c, t_min, t_max, entry.rays, childNear[c]);
+			}
+
+			int first = stackSize;
+			for (int c = 0; c < RT_BVH_WIDTH; c++)
+			{
+				if (childRays[c] == 0)
+					continue;
+
+				stack_entry pushed = { child, c, childRays[c], childNear[c] };
+				int j = stackSize++;
+				while (j > first && stack[j - 1].tnear < pushed.tnear)
+				{
+					stack[j] = stack[j - 1];
+					j--;
+				}
+				stack[j] = pushed;
+			}
+		}
+
+		return hits;
+	}
+
+private:
+	// Origins and reciprocal directions of a packet laid out per axis, so one
+	// slab test covers all of its rays.
+	struct packet_rays
 	{
-		int axis = random_int(0, 2);
-		auto comparator = (axis == 0) ? box_x_compare
-			: (axis == 1) ? box_y_compare : box_z_compare;
+		explicit packet_rays(const ray_packet& packet)
+		{
+			for (int i = 0; i < ray_packet::s_Size; i++)
+			{
+				// Unused lanes get a ray that cannot hit anything
+				bool used = i < packet.count;
+				for (int a = 0; a < 3; a++)
+				{
+					origin[a][i] = used ? packet.rays[i].GetOrigin()[a] : 0.0f;
+					invDir[a][i] = used ? packet.rays[i].GetInvDirection()[a] : INF;
+				}
+			}
+		}
+
+		// Mask of the rays in mask that hit child c of the node within
+		// [t_min, t_max[i]]. nearest receives the smallest entry distance among them.
+		int intersect_box(const wide_bvh_node& node, int c, float t_min, const float* t_max, int mask, float& nearest) const
+		{
+#if defined(RT_BVH_AVX)
+			__m256 t0 = _mm256_set1_ps(t_min);
+			__m256 t1 = _mm256_loadu_ps(t_max);
+			for (int a = 0; a < 3; a++)
+			{
+				__m256 o = _mm256_load_ps(origin[a]);
+				__m256 inv = _mm256_load_ps(invDir[a]);
+				__m256 tlo = _mm256_mul_ps(_mm256_sub_ps(_mm256_set1_ps(node.bmin[a][c]), o), inv);
+				__m256 thi = _mm256_mul_ps(_mm256_sub_ps(_mm256_set1_ps(node.bmax[a][c]), o), inv);
+				t0 = _mm256_max_ps(t0, _mm256_min_ps(tlo, thi));
+				t1 = _mm256_min_ps(t1, _mm256_max_ps(tlo, thi));
+			}
+			__m256 hit = _mm256_cmp_ps(t0, t1, _CMP_LT_OQ);
+			int hits = _mm256_movemask_ps(hit) & mask;
 
-		size_t object_span = end - start;
+			// Horizontal minimum of the entry distances of the rays that hit
+			__m256 masked = _mm256_blendv_ps(_mm256_set1_ps(INF), t0, _mm256_castsi256_ps(lane_mask(hits)));
+			__m128 lanes = _mm_min_ps(_mm256_castps256_ps128(masked), _mm256_extractf128_ps(masked, 1));
+			lanes = _mm_min_ps(lanes, _mm_movehl_ps(lanes, lanes));
+			lanes = _mm_min_ss(lanes, _mm_shuffle_ps(lanes, lanes, 1));
+			nearest = _mm_cvtss_f32(lanes);
+			return hits;
+#elif defined(RT_BVH_SSE)
+			int hits = 0;
+			__m128 closest = _mm_set1_ps(INF);
+			for (int half = 0; half < ray_packet::s_Size; half += 4)
+			{
+				__m128 t0 = _mm_set1_ps(t_min);
+				__m128 t1 = _mm_loadu_ps(t_max + half);
+				for (int a = 0; a < 3; a++)
+				{
+					__m128 o = _mm_load_ps(origin[a] + half);
+					__m128 inv = _mm_load_ps(invDir[a] + half);
+					__m128 tlo = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(node.bmin[a][c]), o), inv);
+					__m128 thi = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(node.bmax[a][c]), o), inv);
+					t0 = _mm_max_ps(t0, _mm_min_ps(tlo, thi));
+					t1 = _mm_min_ps(t1, _mm_max_ps(tlo, thi));
+				}
+
+				// Keep the entry distance only where the ray is active and hit
+				int laneHits = _mm_movemask_ps(_mm_cmplt_ps(t0, t1)) & (mask >> half) & 0xf;
+				__m128 keep = _mm_castsi128_ps(_mm_set_epi32(
+					laneHits & 8 ? -1 : 0, laneHits & 4 ? -1 : 0, laneHits & 2 ? -1 : 0, laneHits & 1 ? -1 : 0));
+				closest = _mm_min_ps(closest, _mm_or_ps(_mm_and_ps(keep, t0), _mm_andnot_ps(keep, _mm_set1_ps(INF))));
+				hits |= laneHits << half;
+			}
+			closest = _mm_min_ps(closest, _mm_movehl_ps(closest, closest));
+			closest = _mm_min_ss(closest, _mm_shuffle_ps(closest, closest, 1));
+			nearest = _mm_cvtss_f32(closest);
+			return hits;
+#else
+			int hits = 0;
+			nearest = INF;
+			for (int i = 0; i < ray_packet::s_Size; i++)
+			{
+				if (!(mask & (1 << i)))
+					continue;
 
-		if (object_span == 1)
-			m_Left = m_Right = objects[start];
-		else if (object_span == 2)
+				float t0 = t_min;
+				float t1 = t_max[i];
+				for (int a = 0; a < 3; a++)
+				{
+					float tlo = (node.bmin[a][c] - origin[a][i]) * invDir[a][i];
+					float thi = (node.bmax[a][c] - origin[a][i]) * invDir[a][i];
+					t0 = std::max(t0, std::min(tlo, thi));
+					t1 = std::min(t1, std::max(tlo, thi));
+				}
+
+				if (t0 < t1)
+				{
+					hits |= 1 << i;
+					nearest = std::min(nearest, t0);
+				}
+			}
+			return hits;
+#endif
+		}
+
+#if defined(RT_BVH_AVX)
+		// All bits set in the lanes whose bit is set in mask
+		static __m256i lane_mask(int mask)
 		{
-			if (comparator(objects[start], objects[start + 1]))
+			const __m256i bits = _mm256_setr_epi32(1, 2, 4, 8, 16, 32, 64, 128);
+			return _mm256_cmpeq_epi32(_mm256_and_si256(_mm256_set1_epi32(mask), bits), bits);
+		}
+#endif
+
+		alignas(32) float origin[3][ray_packet::s_Size];
+		alignas(32) float invDir[3][ray_packet::s_Size];
+	};
+
+	// Interval bounds on the origins and reciprocal directions of a packet.
+	// They are only valid while every ray shares one octant, otherwise the
+	// packet test accepts everything and the per ray tests decide.
+	struct packet_bounds
+	{
+		packet_bounds(const ray_packet& packet, int mask)
+		{
+			valid = true;
+			octant = -1;
+
+			for (int a = 0; a < 3; a++)
 			{
-				m_Left = objects[start];
-				m_Right = objects[start + 1];
+				originMin[a] = invMin[a] = INF;
+				originMax[a] = invMax[a] = -INF;
+			}
+
+			for (int i = 0; i < packet.count; i++)
+			{
+				if (!(mask & (1 << i)))
+					continue;
+
+				const ray& r = packet.rays[i];
+				if (octant < 0)
+					octant = r.GetOctant();
+				else if (octant != r.GetOctant())
+					valid = false;
+
+				for (int a = 0; a < 3; a++)
+				{
+					originMin[a] = std::min(originMin[a], r.GetOrigin()[a]);
+					originMax[a] = std::max(originMax[a], r.GetOrigin()[a]);
+					invMin[a] = std::min(invMin[a], r.GetInvDirection()[a]);
+					invMax[a] = std::max(invMax[a], r.GetInvDirection()[a]);
+				}
+			}
+
+			for (int a = 0; a < 3; a++)
+				if (!std::isfinite(invMin[a]) || !std::isfinite(invMax[a]))
+					valid = false;
+		}
+
+		// Mask of children that at least one ray of the packet may hit
+		int intersect_children(const wide_bvh_node& node, float t_min, const float* t_max, int rays, int count) const
+		{
+			const int all = (1 << RT_BVH_WIDTH) - 1;
+			if (!valid)
+				return all;
+
+			float farthest = t_min;
+			for (int i = 0; i < count; i++)
+				if (rays & (1 << i))
+					farthest = std::max(farthest, t_max[i]);
+
+			int mask = 0;
+			for (int c = 0; c < RT_BVH_WIDTH; c++)
+			{
+				float t0 = t_min;
+				float t1 = farthest;
+
+				for (int a = 0; a < 3; a++)
+				{
+					bool negative = (octant >> a) & 1;
+					float nearPlane = negative ? node.bmax[a][c] : node.bmin[a][c];
+					float farPlane = negative ? node.bmin[a][c] : node.bmax[a][c];
+
+					// Smallest entry and largest exit distance over every origin and
+					// direction in the intervals
+					t0 = std::max(t0, interval_min(nearPlane - originMax[a], nearPlane - originMin[a], invMin[a], invMax[a]));
+					t1 = std::min(t1, interval_max(farPlane - originMax[a], farPlane - originMin[a], invMin[a], invMax[a]));
+				}
+
+				if (t0 <= t1)
+					mask |= 1 << c;
+			}
+			return mask;
+		}
+
+		static float interval_min(float d0, float d1, float i0, float i1)
+		{
+			return std::min(std::min(d0 * i0, d0 * i1), std::min(d1 * i0, d1 * i1));
+		}
+
+		static float interval_max(float d0, float d1, float i0, float i1)
+		{
+			return std::max(std::max(d0 * i0, d0 * i1), std::max(d1 * i0, d1 * i1));
+		}
+
+		bool valid;
+		int octant;
+		float originMin[3], originMax[3];
+		float invMin[3], invMax[3];
+	};
+
+	// Slab test of the ray against all children of a node. Returns a bit mask
+	// of the children hit within [t_min, t_max] and stores their entry distances.
+	// The ray's octant picks the near and far planes, so no per-axis swap is needed.
+	static int intersect_children(const wide_bvh_node& node, const ray& r, float t_min, float t_max, float* tnear)
+	{
+		const point3 origin = r.GetOrigin();
+		const vec3 invDir = r.GetInvDirection();
+		const int octant = r.GetOctant();
+
+		const float* nearX = (octant & 1) ? node.bmax[0] : node.bmin[0];
+		const float* farX = (octant & 1) ? node.bmin[0] : node.bmax[0];
+		const float* nearY = (octant & 2) ? node.bmax[1] : node.bmin[1];
+		const float* farY = (octant & 2) ? node.bmin[1] : node.bmax[1];
+		const float* nearZ = (octant & 4) ? node.bmax[2] : node.bmin[2];
+		const float* farZ = (octant & 4) ? node.bmin[2] : node.bmax[2];
+
+#if defined(RT_BVH_AVX)
+		const __m256 ox = _mm256_set1_ps(origin.x()), oy = _mm256_set1_ps(origin.y()), oz = _mm256_set1_ps(origin.z());
+		const __m256 ix = _mm256_set1_ps(invDir.x()), iy = _mm256_set1_ps(invDir.y()), iz = _mm256_set1_ps(invDir.z());
+
+		__m256 t0 = _mm256_max_ps(
+			_mm256_max_ps(_mm256_mul_ps(_mm256_sub_ps(_mm256_load_ps(nearX), ox), ix),
+				_mm256_mul_ps(_mm256_sub_ps(_mm256_load_ps(nearY), oy), iy)),
+			_mm256_max_ps(_mm256_mul_ps(_mm256_sub_ps(_mm256_load_ps(nearZ), oz), iz), _mm256_set1_ps(t_min)));
+		__m256 t1 = _mm256_min_ps(
+			_mm256_min_ps(_mm256_mul_ps(_mm256_sub_ps(_mm256_load_ps(farX), ox), ix),
+				_mm256_mul_ps(_mm256_sub_ps(_mm256_load_ps(farY), oy), iy)),
+			_mm256_min_ps(_mm256_mul_ps(_mm256_sub_ps(_mm256_load_ps(farZ), oz), iz), _mm256_set1_ps(t_max)));
+
+		_mm256_store_ps(tnear, t0);
+		return _mm256_movemask_ps(_mm256_cmp_ps(t0, t1, _CMP_LT_OQ));
+#elif defined(RT_BVH_SSE)
+		const __m128 ox = _mm_set1_ps(origin.x()), oy = _mm_set1_ps(origin.y()), oz = _mm_set1_ps(origin.z());
+		const __m128 ix = _mm_set1_ps(invDir.x()), iy = _mm_set1_ps(invDir.y()), iz = _mm_set1_ps(invDir.z());
+
+		__m128 t0 = _mm_max_ps(
+			_mm_max_ps(_mm_mul_ps(_mm_sub_ps(_mm_load_ps(nearX), ox), ix),
+				_mm_mul_ps(_mm_sub_ps(_mm_load_ps(nearY), oy), iy)),
+			_mm_max_ps(_mm_mul_ps(_mm_sub_ps(_mm_load_ps(nearZ), oz), iz), _mm_set1_ps(t_min)));
+		__m128 t1 = _mm_min_ps(
+			_mm_min_ps(_mm_mul_ps(_mm_sub_ps(_mm_load_ps(farX), ox), ix),
+				_mm_mul_ps(_mm_sub_ps(_mm_load_ps(farY), oy), iy)),
+			_mm_min_ps(_mm_mul_ps(_mm_sub_ps(_mm_load_ps(farZ), oz), iz), _mm_set1_ps(t_max)));
+
+		_mm_store_ps(tnear, t0);
+		return _mm_movemask_ps(_mm_cmplt_ps(t0, t1));
+#else
+		int mask = 0;
+		for (int i = 0; i < RT_BVH_WIDTH; i++)
+		{
+			float t0 = std::max(std::max((nearX[i] - origin.x()) * invDir.x(), (nearY[i] - origin.y()) * invDir.y()),
+				std::max((nearZ[i] - origin.z()) * invDir.z(), t_min));
+			float t1 = std::min(std::min((farX[i] - origin.x()) * invDir.x(), (farY[i] - origin.y()) * invDir.y()),
+				std::min((farZ[i] - origin.z()) * invDir.z(), t_max));
+
+			tnear[i] = t0;
+			if (t0 < t1)
+				mask |= 1 << i;
+		}
+		return mask;
+#endif
+	}
+
+	static aabb node_bounds(const linear_bvh_node& node)
+	{
+		return aabb(point3(node.bmin[0], node.bmin[1], node.bmin[2]),
+			point3(node.bmax[0], node.bmax[1], node.bmax[2]));
+	}
+
+	// Turns the binary subtree at root into wide nodes. Starting from the root's
+	// children it keeps opening the interior child with the largest surface
+	// until every slot is used, so the wide node replaces the top binary levels.
+	int collapse(const std::vector<linear_bvh_node>& binary, int root)
+	{
+		int index = static_cast<int>(m_Nodes.size());
+		m_Nodes.emplace_back();
+
+		int slots[RT_BVH_WIDTH];
+		int used = 0;
+
+		if (binary[root].primitiveCount > 0)
+			slots[used++] = root;
+		else
+		{
+			slots[used++] = root + 1;
+			slots[used++] = binary[root].secondChildOffset;
+		}
+
+		while (used < RT_BVH_WIDTH)
+		{
+			int largest = -1;
+			float largestArea = -1.0f;
+			for (int i = 0; i < used; i++)
+			{
+				const linear_bvh_node& node = binary[slots[i]];
+				float area = node_bounds(node).surface_area();
+				if (node.primitiveCount == 0 && area > largestArea)
+				{
+					largest = i;
+					largestArea = area;
+				}
+			}
+
+			if (largest < 0)
+				break;
+
+			int opened = slots[largest];
+			slots[largest] = opened + 1;
+			slots[used++] = binary[opened].secondChildOffset;
+		}
+
+		for (int i = 0; i < RT_BVH_WIDTH; i++)
+		{
+			wide_bvh_node& node = m_Nodes[index];
+
+			if (i >= used)
+			{
+				for (int a = 0; a < 3; a++)
+				{
+					node.bmin[a][i] = INF;
+					node.bmax[a][i] = -INF;
+				}
+				node.child[i] = -1;
+				node.count[i] = 0;
+				continue;
+			}
+
+			const linear_bvh_node& child = binary[slots[i]];
+			for (int a = 0; a < 3; a++)
+			{
+				node.bmin[a][i] = child.bmin[a];
+				node.bmax[a][i] = child.bmax[a];
+			}
+
+			if (child.primitiveCount > 0)
+			{
+				node.child[i] = child.primitivesOffset;
+				node.count[i] = static_cast<uint8_t>(child.primitiveCount);
 			}
 			else
 			{
-				m_Left = objects[start + 1];
-				m_Right = objects[start];
+				// The recursion may grow m_Nodes, so look the node up again afterwards
+				int32_t childIndex = collapse(binary, slots[i]);
+				m_Nodes[index].child[i] = childIndex;
+				m_Nodes[index].count[i] = 0;
 			}
 		}
+
+		return index;
+	}
+
+	// Builds the subtree over info[start, end) with a binned surface area
+	// heuristic and returns its nodes depth first, indexed from 0. The range of
+	// info is reordered so every leaf covers a contiguous run of it.
+	static std::vector<linear_bvh_node> build_binary(std::vector<bvh_primitive_info>& info, size_t start, size_t end, int maxLeafSize,
+		float intersectionCost, int depth)
+	{
+		std::vector<linear_bvh_node> nodes;
+		nodes.reserve(2 * (end - start) / maxLeafSize + 1);
+		build_into(nodes, info, start, end, maxLeafSize, intersectionCost, depth);
+		return nodes;
+	}
+
+	static void build_into(std::vector<linear_bvh_node>& nodes,
+		std::vector<bvh_primitive_info>& info, size_t start, size_t end, int maxLeafSize, float intersectionCost, int depth)
+	{
+		size_t index = nodes.size();
+		nodes.emplace_back();
+
+		aabb bounds = aabb::empty();
+		aabb centroidBounds = aabb::empty();
+		for (size_t i = start; i < end; i++)
+		{
+			bounds.expand(info[i].bounds);
+			centroidBounds.expand(info[i].centroid);
+		}
+
+		for (int a = 0; a < 3; a++)
+		{
+			nodes[index].bmin[a] = bounds.GetMin()[a];
+			nodes[index].bmax[a] = bounds.GetMax()[a];
+		}
+
+		// The SAH may peel off one primitive per level. Once that could take a
+		// child past s_MaxDepth, halving is the only way to stay within it.
+		size_t span = end - start;
+		int axis;
+		size_t mid = depth + 1 + median_levels(span, maxLeafSize) <= s_MaxDepth
+			? split(info, start, end, bounds, centroidBounds, maxLeafSize, intersectionCost, axis)
+			: split_median(info, start, end, centroidBounds, maxLeafSize, axis);
+
+		if (mid == start)
+		{
+			nodes[index].primitivesOffset = static_cast<int32_t>(start);
+			nodes[index].primitiveCount = static_cast<uint16_t>(span);
+			return;
+		}
+
+		nodes[index].primitiveCount = 0;
+		nodes[index].axis = static_cast<uint8_t>(axis);
+
+		if (span >= s_ParallelThreshold && depth < s_ParallelDepth)
+		{
+			// The two halves touch disjoint ranges of info, so the left one can be
+			// built on another thread while this one takes the right.
+			auto left = std::async(std::launch::async, [&info, start, mid, maxLeafSize, intersectionCost, depth]() {
+				return build_binary(info, start, mid, maxLeafSize, intersectionCost, depth + 1);
+			});
+			std::vector<linear_bvh_node> right = build_binary(info, mid, end, maxLeafSize, intersectionCost, depth + 1);
+
+			append(nodes, left.get());
+			nodes[index].secondChildOffset = static_cast<int32_t>(nodes.size());
+			append(nodes, right);
+		}
 		else
 		{
-			std::sort(objects.begin() + start, objects.begin() + end, comparator);
-			auto mid = start + object_span / 2;
-			m_Left = std::make_shared<bvh_node>(objects, start, mid, time0, time1);
-			m_Right = std::make_shared<bvh_node>(objects, mid, end, time0, time1);
+			build_into(nodes, info, start, mid, maxLeafSize, intersectionCost, depth + 1);
+			nodes[index].secondChildOffset = static_cast<int32_t>(nodes.size());
+			build_into(nodes, info, mid, end, maxLeafSize, intersectionCost, depth + 1);
 		}
+	}
+
+	// Partitions info[start, end) along the cheapest binned SAH plane and
+	// returns the first index of the right half, or start if a leaf is cheaper.
+	static size_t split(std::vector<bvh_primitive_info>& info, size_t start, size_t end,
+		const aabb& bounds, const aabb& centroidBounds, int maxLeafSize, float intersectionCost, int& axis)
+	{
+		size_t span = end - start;
+		vec3 extent = centroidBounds.GetMax() - centroidBounds.GetMin();
+		axis = extent.x() > extent.y() ? (extent.x() > extent.z() ? 0 : 2) : (extent.y() > extent.z() ? 1 : 2);
+
+		if (span <= 1)
+			return start;
+
+		// Coincident centroids cannot be binned, halve them if they do not fit a leaf
+		if (extent[axis] <= 0.0f)
+			return span <= static_cast<size_t>(maxLeafSize) ? start : start + span / 2;
+
+		struct bin
+		{
+			aabb bounds = aabb::empty();
+			size_t count = 0;
+		};
+
+		float bestCost = INF;
+		int bestAxis = axis;
+		int bestBin = 0;
 
-		aabb box_left, box_right;
+		for (int a = 0; a < 3; a++)
+		{
+			if (extent[a] <= 0.0f)
+				continue;
 
-		if (!m_Left->bounding_box(time0, time1, box_left) || !m_Right->bounding_box(time0, time1, box_right))
-			std::cerr << "No bounding box in bvh_node constructor.\n";
+			bin bins[s_BinCount];
+			float offset = centroidBounds.GetMin()[a];
+			float scale = s_BinCount / extent[a];
 
-		m_Box = surrounding_box(box_left, box_right);
+			for (size_t i = start; i < end; i++)
+			{
+				int b = std::min(s_BinCount - 1, static_cast<int>((info[i].centroid[a] - offset) * scale));
+				bins[b].bounds.expand(info[i].bounds);
+				bins[b].count++;
+			}
+
+			// Sweep from the right to get the area and count of every right half,
+			// then from the left evaluating each of the s_BinCount - 1 planes.
+			float rightArea[s_BinCount];
+			size_t rightCount[s_BinCount];
+			aabb accum = aabb::empty();
+			size_t count = 0;
+			for (int b = s_BinCount - 1; b > 0; b--)
+			{
+				accum.expand(bins[b].bounds);
+				count += bins[b].count;
+				rightArea[b] = count == 0 ? 0.0f : accum.surface_area();
+				rightCount[b] = count;
+			}
+
+			accum = aabb::empty();
+			count = 0;
+			for (int b = 0; b < s_BinCount - 1; b++)
+			{
+				accum.expand(bins[b].bounds);
+				count += bins[b].count;
+
+				if (count == 0 || rightCount[b + 1] == 0)
+					continue;
+
+				float cost = count * accum.surface_area() + rightCount[b + 1] * rightArea[b + 1];
+				if (cost < bestCost)
+				{
+					bestCost = cost;
+					bestAxis = a;
+					bestBin = b;
+				}
+			}
+		}
+
+		float leafCost = intersectionCost * span;
+		bestCost = s_TraversalCost + intersectionCost * bestCost / bounds.surface_area();
+
+		if (span <= static_cast<size_t>(maxLeafSize) && leafCost <= bestCost)
+			return start;
+
+		axis = bestAxis;
+		float offset = centroidBounds.GetMin()[axis];
+		float scale = s_BinCount / extent[axis];
+		auto middle = std::partition(info.begin() + start, info.begin() + end,
+			[=](const bvh_primitive_info& prim) {
+				return std::min(s_BinCount - 1, static_cast<int>((prim.centroid[axis] - offset) * scale)) <= bestBin;
+			});
+
+		size_t mid = middle - info.begin();
+		if (mid == start || mid == end)
+			mid = start + span / 2;
+		return mid;
 	}
 
-	virtual bool hit(const ray& r, float t_min, float t_max, hit_record& rec) const override
+	// Levels of median splits below a node of span primitives down to leaves of
+	// at most maxLeafSize
+	static int median_levels(size_t span, int maxLeafSize)
 	{
-		if (!m_Box.hit(r, t_min, t_max))
-			return false;
+		int levels = 0;
+		for (size_t leaves = (span + maxLeafSize - 1) / maxLeafSize; leaves > 1; leaves = (leaves + 1) / 2)
+			levels++;
+		return levels;
+	}
+
+	// Halves info[start, end) at the median centroid along the widest axis and
+	// returns the first index of the right half, or start if it fits a leaf.
+	static size_t split_median(std::vector<bvh_primitive_info>& info, size_t start, size_t end,
+		const aabb& centroidBounds, int maxLeafSize, int& axis)
+	{
+		size_t span = end - start;
+		vec3 extent = centroidBounds.GetMax() - centroidBounds.GetMin();
+		axis = extent.x() > extent.y() ? (extent.x() > extent.z() ? 0 : 2) : (extent.y() > extent.z() ? 1 : 2);
+
+		if (span <= static_cast<size_t>(maxLeafSize))
+			return start;
+
+		size_t mid = start + span / 2;
+		std::nth_element(info.begin() + start, info.begin() + mid, info.begin() + end,
+			[=](const bvh_primitive_info& a, const bvh_primitive_info& b) {
+				return a.centroid[axis] < b.centroid[axis];
+			});
+		return mid;
+	}
+
+	// Appends a subtree built on its own, shifting its child links past the
+	// nodes that are already there.
+	static void append(std::vector<linear_bvh_node>& nodes, const std::vector<linear_bvh_node>& subtree)
+	{
+		int32_t base = static_cast<int32_t>(nodes.size());
+		for (linear_bvh_node node : subtree)
+		{
+			if (node.primitiveCount == 0)
+				node.secondChildOffset += base;
+			nodes.push_back(node);
+		}
+	}
+
+	std::vector<wide_bvh_node> m_Nodes;
+	const wide_bvh_node* m_External = nullptr;
+	size_t m_ExternalCount = 0;
+	aabb m_Bounds;
+	float m_SahCost = 0.0f;
+};
+
+class bvh_node : public hittable
+{
+public:
+	static const int s_MaxLeafSize = 4;
 
-		bool hit_left = m_Left->hit(r, t_min, t_max, rec);
-		bool hit_right = m_Right->hit(r, t_min, hit_left ? rec.t : t_max, rec);
+	bvh_node() {}
+	bvh_node(hittable_list& list, float time0, float time1)
+		: bvh_node(list.m_Objects, 0, list.GetObjects().size(), time0, time1)
+	{}
 
-		return hit_left || hit_right;
+	bvh_node(std::vector<std::shared_ptr<hittable>>& objects,
+		size_t start, size_t end, double time0, double time1)
+	{
+		std::vector<bvh_primitive_info> info;
+		info.reserve(end - start);
+
+		for (size_t i = start; i < end; i++)
+		{
+			aabb box;
+			if (!objects[i]->bounding_box(time0, time1, box))
+				std::cerr << "No bounding box in bvh_node constructor.\n";
+
+			info.push_back({ i, box, 0.5f * (box.GetMin() + box.GetMax()) });
+		}
+
+		m_Tree.build(info, s_MaxLeafSize);
+
+		// Leaves index into info, which the build left in leaf order
+		m_Primitives.reserve(info.size());
+		for (const auto& prim : info)
+			m_Primitives.push_back(objects[prim.index]);
+	}
+
+	virtual bool hit(const ray& r, float t_min, float t_max, hit_record& rec) const override
+	{
+		return hit_counted(r, t_min, t_max, rec, nullptr);
 	};
 
+	// hit, also adding the number of tree nodes it tested to visits
+	bool hit_counted(const ray& r, float t_min, float t_max, hit_record& rec, int* visits) const
+	{
+		return m_Tree.traverse(r, t_min, t_max, [&](int first, int count, float& closest) {
+			bool hit_anything = false;
+			for (int i = first; i < first + count; i++)
+			{
+				if (m_Primitives[i]->hit(r, t_min, closest, rec))
+				{
+					hit_anything = true;
+					closest = rec.t;
+				}
+			}
+			return hit_anything;
+		}, visits);
+	}
+
+	virtual int hit_packet(const ray_packet& packet, int mask, float t_min, float* t_max, hit_record* recs) const override
+	{
+		return m_Tree.traverse_packet(packet, mask, t_min, t_max, [&](int first, int count, int rays, float* closest) {
+			int hits = 0;
+			for (int i = first; i < first + count; i++)
+				hits |= m_Primitives[i]->hit_packet(packet, rays, t_min, closest, recs);
+			return hits;
+		});
+	}
+
+	// Visits every leaf the ray passes through, since crossings never shrink
+	// the search range.
+	virtual void crossings(const ray& r, float t_min, float t_max, crossing_list& out) const override
+	{
+		m_Tree.traverse(r, t_min, t_max, [&](int first, int count, float&) {
+			for (int i = first; i < first + count; i++)
+				m_Primitives[i]->crossings(r, t_min, t_max, out);
+			return false;
+		});
+	}
+
 	virtual bool bounding_box(float t0, float t1, aabb& output_box) const override
 	{
-		output_box = m_Box;
+		if (m_Tree.empty())
+			return false;
+
+		output_box = m_Tree.bounds();
 		return true;
 	};
 
+	float sah_cost() const { return m_Tree.sah_cost(); }
+
 private:
-	std::shared_ptr<hittable> m_Left;
-	std::shared_ptr<hittable> m_Right;
-	aabb m_Box;
+	bvh_tree m_Tree;
+	std::vector<std::shared_ptr<hittable>> m_Primitives;
 };
-
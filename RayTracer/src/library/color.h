@@ -6,23 +6,46 @@
 #include "math.h"
 #include "vec3.h"
 
-#include <iostream>
+#include <cstddef>
+#include <cstdint>
 
-void writeColor(std::ostream& out, color pixelColor, int samples_per_pixel = 1) {
-	float r = pixelColor.x();
-	float g = pixelColor.y();
-	float b = pixelColor.z();
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+	#include <emmintrin.h>
+	#define RT_COLOR_SSE 1
+#endif
 
-	// Divide by number of samples per pixel. Approximate gamma correction as sqrt
-	float scale = 1.0f / samples_per_pixel;
-	r = sqrt(scale * r);
-	g = sqrt(scale * g);
-	b = sqrt(scale * b);
+static_assert(sizeof(color) == 3 * sizeof(float), "colors are read as packed float triples");
 
-	out << static_cast<int>(255.999f * clamp(r, 0.0f, 0.999f)) << ' '
-		<< static_cast<int>(255.999f * clamp(g, 0.0f, 0.999f)) << ' '
-		<< static_cast<int>(255.999f * clamp(b, 0.0f, 0.999f)) << '\n';
+// Converts n accumulated channel values to 8 bits: divide by the number of
+// samples, approximate gamma correction as sqrt and clamp. The channels of a
+// whole row are independent, so four are done per SSE instruction.
+inline void quantize(const float* in, uint8_t* out, size_t n, int samples_per_pixel)
+{
+	float scale = 1.0f / samples_per_pixel;
+	size_t i = 0;
+
+#if defined(RT_COLOR_SSE)
+	const __m128 vscale = _mm_set1_ps(scale);
+	const __m128 lo = _mm_setzero_ps();
+	const __m128 hi = _mm_set1_ps(0.999f);
+	const __m128 range = _mm_set1_ps(255.999f);
+
+	for (; i + 16 <= n; i += 16)
+	{
+		__m128i q[4];
+		for (int k = 0; k < 4; k++)
+		{
+			__m128 v = _mm_sqrt_ps(_mm_mul_ps(vscale, _mm_loadu_ps(in + i + 4 * k)));
+			v = _mm_min_ps(_mm_max_ps(v, lo), hi);
+			q[k] = _mm_cvttps_epi32(_mm_mul_ps(range, v));
+		}
+		__m128i packed = _mm_packus_epi16(_mm_packs_epi32(q[0], q[1]), _mm_packs_epi32(q[2], q[3]));
+		_mm_storeu_si128(reinterpret_cast<__m128i*>(out + i), packed);
+	}
+#endif
+
+	for (; i < n; i++)
+		out[i] = static_cast<uint8_t>(255.999f * clamp(sqrt(scale * in[i]), 0.0f, 0.999f));
 }
 
-
-#endif
\ No newline at end of file
+#endif
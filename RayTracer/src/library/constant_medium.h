@@ -3,74 +3,105 @@
 #include "hittable.h"
 #include "material.h"
 
+#include <cstring>
+
 class constant_medium : public hittable
 {
 public:
-	constant_medium(std::shared_ptr<hittable> b, float d, std::shared_ptr<texture> a)
-		: m_Boundary(b), m_NegInverseDensity(-1/d)
+	// The phase function is a material of the scene, usually isotropic
+	constant_medium(std::shared_ptr<hittable> b, float d, material_id phase)
+		: m_Boundary(b), m_NegInverseDensity(-1/d), m_PhaseFunction(phase) {}
+
+	virtual bool hit(const ray& r, float t_min, float t_max, hit_record& rec) const override
 	{
-		m_PhaseFunction = std::make_shared<isotropic>(a);
+		return hit_medium(*m_Boundary, m_NegInverseDensity, m_PhaseFunction, r, t_min, t_max, rec);
 	}
 
-	virtual bool hit(const ray& r, float t_min, float t_max, hit_record& rec) const override
+	virtual bool bounding_box(float t0, float t1, aabb& output_box) const override
+	{
+		return m_Boundary->bounding_box(t0, t1, output_box);
+	}
+
+	// The medium inside shape, for callers that keep their boundaries themselves
+	static bool hit_medium(const hittable& shape, float negInverseDensity, material_id phase,
+		const ray& r, float t_min, float t_max, hit_record& rec)
 	{
+		RT_STAT(render_stats::local().tests[render_stats::prim_medium]++);
+
 		// Print occasional samples when debugging. To enable, set enableDebug true
 		const bool enableDebug = false;
 		const bool debugging = enableDebug && random_float() < 0.00001;
 
-		hit_record rec1, rec2;
-
-		if (!m_Boundary->hit(r, -INF, INF, rec1))
-			return false;
-
-		if (!m_Boundary->hit(r, rec1.t + 0.0001, INF, rec2))
+		// One query for every entry and exit of the boundary, which alternate.
+		// The first entry is behind the origin when the ray starts inside.
+		crossing_list boundary;
+		shape.crossings(r, -INF, INF, boundary);
+		if (boundary.count < 2)
 			return false;
 
 		if (debugging)
-			std::cerr << "\nt0=" << rec1.t << ", t1=" << rec2.t << '\n';
-		
-		if (rec1.t < t_min)
-			rec1.t = t_min;
-		if (rec2.t > t_max)
-			rec2.t = t_max;
-
-		if (rec1.t >= rec2.t)
-			return false;
+			std::cerr << "\nt0=" << boundary.t[0] << ", t1=" << boundary.t[1] << '\n';
 
-		if (rec1.t < 0)
-			rec1.t = 0;
+		// Draw from the ray's own stream, salted with where it enters the boundary
+		// so a ray crossing several media gets an independent distance in each.
+		uint32_t entry;
+		std::memcpy(&entry, &boundary.t[0], sizeof(entry));
+		sampler s((static_cast<uint64_t>(r.GetSeed()) << 32) | entry);
 
+		// A single free path is drawn and used up by the stretches inside the
+		// boundary in turn, which for a homogeneous medium is the same as drawing
+		// it over their total length.
 		const float ray_length = r.GetDirection().length();
-		const float distance_inside_boundary = (rec2.t - rec1.t) * ray_length;
-		const float hit_distance = m_NegInverseDensity * log(random_float());
-
-		if (hit_distance > distance_inside_boundary)
-			return false;
-
-		rec.t = rec1.t + hit_distance / ray_length;
-		rec.p = r.at(rec.t);
+		float hit_distance = -1.0f;
 
-		if (debugging)
+		for (int i = 0; i + 1 < boundary.count; i += 2)
 		{
-			std::cerr << "hit_distance = " << hit_distance << '\n'
-				<< "rec.t = " << rec.t << '\n'
-				<< "rec.p = " << rec.p << '\n';
+			float t0 = boundary.t[i], t1 = boundary.t[i + 1];
+			if (t0 < t_min)
+				t0 = t_min;
+			if (t1 > t_max)
+				t1 = t_max;
+
+			if (t0 >= t1)
+				continue;
+
+			if (t0 < 0)
+				t0 = 0;
+
+			if (hit_distance < 0.0f)
+				hit_distance = negInverseDensity * log(1.0f - s.next());
+
+			const float distance_inside_boundary = (t1 - t0) * ray_length;
+			if (hit_distance > distance_inside_boundary)
+			{
+				hit_distance -= distance_inside_boundary;
+				continue;
+			}
+
+			rec.t = t0 + hit_distance / ray_length;
+			rec.p = r.at(rec.t);
+
+			if (debugging)
+			{
+				std::cerr << "hit_distance = " << hit_distance << '\n'
+					<< "rec.t = " << rec.t << '\n'
+					<< "rec.p = " << rec.p << '\n';
+			}
+
+			rec.normal = vec3(1.0f, 0.0f, 0.0f); // arbitrary
+			rec.front_face = true; // arbitrary
+			rec.u = rec.v = rec.footprint = 0.0f;
+			rec.matId = phase;
+			rec.primId = 0;
+
+			return true;
 		}
 
-		rec.normal = vec3(1.0f, 0.0f, 0.0f); // arbitrary
-		rec.front_face = true; // arbitrary
-		rec.matPtr = m_PhaseFunction;
-
-		return true;
-	}
-
-	virtual bool bounding_box(float t0, float t1, aabb& output_box) const override
-	{
-		return m_Boundary->bounding_box(t0, t1, output_box);
+		return false;
 	}
 
 private:
 	std::shared_ptr<hittable> m_Boundary;
 	float m_NegInverseDensity;
-	std::shared_ptr<material> m_PhaseFunction;
+	material_id m_PhaseFunction;
 };
\ No newline at end of file
@@ -0,0 +1,65 @@
+#pragma once
+
+#ifndef FRAMEBUFFER_H
+#define FRAMEBUFFER_H
+
+#include "math.h"
+#include "color.h"
+
+#include <vector>
+
+// Auxiliary outputs of the first hit of a camera ray, for denoisers and
+// compositing. Albedo and normal are summed over the samples like the color,
+// depth keeps the nearest distance.
+struct pixel_aov
+{
+	color albedo = color(0.0f);
+	vec3 normal = vec3(0.0f);
+	float depth = INF;
+
+	void add(const pixel_aov& sample)
+	{
+		albedo += sample.albedo;
+		normal += sample.normal;
+		depth = fmin(depth, sample.depth);
+	}
+};
+
+// Accumulated radiance for every pixel. Row 0 is the bottom of the image,
+// matching the camera's v axis. A framebuffer can also hold just a window of
+// a larger image, whose pixels keep their coordinates in the whole image.
+class framebuffer
+{
+public:
+	framebuffer(int width, int height, bool aovs = false, int x0 = 0, int y0 = 0)
+		: m_Width(width), m_Height(height), m_X0(x0), m_Y0(y0), m_Pixels(static_cast<size_t>(width) * height)
+	{
+		if (aovs)
+			m_Aovs.resize(m_Pixels.size());
+	}
+
+	int GetWidth() const { return m_Width; }
+	int GetHeight() const { return m_Height; }
+	int GetX0() const { return m_X0; }
+	int GetY0() const { return m_Y0; }
+	bool HasAovs() const { return !m_Aovs.empty(); }
+
+	color& at(int x, int y) { return m_Pixels[index(x, y)]; }
+	const color& at(int x, int y) const { return m_Pixels[index(x, y)]; }
+
+	pixel_aov& aov_at(int x, int y) { return m_Aovs[index(x, y)]; }
+	const pixel_aov& aov_at(int x, int y) const { return m_Aovs[index(x, y)]; }
+
+	// The channels of row y as 3 * width consecutive floats
+	const float* row(int y) const { return m_Pixels[index(m_X0, y)].e; }
+
+private:
+	size_t index(int x, int y) const { return static_cast<size_t>(y - m_Y0) * m_Width + (x - m_X0); }
+
+	int m_Width, m_Height;
+	int m_X0, m_Y0;
+	std::vector<color> m_Pixels;
+	std::vector<pixel_aov> m_Aovs;
+};
+
+#endif
@@ -0,0 +1,106 @@
+#pragma once
+
+#ifndef HEATMAP_H
+#define HEATMAP_H
+
+#include "framebuffer.h"
+#include "image_output.h"
+#include "stats.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+// The cost of every pixel summed over its samples, either the BVH nodes its
+// rays visited, which needs RT_ENABLE_STATS, or the time spent on it. Each
+// pixel is only written by the worker owning its tile, so nothing is locked.
+class cost_heatmap
+{
+public:
+	enum quantity { nodes, time };
+
+	// Measures the cost of what happens during its lifetime, for whichever
+	// pixel it is added to. A null map makes it do nothing.
+	class meter
+	{
+	public:
+		explicit meter(const cost_heatmap* map)
+			: m_Map(map)
+		{
+			if (!m_Map)
+				return;
+			if (m_Map->m_Quantity == nodes)
+				m_StartNodes = render_stats::local().nodes;
+			else
+				m_Start = std::chrono::steady_clock::now();
+		}
+
+		// Nodes, or nanoseconds, so far
+		double elapsed() const
+		{
+			if (!m_Map)
+				return 0.0;
+			if (m_Map->m_Quantity == nodes)
+				return static_cast<double>(render_stats::local().nodes - m_StartNodes);
+			return std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - m_Start).count();
+		}
+
+	private:
+		const cost_heatmap* m_Map;
+		uint64_t m_StartNodes = 0;
+		std::chrono::steady_clock::time_point m_Start;
+	};
+
+	cost_heatmap(int width, int height, quantity q)
+		: m_Width(width), m_Height(height), m_Quantity(q), m_Cost(static_cast<size_t>(width) * height, 0.0) {}
+
+	void add(int x, int y, double cost) { m_Cost[static_cast<size_t>(y) * m_Width + x] += cost; }
+
+	// .ppm gets false colors from black through blue, red and yellow to white,
+	// with white at the 99th percentile so a few outliers do not wash out the
+	// rest. .pfm and .exr get the raw cost in every channel.
+	bool write(const std::string& path) const
+	{
+		framebuffer image(m_Width, m_Height);
+		if (!image_output::ends_with(path, ".ppm"))
+		{
+			for (int y = 0; y < m_Height; y++)
+				for (int x = 0; x < m_Width; x++)
+					image.at(x, y) = color(static_cast<float>(m_Cost[static_cast<size_t>(y) * m_Width + x]));
+			return write_image(path, image, 1);
+		}
+
+		std::vector<double> sorted(m_Cost);
+		size_t rank = sorted.size() * 99 / 100;
+		std::nth_element(sorted.begin(), sorted.begin() + rank, sorted.end());
+		double scale = sorted[rank] > 0.0 ? 1.0 / sorted[rank] : 0.0;
+
+		for (int y = 0; y < m_Height; y++)
+			for (int x = 0; x < m_Width; x++)
+			{
+				// The writer takes the square root of what it is given
+				color c = false_color(static_cast<float>(std::min(1.0, m_Cost[static_cast<size_t>(y) * m_Width + x] * scale)));
+				image.at(x, y) = c * c;
+			}
+		return write_image(path, image, 1);
+	}
+
+private:
+	static color false_color(float t)
+	{
+		static const color stops[] = { color(0, 0, 0), color(0.1f, 0.1f, 0.8f), color(0.85f, 0.1f, 0.2f), color(1, 0.85f, 0.1f), color(1, 1, 1) };
+		const int last = static_cast<int>(sizeof(stops) / sizeof(stops[0])) - 1;
+		float f = t * last;
+		int i = std::min(static_cast<int>(f), last - 1);
+		float w = f - i;
+		return (1.0f - w) * stops[i] + w * stops[i + 1];
+	}
+
+	int m_Width, m_Height;
+	quantity m_Quantity;
+	std::vector<double> m_Cost;
+};
+
+#endif
@@ -6,15 +6,29 @@
 #include "math.h"
 #include "ray.h"
 #include "aabb.h"
+#include "stats.h"
 
-class material; // to notify hittables of materials
+#include <cstdint>
+#include <type_traits>
 
+// Index of a material in the scene's material_table
+using material_id = uint32_t;
+const material_id no_material = UINT32_MAX;
+
+// Plain data, copied freely while tracing. Materials are referred to by id
+// instead of a shared_ptr, so keeping the closest hit never touches a
+// reference count.
 struct hit_record {
 	point3 p;
 	vec3 normal;
-	std::shared_ptr<material> matPtr;
+	material_id matId;
+	uint32_t primId; // Primitive inside the hittable that was hit, 0 for single shapes
 	float t;
 	float u, v; // Surface texture Coords
+	// Width of the pixel's ray cone at the hit, in texture coords. Hittables
+	// set it to the change of u and v per unit of distance on the surface, or 0
+	// without a mapping, and the integrator scales it by the cone's width.
+	float footprint;
 	bool front_face;
 
 	inline void set_face_normal(const ray& r, const vec3& outward_normal)
@@ -24,150 +38,121 @@ struct hit_record {
 	}
 };
 
+static_assert(std::is_trivially_copyable<hit_record>::value, "hit_record is copied as plain data");
+
+// The distances along a ray at which it crosses a surface, in increasing
+// order. Only the s_Capacity nearest are kept.
+struct crossing_list
+{
+	static const int s_Capacity = 16;
+
+	float t[s_Capacity] = {};
+	int count = 0;
+
+	void insert(float value)
+	{
+		if (count == s_Capacity && value >= t[s_Capacity - 1])
+			return;
+
+		int i = count < s_Capacity ? count++ : s_Capacity - 1;
+		for (; i > 0 && t[i - 1] > value; i--)
+			t[i] = t[i - 1];
+		t[i] = value;
+	}
+};
+
 class hittable {
 public:
 	virtual bool hit(const ray& r, float t_min, float t_max, hit_record& rec) const = 0;
 	virtual bool bounding_box(float t0, float t1, aabb& output_box) const = 0;
-};
 
-class flip_face : public hittable
-{
-public:
-	flip_face(std::shared_ptr<hittable> ptr)
-		: m_Ptr(ptr) {}
-
-	virtual bool hit(const ray& r, float t_min, float t_max, hit_record& rec) const override
+	// Intersects the rays of the packet selected by mask. Works like hit for each
+	// of them, shrinking t_max[i] and filling recs[i] on a hit, and returns the
+	// mask of rays that hit. Hittables that can share work between coherent rays
+	// override it, everything else traces the rays one by one.
+	virtual int hit_packet(const ray_packet& packet, int mask, float t_min, float* t_max, hit_record* recs) const
 	{
-		if (!m_Ptr->hit(r, t_min, t_max, rec))
-			return false;
+		int hits = 0;
+		for (int i = 0; i < packet.count; i++)
+		{
+			if ((mask & (1 << i)) && hit(packet.rays[i], t_min, t_max[i], recs[i]))
+			{
+				hits |= 1 << i;
+				t_max[i] = recs[i].t;
+			}
+		}
+		return hits;
+	}
 
-		rec.front_face = !rec.front_face;
-		return true;
-	};
+	// Adds to out every distance in (t_min, t_max) at which r crosses the
+	// surface. For a hittable enclosing a volume they alternate between
+	// entering and leaving it, which is all participating media need to know.
+	// Shapes with a closed form override it. Otherwise hit is repeated from
+	// just past each crossing found, which works for any closed surface. The
+	// step grows with the distance, so far crossings are still stepped over
+	// where a fixed epsilon would round away.
+	virtual void crossings(const ray& r, float t_min, float t_max, crossing_list& out) const
+	{
+		hit_record rec;
+		for (int n = 0; n < crossing_list::s_Capacity && hit(r, t_min, t_max, rec); n++)
+		{
+			out.insert(rec.t);
+			t_min = rec.t + 1e-5f * fmax(fabs(rec.t), 10.0f);
+		}
+	}
 
-	virtual bool bounding_box(float t0, float t1, aabb& output_box) const override
+	// Light sampling, only implemented by shapes that can be used as lights.
+	// pdf_value is the density, per solid angle seen from o, with which random
+	// picks direction v, or 0 if v misses the shape. random returns a direction
+	// from o towards a point on the shape.
+	virtual float pdf_value(const point3& o, const vec3& v) const
 	{
-		return m_Ptr->bounding_box(t0, t1, output_box);
-	};
+		return 0.0f;
+	}
 
-private:
-	std::shared_ptr<hittable> m_Ptr;
+	virtual vec3 random(const point3& o, sampler& s) const
+	{
+		return vec3(1.0f, 0.0f, 0.0f);
+	}
 };
 
-class translate : public hittable
+class flip_face : public hittable
 {
 public:
-	translate(std::shared_ptr<hittable> p, const vec3& displacement)
-		: m_Ptr(p), m_Offset(displacement) {}
+	flip_face(std::shared_ptr<hittable> ptr)
+		: m_Ptr(ptr) {}
 
 	virtual bool hit(const ray& r, float t_min, float t_max, hit_record& rec) const override
 	{
-		ray movedRay(r.GetOrigin() - m_Offset, r.GetDirection(), r.GetTime());
-
-		if (!m_Ptr->hit(movedRay, t_min, t_max, rec))
+		if (!m_Ptr->hit(r, t_min, t_max, rec))
 			return false;
 
-		rec.p += m_Offset;
-		rec.set_face_normal(movedRay, rec.normal);
-
+		rec.front_face = !rec.front_face;
 		return true;
 	};
 
 	virtual bool bounding_box(float t0, float t1, aabb& output_box) const override
 	{
-		if (!m_Ptr->bounding_box(t0, t1, output_box))
-			return false;
-
-		output_box = aabb(output_box.GetMin() + m_Offset, output_box.GetMax() + m_Offset);
-		return true;
+		return m_Ptr->bounding_box(t0, t1, output_box);
 	};
 
-private:
-	std::shared_ptr<hittable> m_Ptr;
-	vec3 m_Offset;
-};
-
-class rotate_y : public hittable
-{
-public:
-	rotate_y(std::shared_ptr<hittable> p, float angle)
-		: m_Ptr(p) 
+	virtual void crossings(const ray& r, float t_min, float t_max, crossing_list& out) const override
 	{
-		float radians = degrees_to_radians(angle);
-		sin_theta = sin(radians);
-		cos_theta = cos(radians);
-		m_HasBox = m_Ptr->bounding_box(0, 1, m_BB);
-
-		point3 min(INF);
-		point3 max(-INF);
-
-		for (int i = 0; i < 2; i++)
-		{
-			for (int j = 0; j < 2; j++)
-			{
-				float x = i * m_BB.GetMax().x() + (1 - i) * m_BB.GetMin().x();
-				float y = i * m_BB.GetMax().y() + (1 - i) * m_BB.GetMin().y();
-				float z = i * m_BB.GetMax().z() + (1 - i) * m_BB.GetMin().z();
-
-				float newX = cos_theta * x + sin_theta * z;
-				float newZ = -sin_theta * x + cos_theta * z;
-
-				vec3 tester(newX, y, newZ);
-
-				for (int c = 0; c < 3; c++)
-				{
-					min[c] = fmin(min[c], tester[c]);
-					max[c] = fmin(max[c], tester[c]);
-				}
-			}
-		}
-
-		m_BB = aabb(min, max);
+		m_Ptr->crossings(r, t_min, t_max, out);
 	}
 
-	virtual bool hit(const ray& r, float t_min, float t_max, hit_record& rec) const override
+	virtual float pdf_value(const point3& o, const vec3& v) const override
 	{
-		vec3 origin = r.GetOrigin();
-		vec3 direction = r.GetDirection();
-
-		origin[0] = cos_theta * r.GetOrigin()[0] - sin_theta * r.GetOrigin()[2];
-		origin[2] = sin_theta * r.GetOrigin()[0] + cos_theta * r.GetOrigin()[2];
-
-		direction[0] = cos_theta * r.GetDirection()[0] - sin_theta * r.GetDirection()[2];
-		direction[2] = sin_theta * r.GetDirection()[0] + cos_theta * r.GetDirection()[2];
-
-		ray rotated_r(origin, direction, r.GetTime());
-
-		if (!m_Ptr->hit(rotated_r, t_min, t_max, rec))
-			return false;
-
-		vec3 p = rec.p;
-		vec3 normal = rec.normal;
-
-		p[0] = cos_theta * rec.p[0] + sin_theta * rec.p[2];
-		p[2] = -sin_theta * rec.p[0] + cos_theta * rec.p[2];
-
-		normal[0] = cos_theta * rec.normal[0] + sin_theta * rec.normal[2];
-		normal[2] = -sin_theta * rec.normal[0] + cos_theta * rec.normal[2];
-
-		rec.p = p;
-		rec.set_face_normal(rotated_r, normal);
-
-		return true;
-	};
+		return m_Ptr->pdf_value(o, v);
+	}
 
-	virtual bool bounding_box(float t0, float t1, aabb& output_box) const override
+	virtual vec3 random(const point3& o, sampler& s) const override
 	{
-		output_box = m_BB;
-		return m_HasBox;
-	};
+		return m_Ptr->random(o, s);
+	}
 
 private:
 	std::shared_ptr<hittable> m_Ptr;
-	float sin_theta;
-	float cos_theta;
-	bool m_HasBox;
-	aabb m_BB;
 };
 
 #endif
\ No newline at end of file
@@ -40,6 +40,20 @@ public:
 		return hit_anything;
 	}
 
+	virtual int hit_packet(const ray_packet& packet, int mask, float t_min, float* t_max, hit_record* recs) const override
+	{
+		int hits = 0;
+		for (const auto& object : m_Objects)
+			hits |= object->hit_packet(packet, mask, t_min, t_max, recs);
+		return hits;
+	}
+
+	virtual void crossings(const ray& r, float t_min, float t_max, crossing_list& out) const override
+	{
+		for (const auto& object : m_Objects)
+			object->crossings(r, t_min, t_max, out);
+	}
+
 	virtual bool bounding_box(float t0, float t1, aabb& output_box) const override {
 		if (m_Objects.empty())
 			return false;
@@ -0,0 +1,254 @@
+#pragma once
+
+#ifndef IMAGE_OUTPUT_H
+#define IMAGE_OUTPUT_H
+
+#include "framebuffer.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+
+// Writers for a rendered framebuffer. Each one builds the complete file in
+// memory and hands it to the OS with a single write.
+//  .ppm  binary P6, tone mapped to 8 bits
+//  .pfm  32 bit float RGB, averaged but otherwise linear
+//  .exr  uncompressed 32 bit float OpenEXR, including the AOV channels
+//        (albedo, N, Z) when the framebuffer recorded them
+namespace image_output
+{
+	inline void append_bytes(std::vector<char>& out, const void* data, size_t size)
+	{
+		const char* bytes = static_cast<const char*>(data);
+		out.insert(out.end(), bytes, bytes + size);
+	}
+
+	inline void append_string(std::vector<char>& out, const std::string& s)
+	{
+		out.insert(out.end(), s.begin(), s.end());
+	}
+
+	// Floats are written in host order. PFM records the byte order in its
+	// header, OpenEXR is always little endian.
+	inline bool host_is_little_endian()
+	{
+		const uint16_t probe = 1;
+		uint8_t first;
+		std::memcpy(&first, &probe, 1);
+		return first == 1;
+	}
+
+	inline std::vector<char> encode_ppm(const framebuffer& image, int samples_per_pixel)
+	{
+		int width = image.GetWidth();
+		int height = image.GetHeight();
+		size_t rowBytes = 3 * static_cast<size_t>(width);
+
+		std::vector<char> out;
+		append_string(out, "P6\n" + std::to_string(width) + ' ' + std::to_string(height) + "\n255\n");
+
+		size_t header = out.size();
+		out.resize(header + rowBytes * height);
+
+		// P6 stores the top row first
+		for (int j = 0; j < height; j++)
+		{
+			uint8_t* dst = reinterpret_cast<uint8_t*>(out.data() + header + rowBytes * j);
+			quantize(image.row(height - 1 - j), dst, rowBytes, samples_per_pixel);
+		}
+		return out;
+	}
+
+	inline std::vector<char> encode_pfm(const framebuffer& image, int samples_per_pixel)
+	{
+		int width = image.GetWidth();
+		int height = image.GetHeight();
+		size_t rowFloats = 3 * static_cast<size_t>(width);
+		float scale = 1.0f / samples_per_pixel;
+
+		std::vector<char> out;
+		append_string(out, "PF\n" + std::to_string(width) + ' ' + std::to_string(height) + '\n');
+		append_string(out, host_is_little_endian() ? "-1.0\n" : "1.0\n");
+
+		// PFM stores the bottom row first, the same order as the framebuffer
+		std::vector<float> row(rowFloats);
+		for (int j = 0; j < height; j++)
+		{
+			const float* src = image.row(j);
+			for (size_t i = 0; i < rowFloats; i++)
+				row[i] = src[i] * scale;
+			append_bytes(out, row.data(), rowFloats * sizeof(float));
+		}
+		return out;
+	}
+
+	inline std::vector<char> encode_exr(const framebuffer& image, int samples_per_pixel)
+	{
+		int width = image.GetWidth();
+		int height = image.GetHeight();
+		float scale = 1.0f / samples_per_pixel;
+
+		// A channel is one float inside the color or AOV of every pixel
+		struct channel
+		{
+			const char* name;
+			bool aov;
+			size_t offset; // Byte offset of the float inside the element
+			bool average; // Divide by the sample count
+		};
+
+		const size_t albedo = offsetof(pixel_aov, albedo);
+		const size_t normal = offsetof(pixel_aov, normal);
+
+		// OpenEXR requires the channel list sorted by name, which is also the order
+		// of the per channel runs inside a scanline.
+		std::vector<channel> channels = {
+			{ "B", false, 2 * sizeof(float), true },
+			{ "G", false, 1 * sizeof(float), true },
+		};
+		if (image.HasAovs())
+		{
+			channels.push_back({ "N.X", true, normal + 0 * sizeof(float), true });
+			channels.push_back({ "N.Y", true, normal + 1 * sizeof(float), true });
+			channels.push_back({ "N.Z", true, normal + 2 * sizeof(float), true });
+		}
+		channels.push_back({ "R", false, 0, true });
+		if (image.HasAovs())
+		{
+			channels.push_back({ "Z", true, offsetof(pixel_aov, depth), false });
+			channels.push_back({ "albedo.B", true, albedo + 2 * sizeof(float), true });
+			channels.push_back({ "albedo.G", true, albedo + 1 * sizeof(float), true });
+			channels.push_back({ "albedo.R", true, albedo + 0 * sizeof(float), true });
+		}
+
+		std::vector<char> out;
+		auto append_i32 = [&out](int32_t v) { append_bytes(out, &v, 4); };
+		auto append_f32 = [&out](float v) { append_bytes(out, &v, 4); };
+		auto attribute = [&](const char* name, const char* type, int32_t size) {
+			append_bytes(out, name, std::strlen(name) + 1);
+			append_bytes(out, type, std::strlen(type) + 1);
+			append_i32(size);
+		};
+
+		// Magic number and version 2, single part scanline file
+		append_i32(20000630);
+		append_i32(2);
+
+		int32_t listSize = 1;
+		for (const channel& c : channels)
+			listSize += static_cast<int32_t>(std::strlen(c.name)) + 1 + 16;
+
+		attribute("channels", "chlist", listSize);
+		for (const channel& c : channels)
+		{
+			append_bytes(out, c.name, std::strlen(c.name) + 1);
+			append_i32(2); // FLOAT
+			append_i32(0); // pLinear and reserved bytes
+			append_i32(1); // x sampling
+			append_i32(1); // y sampling
+		}
+		out.push_back('\0');
+
+		attribute("compression", "compression", 1);
+		out.push_back(0); // NO_COMPRESSION
+
+		for (const char* window : { "dataWindow", "displayWindow" })
+		{
+			attribute(window, "box2i", 16);
+			append_i32(0);
+			append_i32(0);
+			append_i32(width - 1);
+			append_i32(height - 1);
+		}
+
+		attribute("lineOrder", "lineOrder", 1);
+		out.push_back(0); // INCREASING_Y
+
+		attribute("pixelAspectRatio", "float", 4);
+		append_f32(1.0f);
+
+		attribute("screenWindowCenter", "v2f", 8);
+		append_f32(0.0f);
+		append_f32(0.0f);
+
+		attribute("screenWindowWidth", "float", 4);
+		append_f32(1.0f);
+
+		out.push_back('\0');
+
+		// Offset table, then one block per scanline with y = 0 at the top
+		int32_t lineBytes = static_cast<int32_t>(channels.size() * width * sizeof(float));
+		uint64_t offset = out.size() + sizeof(uint64_t) * height;
+		for (int y = 0; y < height; y++)
+		{
+			append_bytes(out, &offset, sizeof(offset));
+			offset += 8 + lineBytes;
+		}
+
+		out.reserve(offset);
+		for (int y = 0; y < height; y++)
+		{
+			append_i32(y);
+			append_i32(lineBytes);
+
+			int row = height - 1 - y;
+			for (const channel& c : channels)
+			{
+				const char* base = c.aov
+					? reinterpret_cast<const char*>(&image.aov_at(0, row))
+					: reinterpret_cast<const char*>(&image.at(0, row));
+				size_t stride = c.aov ? sizeof(pixel_aov) : sizeof(color);
+				float factor = c.average ? scale : 1.0f;
+
+				size_t start = out.size();
+				out.resize(start + width * sizeof(float));
+				for (int x = 0; x < width; x++)
+				{
+					float v;
+					std::memcpy(&v, base + x * stride + c.offset, sizeof(float));
+					v *= factor;
+					std::memcpy(out.data() + start + x * sizeof(float), &v, sizeof(float));
+				}
+			}
+		}
+		return out;
+	}
+
+	inline bool ends_with(const std::string& s, const std::string& suffix)
+	{
+		return s.size() >= suffix.size() && s.compare(s.size() - suffix.size(), suffix.size(), suffix) == 0;
+	}
+}
+
+// Writes the framebuffer to path in the format picked by its extension.
+// Returns false for an unknown extension or if the file cannot be written.
+inline bool write_image(const std::string& path, const framebuffer& image, int samples_per_pixel)
+{
+	using namespace image_output;
+
+	// OpenEXR is little endian only
+	if (ends_with(path, ".exr") && !host_is_little_endian())
+		return false;
+
+	std::vector<char> data;
+	if (ends_with(path, ".ppm"))
+		data = encode_ppm(image, samples_per_pixel);
+	else if (ends_with(path, ".pfm"))
+		data = encode_pfm(image, samples_per_pixel);
+	else if (ends_with(path, ".exr"))
+		data = encode_exr(image, samples_per_pixel);
+	else
+		return false;
+
+	std::FILE* file = std::fopen(path.c_str(), "wb");
+	if (!file)
+		return false;
+
+	bool written = std::fwrite(data.data(), 1, data.size(), file) == data.size();
+	return std::fclose(file) == 0 && written;
+}
+
+#endif
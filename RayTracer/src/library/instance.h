@@ -0,0 +1,84 @@
+#pragma once
+
+#ifndef INSTANCE_H
+#define INSTANCE_H
+
+#include "hittable.h"
+#include "transform.h"
+
+// Places a hittable in the world through an affine transform. Rays are moved
+// into object space with the cached inverse, and since the direction is not
+// renormalized the hit distance is the same in both spaces. Wrapping another
+// instance folds both transforms into one, so chains of translate and
+// rotate_y cost a single matrix per ray no matter how deep they are.
+class instance : public hittable
+{
+public:
+	instance(std::shared_ptr<hittable> object, const affine_transform& objectToWorld)
+		: m_Object(object), m_ObjectToWorld(objectToWorld)
+	{
+		while (auto inner = std::dynamic_pointer_cast<instance>(m_Object))
+		{
+			m_ObjectToWorld = m_ObjectToWorld * inner->m_ObjectToWorld;
+			m_Object = inner->m_Object;
+		}
+
+		m_WorldToObject = m_ObjectToWorld.inverse();
+	}
+
+	virtual bool hit(const ray& r, float t_min, float t_max, hit_record& rec) const override
+	{
+		ray local(m_WorldToObject.apply_point(r.GetOrigin()), m_WorldToObject.apply_vector(r.GetDirection()), r.GetTime(), r.GetSeed());
+
+		if (!m_Object->hit(local, t_min, t_max, rec))
+			return false;
+
+		// The child's normal already faces the local ray. The inverse transpose
+		// keeps it facing the world ray, so front_face stays as the child set it.
+		rec.p = m_ObjectToWorld.apply_point(rec.p);
+		rec.normal = unit_vector(m_WorldToObject.apply_transposed(rec.normal));
+
+		return true;
+	}
+
+	// Distances are the same in both spaces, so the crossings need no mapping back
+	virtual void crossings(const ray& r, float t_min, float t_max, crossing_list& out) const override
+	{
+		ray local(m_WorldToObject.apply_point(r.GetOrigin()), m_WorldToObject.apply_vector(r.GetDirection()), r.GetTime(), r.GetSeed());
+		m_Object->crossings(local, t_min, t_max, out);
+	}
+
+	virtual bool bounding_box(float t0, float t1, aabb& output_box) const override
+	{
+		aabb box;
+		if (!m_Object->bounding_box(t0, t1, box))
+			return false;
+
+		output_box = m_ObjectToWorld.apply_box(box);
+		return true;
+	}
+
+	const affine_transform& GetTransform() const { return m_ObjectToWorld; }
+	const std::shared_ptr<hittable>& GetObject() const { return m_Object; }
+
+private:
+	std::shared_ptr<hittable> m_Object;
+	affine_transform m_ObjectToWorld;
+	affine_transform m_WorldToObject;
+};
+
+class translate : public instance
+{
+public:
+	translate(std::shared_ptr<hittable> p, const vec3& displacement)
+		: instance(p, affine_transform::translation(displacement)) {}
+};
+
+class rotate_y : public instance
+{
+public:
+	rotate_y(std::shared_ptr<hittable> p, float angle)
+		: instance(p, affine_transform::rotation_y(angle)) {}
+};
+
+#endif
@@ -0,0 +1,195 @@
+#pragma once
+
+#ifndef INTEGRATOR_H
+#define INTEGRATOR_H
+
+#include "hittable.h"
+#include "material.h"
+#include "framebuffer.h"
+#include "light_list.h"
+
+// The steps of a path that both integrators share. tracePath runs them one
+// path at a time, the wavefront integrator runs each of them over a whole
+// batch of paths. Every path draws from its own sampler in the same order
+// either way, so they produce the same image.
+//
+// Emission is gathered by two strategies: hitting an emitter after a scatter,
+// and next event estimation, which samples a direction towards the lights at
+// every non specular hit and traces a shadow ray. Contributions are combined
+// with multiple importance sampling so each strategy dominates where it has
+// less variance.
+
+// Balances two sampling strategies that can produce the same direction. The
+// one that drew it with density pdf keeps this share of the contribution.
+inline float power_heuristic(float pdf, float other)
+{
+	float a = pdf * pdf;
+	return a / (a + other * other);
+}
+
+// A shadow ray towards a point sampled on a light. Whatever emission it
+// reaches first is added to the path multiplied by weight.
+struct light_sample
+{
+	ray shadow;
+	color weight;
+};
+
+// What shading a hit produced besides the emission it added
+struct shade_result
+{
+	color attenuation;
+	ray scattered;
+	float scatteredPdf; // Density scatter picked the direction with, 0 for specular bounces
+	bool lit; // Whether light holds a shadow ray
+	light_sample light;
+};
+
+// Shades the hit rec of r, which scatter picked with density pdf (0 for camera
+// rays and specular bounces). Adds the emission of the hit to radiance,
+// weighted by the throughput of the path and, when the lights could have
+// picked r as well, by its MIS weight. Non specular materials also sample a
+// direction towards the lights, returned as a shadow ray in out.light.
+// Returns whether the material scatters, with the rest of out set. If aov is
+// not null it receives the albedo, normal and distance of the hit.
+inline bool shade_hit(const material& mat, const ray& r, const hit_record& rec, float pdf, const light_list* lights,
+	const color& throughput, color& radiance, sampler& s, pixel_aov* aov, shade_result& out)
+{
+	bool sampleLights = lights && !lights->empty();
+
+	color emitted = mat.emitted(rec.u, rec.v, rec.p);
+	if (sampleLights && pdf > 0.0f && (emitted.x() > 0.0f || emitted.y() > 0.0f || emitted.z() > 0.0f))
+		emitted *= power_heuristic(pdf, lights->pdf_value(r.GetOrigin(), r.GetDirection()));
+	radiance += throughput * emitted;
+
+	out.lit = false;
+	if (sampleLights && !mat.is_specular())
+	{
+		vec3 direction = lights->random(rec.p, s);
+		uint32_t seed = s.next_seed();
+		float lightPdf = lights->pdf_value(rec.p, direction);
+		color f = mat.eval(r, rec, direction);
+
+		if (lightPdf > 0.0f && (f.x() > 0.0f || f.y() > 0.0f || f.z() > 0.0f))
+		{
+			float weight = power_heuristic(lightPdf, mat.scattering_pdf(r, rec, direction));
+			out.light.shadow = ray(rec.p, direction, r.GetTime(), seed);
+			out.light.weight = throughput * f * (weight / lightPdf);
+			out.lit = true;
+		}
+	}
+
+	bool scatters = mat.scatter(r, rec, out.attenuation, out.scattered, s);
+	out.scatteredPdf = scatters && !mat.is_specular() ? mat.scattering_pdf(r, rec, out.scattered.GetDirection()) : 0.0f;
+
+	if (aov)
+	{
+		// Lights do not scatter, their clamped emission stands in for the albedo
+		aov->albedo = scatters ? out.attenuation : color(fmin(emitted.x(), 1.0f), fmin(emitted.y(), 1.0f), fmin(emitted.z(), 1.0f));
+		aov->normal = rec.normal;
+		aov->depth = rec.t * r.GetDirection().length();
+	}
+
+	return scatters;
+}
+
+// The emission a shadow ray reaches, weighted. Anything in the way that does
+// not emit, including a participating medium scattering it, blocks it.
+inline color connect_light(const light_sample& light, const hittable& world, const material_table& materials)
+{
+	RT_STAT(render_stats::local().shadowRays++);
+	hit_record rec;
+	if (!world.hit(light.shadow, 0.001f, INF, rec))
+		return color(0.0f);
+
+	return light.weight * materials[rec.matId].emitted(rec.u, rec.v, rec.p);
+}
+
+// Finishes the footprint of a hit whose hittable set it per unit of distance.
+// The cone of a pixel is followed along the whole path as if every bounce were
+// a flat mirror, so after rough bounces it is narrower than it should be and
+// textures stay on the sharp side.
+inline void widen_footprint(hit_record& rec, float spread, float distance)
+{
+	rec.footprint *= spread * distance;
+}
+
+// Carries the attenuation of a scattering event into the throughput. From
+// rr_depth bounces on, a path survives with probability equal to its largest
+// throughput channel and is reweighted by its inverse, which keeps it unbiased
+// while dark paths end early. Returns false if the path ends.
+inline bool continue_path(color& throughput, const color& attenuation, int depth, int rr_depth, sampler& s)
+{
+	throughput = throughput * attenuation;
+
+	if (depth + 1 >= rr_depth)
+	{
+		float survival = fmin(fmax(throughput.x(), fmax(throughput.y(), throughput.z())), 1.0f);
+		if (s.next() >= survival)
+		{
+			RT_STAT(render_stats::local().ends[render_stats::end_roulette]++);
+			return false;
+		}
+		throughput /= survival;
+	}
+
+	return true;
+}
+
+// Traces a path iteratively, carrying the product of the attenuations seen so far.
+// The first intersection of r has already been found by the caller: found tells
+// whether it hit anything, and rec holds the hit if so. lights may be null,
+// which leaves hitting emitters as the only way to find them. spread is the
+// camera's pixel_spread, which sets how blurry textures are looked up. If aov
+// is not null it receives the albedo, normal and distance of that first hit.
+inline color tracePath(const ray& r, bool found, hit_record rec, const color& background, const hittable& world, const material_table& materials,
+	const light_list* lights, int max_depth, int rr_depth, float spread, sampler& s, pixel_aov* aov = nullptr)
+{
+	color radiance(0.0f);
+	color throughput(1.0f);
+	ray current = r;
+	float pdf = 0.0f;
+	float distance = 0.0f; // Travelled along the path
+	RT_STAT(render_stats& stats = render_stats::local());
+
+	for (int depth = 0; depth < max_depth; depth++)
+	{
+		if (depth > 0)
+			found = world.hit(current, 0.001f, INF, rec);
+		RT_STAT(stats.count_rays(depth));
+
+		// If the ray hits nothing, the background is all that is left.
+		if (!found)
+		{
+			radiance += throughput * background;
+			RT_STAT(stats.ends[render_stats::end_escaped]++);
+			break;
+		}
+
+		distance += rec.t * current.GetDirection().length();
+		widen_footprint(rec, spread, distance);
+
+		shade_result shaded;
+		bool scatters = shade_hit(materials[rec.matId], current, rec, pdf, lights, throughput, radiance, s, depth == 0 ? aov : nullptr, shaded);
+
+		if (shaded.lit)
+			radiance += connect_light(shaded.light, world, materials);
+
+		if (!scatters)
+		{
+			RT_STAT(stats.ends[render_stats::end_absorbed]++);
+			break;
+		}
+
+		if (!continue_path(throughput, shaded.attenuation, depth, rr_depth, s))
+			break;
+
+		RT_STAT(if (depth + 1 == max_depth) stats.ends[render_stats::end_max_depth]++);
+		current = shaded.scattered;
+		pdf = shaded.scatteredPdf;
+	}
+
+	return radiance;
+}
+
+#endif
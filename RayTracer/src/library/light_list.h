@@ -0,0 +1,43 @@
+#pragma once
+
+#ifndef LIGHT_LIST_H
+#define LIGHT_LIST_H
+
+#include "hittable.h"
+
+#include <memory>
+#include <vector>
+
+// The emissive shapes of a scene, sampled directly for next event estimation.
+// The shapes are also part of the world, which is what shadow rays are traced
+// against. A light is picked uniformly, then a direction towards it.
+class light_list
+{
+public:
+	void add(std::shared_ptr<hittable> light) { m_Lights.push_back(light); }
+
+	bool empty() const { return m_Lights.empty(); }
+	size_t size() const { return m_Lights.size(); }
+
+	// Density of random picking direction v from o, per solid angle
+	float pdf_value(const point3& o, const vec3& v) const
+	{
+		float sum = 0.0f;
+		for (const auto& light : m_Lights)
+			sum += light->pdf_value(o, v);
+		return sum / m_Lights.size();
+	}
+
+	vec3 random(const point3& o, sampler& s) const
+	{
+		size_t index = static_cast<size_t>(s.next() * m_Lights.size());
+		if (index >= m_Lights.size())
+			index = m_Lights.size() - 1;
+		return m_Lights[index]->random(o, s);
+	}
+
+private:
+	std::vector<std::shared_ptr<hittable>> m_Lights;
+};
+
+#endif
@@ -0,0 +1,120 @@
+#pragma once
+
+#ifndef MAPPED_FILE_H
+#define MAPPED_FILE_H
+
+#include <cstddef>
+#include <cstdint>
+
+#if defined(_WIN32)
+	#ifndef NOMINMAX
+		#define NOMINMAX
+	#endif
+	#ifndef WIN32_LEAN_AND_MEAN
+		#define WIN32_LEAN_AND_MEAN
+	#endif
+	#include <windows.h>
+#else
+	#include <fcntl.h>
+	#include <sys/mman.h>
+	#include <sys/stat.h>
+	#include <unistd.h>
+#endif
+
+// A whole file mapped read-only into memory. Pages are read in by the OS as
+// they are touched, and nothing is copied into the process. Empty files and
+// files that cannot be opened leave it invalid.
+class mapped_file
+{
+public:
+	mapped_file() {}
+
+	explicit mapped_file(const char* filename)
+	{
+#if defined(_WIN32)
+		HANDLE file = CreateFileA(filename, GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+		if (file == INVALID_HANDLE_VALUE)
+			return;
+
+		LARGE_INTEGER size;
+		if (GetFileSizeEx(file, &size) && size.QuadPart > 0)
+		{
+			HANDLE mapping = CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+			if (mapping)
+			{
+				m_Data = static_cast<const uint8_t*>(MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0));
+				m_Size = m_Data ? static_cast<size_t>(size.QuadPart) : 0;
+				// The view keeps the mapping alive
+				CloseHandle(mapping);
+			}
+		}
+		CloseHandle(file);
+#else
+		int fd = open(filename, O_RDONLY);
+		if (fd < 0)
+			return;
+
+		struct stat info;
+		if (fstat(fd, &info) == 0 && info.st_size > 0)
+		{
+			void* data = mmap(nullptr, static_cast<size_t>(info.st_size), PROT_READ, MAP_PRIVATE, fd, 0);
+			if (data != MAP_FAILED)
+			{
+				m_Data = static_cast<const uint8_t*>(data);
+				m_Size = static_cast<size_t>(info.st_size);
+			}
+		}
+		// The mapping keeps the file alive
+		close(fd);
+#endif
+	}
+
+	~mapped_file() { unmap(); }
+
+	mapped_file(const mapped_file&) = delete;
+	mapped_file& operator=(const mapped_file&) = delete;
+
+	mapped_file(mapped_file&& other) noexcept
+		: m_Data(other.m_Data), m_Size(other.m_Size)
+	{
+		other.m_Data = nullptr;
+		other.m_Size = 0;
+	}
+
+	mapped_file& operator=(mapped_file&& other) noexcept
+	{
+		if (this != &other)
+		{
+			unmap();
+			m_Data = other.m_Data;
+			m_Size = other.m_Size;
+			other.m_Data = nullptr;
+			other.m_Size = 0;
+		}
+		return *this;
+	}
+
+	bool valid() const { return m_Data != nullptr; }
+	const uint8_t* data() const { return m_Data; }
+	size_t size() const { return m_Size; }
+
+private:
+	void unmap()
+	{
+		if (!m_Data)
+			return;
+
+#if defined(_WIN32)
+		UnmapViewOfFile(m_Data);
+#else
+		munmap(const_cast<uint8_t*>(m_Data), m_Size);
+#endif
+		m_Data = nullptr;
+		m_Size = 0;
+	}
+
+	const uint8_t* m_Data = nullptr;
+	size_t m_Size = 0;
+};
+
+#endif
@@ -8,6 +8,10 @@
 #include "hittable.h"
 #include "texture.h"
 
+#include <vector>
+
+class material_table;
+
 class material
 {
 public:
@@ -16,24 +20,70 @@ public:
 		return color(0.0f);
 	}
 
-	virtual bool scatter(const ray& r_in, const hit_record& rec, color& attenuation, ray& scattered) const = 0;
+	virtual bool scatter(const ray& r_in, const hit_record& rec, color& attenuation, ray& scattered, sampler& s) const = 0;
+
+	// Materials whose scatter draws from a density instead of picking a fixed
+	// direction can also be lit by sampling the lights. scattering_pdf is the
+	// density, per solid angle, with which scatter picks direction. eval is what
+	// light arriving from direction is multiplied by on its way to r_in, with
+	// the cosine included, so for a scattered direction it equals attenuation
+	// times scattering_pdf.
+	virtual bool is_specular() const
+	{
+		return true;
+	}
+
+	virtual float scattering_pdf(const ray& r_in, const hit_record& rec, const vec3& direction) const
+	{
+		return 0.0f;
+	}
+
+	virtual color eval(const ray& r_in, const hit_record& rec, const vec3& direction) const
+	{
+		return color(0.0f);
+	}
+
+protected:
+	// Textures of the table the material was added to
+	const texture_table* m_Textures = nullptr;
+
+	friend class material_table;
 };
 
 class lambertian : public material
 {
 public:
-	lambertian(std::shared_ptr<texture> a)
+	lambertian(texture_id a)
 		: m_Albedo(a) {};
 
-	virtual bool scatter(const ray& r_in, const hit_record& rec, color& attenuation, ray& scattered) const override
+	virtual bool scatter(const ray& r_in, const hit_record& rec, color& attenuation, ray& scattered, sampler& s) const override
 	{
-		vec3 scatterDir = rec.normal + random_unit_vector();
-		scattered = ray(rec.p, scatterDir, r_in.GetTime());
-		attenuation = m_Albedo->value(rec.u, rec.v, rec.p);
+		RT_STAT(render_stats::local().scatters[render_stats::mat_lambertian]++);
+		vec3 scatterDir = rec.normal + random_unit_vector(s);
+		scattered = ray(rec.p, scatterDir, r_in.GetTime(), s.next_seed());
+		attenuation = (*m_Textures)[m_Albedo].value(rec.u, rec.v, rec.p, rec.footprint);
 		return true;
 	}
+
+	virtual bool is_specular() const override
+	{
+		return false;
+	}
+
+	// The normal plus a random unit vector is cosine distributed
+	virtual float scattering_pdf(const ray& r_in, const hit_record& rec, const vec3& direction) const override
+	{
+		float cosine = dot(rec.normal, unit_vector(direction));
+		return cosine > 0.0f ? cosine / PI : 0.0f;
+	}
+
+	virtual color eval(const ray& r_in, const hit_record& rec, const vec3& direction) const override
+	{
+		return (*m_Textures)[m_Albedo].value(rec.u, rec.v, rec.p, rec.footprint) * scattering_pdf(r_in, rec, direction);
+	}
+
 private:
-	std::shared_ptr<texture> m_Albedo;
+	texture_id m_Albedo;
 };
 
 class metal : public material
@@ -42,13 +92,50 @@ public:
 	metal(const color& a, float f)
 		: m_Albedo(a), m_Fuzz(f < 1 ? f : 1) {};
 
-	virtual bool scatter(const ray& r_in, const hit_record& rec, color& attenuation, ray& scattered) const override
+	virtual bool scatter(const ray& r_in, const hit_record& rec, color& attenuation, ray& scattered, sampler& s) const override
 	{
+		RT_STAT(render_stats::local().scatters[render_stats::mat_metal]++);
 		vec3 reflected = reflect(unit_vector(r_in.GetDirection()), rec.normal);
-		scattered = ray(rec.p, reflected + m_Fuzz * random_in_unit_sphere());
+		scattered = ray(rec.p, reflected + m_Fuzz * random_in_unit_sphere(s), r_in.GetTime(), s.next_seed());
 		attenuation = m_Albedo;
 		return (dot(scattered.GetDirection(), rec.normal) > 0);
 	}
+
+	virtual bool is_specular() const override
+	{
+		return m_Fuzz == 0.0f;
+	}
+
+	// The scattered direction points at a uniform random point of the ball of
+	// radius fuzz around the mirror direction. Its density is the ball's volume
+	// along the direction, weighted by t^2, over the whole volume. Directions
+	// below the surface are absorbed.
+	virtual float scattering_pdf(const ray& r_in, const hit_record& rec, const vec3& direction) const override
+	{
+		vec3 w = unit_vector(direction);
+		if (m_Fuzz == 0.0f || dot(w, rec.normal) <= 0.0f)
+			return 0.0f;
+
+		vec3 reflected = reflect(unit_vector(r_in.GetDirection()), rec.normal);
+		float b = dot(w, reflected);
+		float discriminant = b * b - reflected.length_squared() + m_Fuzz * m_Fuzz;
+		if (discriminant <= 0.0f)
+			return 0.0f;
+
+		float root = sqrt(discriminant);
+		float t1 = fmax(b - root, 0.0f);
+		float t2 = b + root;
+		if (t2 <= 0.0f)
+			return 0.0f;
+
+		return (t2 * t2 * t2 - t1 * t1 * t1) / (4.0f * PI * m_Fuzz * m_Fuzz * m_Fuzz);
+	}
+
+	virtual color eval(const ray& r_in, const hit_record& rec, const vec3& direction) const override
+	{
+		return m_Albedo * scattering_pdf(r_in, rec, direction);
+	}
+
 private:
 	color m_Albedo;
 	float m_Fuzz;
@@ -68,8 +155,9 @@ public:
 	dielectric(const color& a, float index)
 		: m_Albedo(a), m_Idx(index) {};
 
-	virtual bool scatter(const ray& r_in, const hit_record& rec, color& attenuation, ray& scattered) const override
+	virtual bool scatter(const ray& r_in, const hit_record& rec, color& attenuation, ray& scattered, sampler& s) const override
 	{
+		RT_STAT(render_stats::local().scatters[render_stats::mat_dielectric]++);
 		attenuation = m_Albedo;
 
 		float factor;
@@ -85,15 +173,15 @@ public:
 		float reflectProb = schlick(cos_theta, factor);
 
 		// Reflect if the factor is too large
-		if (factor * sin_theta > 1.0f || random_float() < reflectProb)
+		if (factor * sin_theta > 1.0f || s.next() < reflectProb)
 		{
 			vec3 reflected = reflect(unit_direction, rec.normal);
-			scattered = ray(rec.p, reflected);
+			scattered = ray(rec.p, reflected, r_in.GetTime(), s.next_seed());
 			return true;
 		}
 
 		vec3 refracted = refract(unit_direction, rec.normal, factor);
-		scattered = ray(rec.p, refracted);
+		scattered = ray(rec.p, refracted, r_in.GetTime(), s.next_seed());
 		return true;
 	}
 private:
@@ -104,38 +192,85 @@ private:
 class diffuse_light : public material
 {
 public:
-	diffuse_light(std::shared_ptr<texture> a)
+	diffuse_light(texture_id a)
 		: m_Emit(a) {}
 
-	virtual bool scatter(const ray& r_in, const hit_record& rec, color& attenuation, ray& scattered) const override
+	virtual bool scatter(const ray& r_in, const hit_record& rec, color& attenuation, ray& scattered, sampler& s) const override
 	{
+		RT_STAT(render_stats::local().scatters[render_stats::mat_diffuse_light]++);
 		return false;
 	}
 
 	virtual color emitted(float u, float v, const point3& p) const override
 	{
-		return m_Emit->value(u, v, p);
+		return (*m_Textures)[m_Emit].value(u, v, p);
 	}
 
 private:
-	std::shared_ptr<texture> m_Emit;
+	texture_id m_Emit;
 };
 
 class isotropic : public material
 {
 public:
-	isotropic(std::shared_ptr<texture> a)
+	isotropic(texture_id a)
 		: m_Albedo(a) {}
 
-	virtual bool scatter(const ray& r_in, const hit_record& rec, color& attenuation, ray& scattered) const override
+	virtual bool scatter(const ray& r_in, const hit_record& rec, color& attenuation, ray& scattered, sampler& s) const override
 	{
-		scattered = ray(rec.p, random_in_unit_sphere(), r_in.GetTime());
-		attenuation = m_Albedo->value(rec.u, rec.v, rec.p);
+		RT_STAT(render_stats::local().scatters[render_stats::mat_isotropic]++);
+		scattered = ray(rec.p, random_in_unit_sphere(s), r_in.GetTime(), s.next_seed());
+		attenuation = (*m_Textures)[m_Albedo].value(rec.u, rec.v, rec.p, rec.footprint);
 		return true;
 	}
 
+	virtual bool is_specular() const override
+	{
+		return false;
+	}
+
+	// Directions inside the unit sphere are uniform over all of them
+	virtual float scattering_pdf(const ray& r_in, const hit_record& rec, const vec3& direction) const override
+	{
+		return 1.0f / (4.0f * PI);
+	}
+
+	virtual color eval(const ray& r_in, const hit_record& rec, const vec3& direction) const override
+	{
+		return (*m_Textures)[m_Albedo].value(rec.u, rec.v, rec.p, rec.footprint) * scattering_pdf(r_in, rec, direction);
+	}
+
+private:
+	texture_id m_Albedo;
+};
+
+// Owns the materials of a scene along with the textures they use. Hittables
+// and hit records carry the material_id returned by add, the integrator
+// looks the material up here. Like texture_table it cannot be copied or
+// moved once filled.
+class material_table
+{
+public:
+	material_table() {}
+	material_table(const material_table&) = delete;
+	material_table& operator=(const material_table&) = delete;
+
+	material_id add(std::shared_ptr<material> m)
+	{
+		m->m_Textures = &m_Textures;
+		m_Materials.push_back(m);
+		return static_cast<material_id>(m_Materials.size() - 1);
+	}
+
+	texture_id add_texture(std::shared_ptr<texture> t) { return m_Textures.add(t); }
+
+	const material& operator[](material_id id) const { return *m_Materials[id]; }
+	const texture_table& GetTextures() const { return m_Textures; }
+	size_t size() const { return m_Materials.size(); }
+
 private:
-	std::shared_ptr<texture> m_Albedo;
+	std::vector<std::shared_ptr<material>> m_Materials;
+	texture_table m_Textures;
 };
 
 #endif
\ No newline at end of file
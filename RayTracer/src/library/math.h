@@ -3,12 +3,14 @@
 #ifndef MATH_H
 #define MATH_H
 
+#include <atomic>
 #include <cmath>
-#include <functional>
-#include <random>
+#include <cstdint>
 #include <limits>
 #include <memory>
 
+#include "sampler.h"
+
 // Constants
 
 const float INF = std::numeric_limits<float>::infinity();
@@ -28,12 +30,22 @@ inline float clamp(float x, float min, float max)
 	return x;
 }
 
+// Scene setup and other code outside the render loop draws from a per-thread
+// stream of the same counter based generator the render uses. Threads are
+// keyed in the order they first draw, so the thread that sets up the scene,
+// normally the only one by then, gets stream 0 and builds the same scene on
+// every run. The render itself passes an explicit sampler keyed on
+// (pixel, sample).
+inline sampler& thread_sampler()
+{
+	static std::atomic<uint64_t> threads(0);
+	thread_local sampler s(threads++);
+	return s;
+}
+
 inline float random_float() 
 {
-	static std::uniform_real_distribution<float> distribution(0.0f, 1.0f);
-	static std::mt19937 generator;
-	static std::function<float()> rand_generator = std::bind(distribution, generator);
-	return rand_generator();
+	return thread_sampler().next();
 }
 
 inline float random_float(float min, float max) 
@@ -43,10 +55,8 @@ inline float random_float(float min, float max)
 
 inline int random_int(int min, int max)
 {
-	static std::uniform_int_distribution<std::mt19937::result_type> distribution(min, max);
-	static std::mt19937 generator;
-	static std::function<int()> rand_generator = std::bind(distribution, generator);
-	return rand_generator();
+	int value = min + static_cast<int>(random_float() * (max - min + 1));
+	return value > max ? max : value;
 }
 
 // Common Headers
@@ -1,7 +1,31 @@
 #pragma once
 
+#ifndef NOISE_H
+#define NOISE_H
+
 #include "math.h"
 
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+// Number of points the noise kernel evaluates at once, fixed at compile time
+// by the available instruction set. Define RT_NOISE_SCALAR to force the
+// portable loop.
+#if !defined(RT_NOISE_SCALAR) && defined(__AVX2__)
+	#define RT_NOISE_AVX 1
+	#define RT_NOISE_WIDTH 8
+#elif !defined(RT_NOISE_SCALAR) && (defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2))
+	#define RT_NOISE_SSE 1
+	#define RT_NOISE_WIDTH 4
+#else
+	#define RT_NOISE_WIDTH 4
+#endif
+
+#if defined(RT_NOISE_AVX) || defined(RT_NOISE_SSE)
+	#include <immintrin.h>
+#endif
+
 inline float trilinear_interp(vec3 c[2][2][2], float u, float v, float w)
 {
 	auto uu = u * u * (3 - 2 * u);
@@ -16,34 +40,38 @@ inline float trilinear_interp(vec3 c[2][2][2], float u, float v, float w)
 				vec3 weight(u - i, v - j, w - k);
 				accum += (i * uu + (1 - i) * (1 - uu)) *
 					     (j * vv + (1 - j) * (1 - vv)) *
-					     (k * ww + (1 - k) * (1 - ww)) * 
+					     (k * ww + (1 - k) * (1 - ww)) *
 					     dot(c[i][j][k], weight);
 			}
 	return accum;
 }
 
+// Gradient noise over a lattice of 256 random unit vectors. The three axis
+// permutations live back to back in one table and the gradients are stored
+// one array per component, so the kernel can gather the eight corners of
+// RT_NOISE_WIDTH cells at once. turbulence puts its octaves in those lanes,
+// the batch overloads put one point in each.
 class perlin
 {
 public:
+	static const int s_Lanes = RT_NOISE_WIDTH;
+
 	perlin()
 	{
-		m_Ranvec = new vec3[s_PointCount];
+		m_GradX.resize(s_PointCount);
+		m_GradY.resize(s_PointCount);
+		m_GradZ.resize(s_PointCount);
 		for (int i = 0; i < s_PointCount; ++i)
 		{
-			m_Ranvec[i] = unit_vector(vec3::random(-1, 1));
+			vec3 g = unit_vector(vec3::random(-1, 1));
+			m_GradX[i] = g.x();
+			m_GradY[i] = g.y();
+			m_GradZ[i] = g.z();
 		}
-		
-		m_PermX = perlin_generate_perm();
-		m_PermY = perlin_generate_perm();
-		m_PermZ = perlin_generate_perm();
-	}
 
-	~perlin()
-	{
-		delete[] m_Ranvec;
-		delete[] m_PermX;
-		delete[] m_PermY;
-		delete[] m_PermZ;
+		m_Perm.resize(3 * s_PointCount);
+		for (int axis = 0; axis < 3; axis++)
+			perlin_generate_perm(&m_Perm[axis * s_PointCount]);
 	}
 
 	float noise(const point3& p) const
@@ -60,52 +88,231 @@ public:
 		for (int di = 0; di < 2; di++)
 			for (int dj = 0; dj < 2; dj++)
 				for (int dk = 0; dk < 2; dk++)
-					c[di][dj][dk] = m_Ranvec[
-						m_PermX[(i + di) & 255] ^
-						m_PermY[(j + dj) & 255] ^
-						m_PermZ[(k + dk) & 255]
-					];
+				{
+					int h = permX()[(i + di) & 255] ^ permY()[(j + dj) & 255] ^ permZ()[(k + dk) & 255];
+					c[di][dj][dk] = vec3(m_GradX[h], m_GradY[h], m_GradZ[h]);
+				}
 
 		return trilinear_interp(c, u, v, w);
 	}
 
+	// Sum of depth octaves of noise, each at twice the frequency and half the
+	// weight of the previous one. The octaves are independent, so they are
+	// evaluated side by side in the lanes of the kernel and only summed at the
+	// end, in the same order as one after the other.
 	float turbulence(const point3& p, int depth = 7) const
 	{
+		alignas(32) float x[s_Lanes], y[s_Lanes], z[s_Lanes], n[s_Lanes];
 		float accum = 0.0f;
 		point3 temp_p = p;
 		float weight = 1.0f;
 
-		for (int i = 0; i < depth; i++)
+		for (int first = 0; first < depth; first += s_Lanes)
 		{
-			accum += weight * noise(temp_p);
-			weight *= 0.5f;
-			temp_p *= 2.0f;
+			int count = depth - first < s_Lanes ? depth - first : s_Lanes;
+			for (int l = 0; l < s_Lanes; l++)
+			{
+				x[l] = temp_p.x();
+				y[l] = temp_p.y();
+				z[l] = temp_p.z();
+				if (l < count)
+					temp_p *= 2.0f;
+			}
+
+			noise_lanes(x, y, z, n, count);
+
+			for (int l = 0; l < count; l++)
+			{
+				accum += weight * n[l];
+				weight *= 0.5f;
+			}
 		}
 
 		return fabs(accum);
 	}
 
+	// Noise at the n points (x[i], y[i], z[i]), written to out[i]. Meant for
+	// callers that have a whole batch of shading points at hand, such as the
+	// wavefront integrator.
+	void noise(const float* x, const float* y, const float* z, float* out, size_t n) const
+	{
+		alignas(32) float px[s_Lanes], py[s_Lanes], pz[s_Lanes], result[s_Lanes];
+
+		for (size_t first = 0; first < n; first += s_Lanes)
+		{
+			size_t count = load_lanes(x, y, z, first, n, px, py, pz);
+			noise_lanes(px, py, pz, result, static_cast<int>(count));
+			for (size_t l = 0; l < count; l++)
+				out[first + l] = result[l];
+		}
+	}
+
+	// Turbulence at the n points (x[i], y[i], z[i]), written to out[i]
+	void turbulence(const float* x, const float* y, const float* z, float* out, size_t n, int depth = 7) const
+	{
+		alignas(32) float px[s_Lanes], py[s_Lanes], pz[s_Lanes], result[s_Lanes];
+
+		for (size_t first = 0; first < n; first += s_Lanes)
+		{
+			size_t count = load_lanes(x, y, z, first, n, px, py, pz);
+			float accum[s_Lanes] = {};
+			float weight = 1.0f;
+
+			for (int i = 0; i < depth; i++)
+			{
+				noise_lanes(px, py, pz, result, static_cast<int>(count));
+				for (int l = 0; l < s_Lanes; l++)
+				{
+					accum[l] += weight * result[l];
+					px[l] *= 2.0f;
+					py[l] *= 2.0f;
+					pz[l] *= 2.0f;
+				}
+				weight *= 0.5f;
+			}
+
+			for (size_t l = 0; l < count; l++)
+				out[first + l] = fabs(accum[l]);
+		}
+	}
+
 private:
 	static const int s_PointCount = 256;
 
-	vec3* m_Ranvec;
-	int* m_PermX;
-	int* m_PermY;
-	int* m_PermZ;
+	std::vector<float> m_GradX, m_GradY, m_GradZ;
+	std::vector<int32_t> m_Perm; // X, Y and Z permutations, s_PointCount each
 
-	static int* perlin_generate_perm()
+	const int32_t* permX() const { return m_Perm.data(); }
+	const int32_t* permY() const { return m_Perm.data() + s_PointCount; }
+	const int32_t* permZ() const { return m_Perm.data() + 2 * s_PointCount; }
+
+	// Copies the points from first on into the lanes, padding a short tail
+	// with zeros. Returns how many lanes hold points.
+	static size_t load_lanes(const float* x, const float* y, const float* z, size_t first, size_t n, float* px, float* py, float* pz)
+	{
+		size_t count = n - first < s_Lanes ? n - first : s_Lanes;
+		for (size_t l = 0; l < s_Lanes; l++)
+		{
+			px[l] = l < count ? x[first + l] : 0.0f;
+			py[l] = l < count ? y[first + l] : 0.0f;
+			pz[l] = l < count ? z[first + l] : 0.0f;
+		}
+		return count;
+	}
+
+	// noise at s_Lanes points, of which only the first count are needed. The
+	// fade and the interpolation are plain arithmetic on whole lanes, so there
+	// is no branch on the cell position; the result matches the scalar noise up
+	// to the rounding of the reordered sums.
+	void noise_lanes(const float* x, const float* y, const float* z, float* out, int count) const
 	{
-		auto p = new int[s_PointCount];
+#if defined(RT_NOISE_AVX)
+		const __m256 px = _mm256_load_ps(x), py = _mm256_load_ps(y), pz = _mm256_load_ps(z);
+		const __m256 fx = _mm256_floor_ps(px), fy = _mm256_floor_ps(py), fz = _mm256_floor_ps(pz);
+		const __m256 u = _mm256_sub_ps(px, fx), v = _mm256_sub_ps(py, fy), w = _mm256_sub_ps(pz, fz);
+
+		// The floors are whole numbers, so truncating them is exact
+		const __m256i mask = _mm256_set1_epi32(255), one = _mm256_set1_epi32(1);
+		const __m256i ix = _mm256_cvttps_epi32(fx), iy = _mm256_cvttps_epi32(fy), iz = _mm256_cvttps_epi32(fz);
+		const __m256i hx[2] = {
+			_mm256_i32gather_epi32(permX(), _mm256_and_si256(ix, mask), 4),
+			_mm256_i32gather_epi32(permX(), _mm256_and_si256(_mm256_add_epi32(ix, one), mask), 4) };
+		const __m256i hy[2] = {
+			_mm256_i32gather_epi32(permY(), _mm256_and_si256(iy, mask), 4),
+			_mm256_i32gather_epi32(permY(), _mm256_and_si256(_mm256_add_epi32(iy, one), mask), 4) };
+		const __m256i hz[2] = {
+			_mm256_i32gather_epi32(permZ(), _mm256_and_si256(iz, mask), 4),
+			_mm256_i32gather_epi32(permZ(), _mm256_and_si256(_mm256_add_epi32(iz, one), mask), 4) };
+
+		const __m256 vone = _mm256_set1_ps(1.0f);
+		const __m256 du[2] = { u, _mm256_sub_ps(u, vone) };
+		const __m256 dv[2] = { v, _mm256_sub_ps(v, vone) };
+		const __m256 dw[2] = { w, _mm256_sub_ps(w, vone) };
+
+		__m256 d[2][2][2];
+		for (int di = 0; di < 2; di++)
+			for (int dj = 0; dj < 2; dj++)
+				for (int dk = 0; dk < 2; dk++)
+				{
+					__m256i h = _mm256_xor_si256(_mm256_xor_si256(hx[di], hy[dj]), hz[dk]);
+					__m256 gx = _mm256_i32gather_ps(m_GradX.data(), h, 4);
+					__m256 gy = _mm256_i32gather_ps(m_GradY.data(), h, 4);
+					__m256 gz = _mm256_i32gather_ps(m_GradZ.data(), h, 4);
+					d[di][dj][dk] = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(gx, du[di]), _mm256_mul_ps(gy, dv[dj])), _mm256_mul_ps(gz, dw[dk]));
+				}
+
+		const __m256 three = _mm256_set1_ps(3.0f), two = _mm256_set1_ps(2.0f);
+		auto fade = [&](__m256 t) { return _mm256_mul_ps(_mm256_mul_ps(t, t), _mm256_sub_ps(three, _mm256_mul_ps(two, t))); };
+		auto lerp = [](__m256 a, __m256 b, __m256 t) { return _mm256_add_ps(a, _mm256_mul_ps(t, _mm256_sub_ps(b, a))); };
+		const __m256 uu = fade(u), vv = fade(v), ww = fade(w);
+
+		__m256 e[2];
+		for (int di = 0; di < 2; di++)
+			e[di] = lerp(lerp(d[di][0][0], d[di][0][1], ww), lerp(d[di][1][0], d[di][1][1], ww), vv);
+		_mm256_store_ps(out, lerp(e[0], e[1], uu));
+#elif defined(RT_NOISE_SSE)
+		// SSE2 has neither a floor nor gathers: the floor corrects the truncation
+		// of negative values, the corners are fetched one lane at a time.
+		const __m128 vone = _mm_set1_ps(1.0f);
+		auto floor4 = [&](__m128 p) {
+			__m128 t = _mm_cvtepi32_ps(_mm_cvttps_epi32(p));
+			return _mm_sub_ps(t, _mm_and_ps(_mm_cmpgt_ps(t, p), vone));
+		};
 
+		const __m128 px = _mm_load_ps(x), py = _mm_load_ps(y), pz = _mm_load_ps(z);
+		const __m128 fx = floor4(px), fy = floor4(py), fz = floor4(pz);
+		const __m128 u = _mm_sub_ps(px, fx), v = _mm_sub_ps(py, fy), w = _mm_sub_ps(pz, fz);
+
+		alignas(16) int32_t ix[4], iy[4], iz[4];
+		_mm_store_si128(reinterpret_cast<__m128i*>(ix), _mm_cvttps_epi32(fx));
+		_mm_store_si128(reinterpret_cast<__m128i*>(iy), _mm_cvttps_epi32(fy));
+		_mm_store_si128(reinterpret_cast<__m128i*>(iz), _mm_cvttps_epi32(fz));
+
+		const __m128 du[2] = { u, _mm_sub_ps(u, vone) };
+		const __m128 dv[2] = { v, _mm_sub_ps(v, vone) };
+		const __m128 dw[2] = { w, _mm_sub_ps(w, vone) };
+
+		__m128 d[2][2][2];
+		alignas(16) float gx[4], gy[4], gz[4];
+		for (int di = 0; di < 2; di++)
+			for (int dj = 0; dj < 2; dj++)
+				for (int dk = 0; dk < 2; dk++)
+				{
+					for (int l = 0; l < 4; l++)
+					{
+						int h = permX()[(ix[l] + di) & 255] ^ permY()[(iy[l] + dj) & 255] ^ permZ()[(iz[l] + dk) & 255];
+						gx[l] = m_GradX[h];
+						gy[l] = m_GradY[h];
+						gz[l] = m_GradZ[h];
+					}
+					d[di][dj][dk] = _mm_add_ps(_mm_add_ps(_mm_mul_ps(_mm_load_ps(gx), du[di]), _mm_mul_ps(_mm_load_ps(gy), dv[dj])),
+						_mm_mul_ps(_mm_load_ps(gz), dw[dk]));
+				}
+
+		const __m128 three = _mm_set1_ps(3.0f), two = _mm_set1_ps(2.0f);
+		auto fade = [&](__m128 t) { return _mm_mul_ps(_mm_mul_ps(t, t), _mm_sub_ps(three, _mm_mul_ps(two, t))); };
+		auto lerp = [](__m128 a, __m128 b, __m128 t) { return _mm_add_ps(a, _mm_mul_ps(t, _mm_sub_ps(b, a))); };
+		const __m128 uu = fade(u), vv = fade(v), ww = fade(w);
+
+		__m128 e[2];
+		for (int di = 0; di < 2; di++)
+			e[di] = lerp(lerp(d[di][0][0], d[di][0][1], ww), lerp(d[di][1][0], d[di][1][1], ww), vv);
+		_mm_store_ps(out, lerp(e[0], e[1], uu));
+#else
+		for (int l = 0; l < s_Lanes; l++)
+			out[l] = l < count ? noise(point3(x[l], y[l], z[l])) : 0.0f;
+#endif
+	}
+
+	static void perlin_generate_perm(int32_t* p)
+	{
 		for (int i = 0; i < perlin::s_PointCount; i++)
 			p[i] = i;
 
 		permute(p, s_PointCount);
-
-		return p;
 	}
 
-	static void permute(int* p, int n)
+	static void permute(int32_t* p, int n)
 	{
 		for (int i = n - 1; i > 0; i--)
 		{
@@ -115,4 +322,6 @@ private:
 			p[target] = tmp;
 		}
 	}
-};
\ No newline at end of file
+};
+
+#endif
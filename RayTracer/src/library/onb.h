@@ -0,0 +1,29 @@
+#pragma once
+
+#ifndef ONB_H
+#define ONB_H
+
+#include "vec3.h"
+
+// Orthonormal basis around a direction, for sampling directions given in a
+// frame where w points along it.
+class onb
+{
+public:
+	onb(const vec3& direction)
+	{
+		m_W = unit_vector(direction);
+		vec3 a = fabs(m_W.x()) > 0.9f ? vec3(0.0f, 1.0f, 0.0f) : vec3(1.0f, 0.0f, 0.0f);
+		m_V = unit_vector(cross(m_W, a));
+		m_U = cross(m_W, m_V);
+	}
+
+	vec3 local(float a, float b, float c) const { return a * m_U + b * m_V + c * m_W; }
+
+	const vec3& GetW() const { return m_W; }
+
+private:
+	vec3 m_U, m_V, m_W;
+};
+
+#endif
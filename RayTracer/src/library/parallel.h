@@ -0,0 +1,118 @@
+#pragma once
+
+#ifndef PARALLEL_H
+#define PARALLEL_H
+
+#include <algorithm>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// A double ended queue of task indices. The owning worker pops from the front
+// so it walks its own tasks in order, idle workers steal from the back.
+class work_stealing_queue
+{
+public:
+	void push(size_t task)
+	{
+		std::lock_guard<std::mutex> lock(m_Mutex);
+		m_Tasks.push_back(task);
+	}
+
+	bool pop(size_t& task)
+	{
+		std::lock_guard<std::mutex> lock(m_Mutex);
+		if (m_Tasks.empty())
+			return false;
+
+		task = m_Tasks.front();
+		m_Tasks.pop_front();
+		return true;
+	}
+
+	bool steal(size_t& task)
+	{
+		std::lock_guard<std::mutex> lock(m_Mutex);
+		if (m_Tasks.empty())
+			return false;
+
+		task = m_Tasks.back();
+		m_Tasks.pop_back();
+		return true;
+	}
+
+private:
+	std::mutex m_Mutex;
+	std::deque<size_t> m_Tasks;
+};
+
+inline unsigned default_thread_count()
+{
+	unsigned threads = std::thread::hardware_concurrency();
+	return threads == 0 ? 1 : threads;
+}
+
+// Runs task(index) for every index in [0, count) and blocks until all are done.
+// Each worker starts with a contiguous run of indices so neighbouring tasks stay
+// on the same core, and steals from the others once its own queue runs dry.
+template<typename Task>
+void parallel_for(size_t count, unsigned threads, Task&& task)
+{
+	if (threads == 0)
+		threads = default_thread_count();
+	threads = static_cast<unsigned>(std::min<size_t>(threads, count));
+
+	if (threads <= 1)
+	{
+		for (size_t i = 0; i < count; i++)
+			task(i);
+		return;
+	}
+
+	std::vector<work_stealing_queue> queues(threads);
+	for (unsigned w = 0; w < threads; w++)
+	{
+		size_t begin = count * w / threads;
+		size_t end = count * (w + 1) / threads;
+		for (size_t i = begin; i < end; i++)
+			queues[w].push(i);
+	}
+
+	// No tasks are added once workers start, so a worker that finds every queue
+	// empty can safely retire.
+	auto worker = [&](unsigned id)
+	{
+		size_t index;
+		while (true)
+		{
+			if (queues[id].pop(index))
+			{
+				task(index);
+				continue;
+			}
+
+			bool stolen = false;
+			for (unsigned k = 1; k < threads && !stolen; k++)
+				stolen = queues[(id + k) % threads].steal(index);
+
+			if (!stolen)
+				return;
+
+			task(index);
+		}
+	};
+
+	std::vector<std::thread> pool;
+	pool.reserve(threads - 1);
+	for (unsigned w = 1; w < threads; w++)
+		pool.emplace_back(worker, w);
+
+	// The calling thread works as well instead of sleeping on the joins
+	worker(0);
+
+	for (auto& t : pool)
+		t.join();
+}
+
+#endif
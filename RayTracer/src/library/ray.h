@@ -4,24 +4,54 @@
 #define RAY_H
 
 #include "vec3.h"
+#include <cstdint>
 #include <iostream>
 
 class ray {
 public:
 	ray() {}
-	ray(const point3& origin, const vec3& direction, float time = 0.0f)
-		: m_Origin(origin), m_Direction(direction), m_Time(time) {}
+	ray(const point3& origin, const vec3& direction, float time = 0.0f, uint32_t seed = 0)
+		: m_Origin(origin), m_Direction(direction), m_Time(time), m_Seed(seed),
+		m_InvDirection(1.0f / direction.x(), 1.0f / direction.y(), 1.0f / direction.z())
+	{
+		// Taken from the reciprocal so that -0 directions, whose reciprocal is
+		// -inf, land in the negative octant.
+		m_Octant = (m_InvDirection.x() < 0 ? 1 : 0) | (m_InvDirection.y() < 0 ? 2 : 0) | (m_InvDirection.z() < 0 ? 4 : 0);
+	}
 
 	point3 GetOrigin() const { return m_Origin; }
 	vec3 GetDirection() const { return m_Direction; }
 	float GetTime() const { return m_Time; }
 
+	// Random stream key for decisions made while intersecting this ray, such as
+	// the scattering distance inside a participating medium.
+	uint32_t GetSeed() const { return m_Seed; }
+
+	// Precomputed for slab tests. Bit a of the octant is set when the direction
+	// is negative along axis a.
+	vec3 GetInvDirection() const { return m_InvDirection; }
+	int GetOctant() const { return m_Octant; }
+
 	point3 at(float t) const { return m_Origin + t * m_Direction; }
 
 private:
 	point3 m_Origin;
 	vec3 m_Direction;
 	float m_Time;
+	uint32_t m_Seed;
+	vec3 m_InvDirection;
+	int m_Octant;
+};
+
+// A bundle of coherent rays, such as the camera rays of neighbouring pixels,
+// that are intersected together so every node fetch is shared between them.
+struct ray_packet {
+	static const int s_Size = 8;
+
+	ray rays[s_Size];
+	int count = 0;
+
+	int mask() const { return (1 << count) - 1; }
 };
 
 
@@ -0,0 +1,72 @@
+#pragma once
+
+#ifndef SAMPLER_H
+#define SAMPLER_H
+
+#include <cstdint>
+
+// SplitMix64 finalizer. A bijection on 64 bits, so distinct keys never collide.
+inline uint64_t mix64(uint64_t z)
+{
+	z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+	z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+	return z ^ (z >> 31);
+}
+
+// Maps the top 24 bits of a hash to a float in [0, 1)
+inline float bits_to_float(uint64_t bits)
+{
+	return static_cast<float>(bits >> 40) * (1.0f / 16777216.0f);
+}
+
+// Counter based random numbers. Every value is a pure function of the stream
+// key and the dimension index, so there is no shared state between threads and
+// a pixel sample draws the same numbers no matter which thread renders it.
+class sampler
+{
+public:
+	sampler()
+		: m_Key(0), m_Dimension(0) {}
+
+	explicit sampler(uint64_t key)
+		: m_Key(mix64(key)), m_Dimension(0) {}
+
+	sampler(uint32_t pixel, uint32_t sample)
+		: sampler((static_cast<uint64_t>(pixel) << 32) | sample) {}
+
+	float next()
+	{
+		return bits_to_float(draw(m_Dimension++));
+	}
+
+	float next(float min, float max)
+	{
+		return min + (max - min) * next();
+	}
+
+	// Fills out[0..n) from consecutive dimensions. Each lane only depends on its
+	// own counter, so the loop has no carried dependency and vectorizes.
+	void next(float* out, int n)
+	{
+		for (int i = 0; i < n; i++)
+			out[i] = bits_to_float(draw(m_Dimension + i));
+		m_Dimension += n;
+	}
+
+	// Key for a new stream, used to seed the rays spawned from this one
+	uint32_t next_seed()
+	{
+		return static_cast<uint32_t>(draw(m_Dimension++) >> 32);
+	}
+
+private:
+	uint64_t draw(uint64_t dimension) const
+	{
+		return mix64(m_Key + dimension * 0x9e3779b97f4a7c15ULL);
+	}
+
+	uint64_t m_Key;
+	uint64_t m_Dimension;
+};
+
+#endif
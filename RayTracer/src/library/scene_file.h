@@ -0,0 +1,742 @@
+#pragma once
+
+#ifndef SCENE_FILE_H
+#define SCENE_FILE_H
+
+#include "aarect.h"
+#include "box.h"
+#include "bvh.h"
+#include "constant_medium.h"
+#include "instance.h"
+#include "light_list.h"
+#include "mapped_file.h"
+#include "material.h"
+#include "sphere.h"
+#include "transform.h"
+
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+// Scenes described in a text file, compiled into a flat binary file that is
+// mapped and traced in place.
+//
+// The text format has one statement per line, # starts a comment, and names
+// are defined before they are used:
+//
+//   camera FROMX FROMY FROMZ ATX ATY ATZ UPX UPY UPZ VFOV APERTURE FOCUS
+//   background R G B
+//
+//   texture NAME solid R G B
+//   texture NAME checker EVEN ODD
+//   texture NAME noise SCALE
+//   texture NAME image PATH
+//
+//   material NAME lambertian TEXTURE
+//   material NAME metal R G B FUZZ
+//   material NAME dielectric R G B IOR
+//   material NAME diffuse_light TEXTURE
+//   material NAME isotropic TEXTURE
+//
+//   [MODIFIERS] sphere MATERIAL X Y Z RADIUS
+//   [MODIFIERS] moving_sphere MATERIAL X0 Y0 Z0 X1 Y1 Z1 T0 T1 RADIUS
+//   [MODIFIERS] xy_rect MATERIAL X0 X1 Y0 Y1 K
+//   [MODIFIERS] xz_rect MATERIAL X0 X1 Z0 Z1 K
+//   [MODIFIERS] yz_rect MATERIAL Y0 Y1 Z0 Z1 K
+//   [MODIFIERS] box MATERIAL X0 Y0 Z0 X1 Y1 Z1
+//
+// Every shape is added to the world. The modifiers in front of it stand for
+// the C++ wrappers of the same name:
+//
+//   light             also sampled as a light, not with medium or transforms
+//   flip              flip_face
+//   medium DENSITY    constant_medium with the shape as its boundary and
+//                     MATERIAL as its phase function
+//   translate X Y Z   translate
+//   rotate_y DEGREES  rotate_y
+//
+// Transforms compose like nested wrappers, the one nearest the shape applies
+// first, and always apply to the medium or flipped shape as a whole.
+//
+// so "medium 0.01 translate 265 0 295 rotate_y 15 box smoke 0 0 0 165 330 165"
+// is the smoke box of cornell_box(). Collections such as bvh_node, sphere_set
+// and tlas need no statement, the compiled scene puts every shape in one BVH.
+//
+// The compiled file holds the primitives as fixed size records, in the leaf
+// order of the BVH, next to the BVH's nodes. Opening it maps it and points
+// the tree at the mapped nodes, so tracing starts without reading or
+// allocating anything per primitive. Only the few textures, materials and
+// lights are created as objects. A file is tied to the BVH width it was
+// compiled for and is trusted to be as compile_scene wrote it.
+
+struct scene_texture
+{
+	enum kind { solid, checker, noise, image };
+
+	uint32_t type;
+	uint32_t refs[2]; // Textures of a checker
+	uint32_t path; // Offset of an image's path in the string section
+	float values[3];
+};
+
+struct scene_material
+{
+	enum kind { lambertian, metal, dielectric, diffuse_light, isotropic };
+
+	uint32_t type;
+	uint32_t texture;
+	float values[4]; // Color and fuzz or index of refraction
+};
+
+struct scene_primitive
+{
+	enum kind { sphere, moving_sphere, xy_rect, xz_rect, yz_rect, box };
+	enum flag { flipped = 1, medium = 2, light = 4 };
+
+	uint32_t type;
+	uint32_t material;
+	uint32_t flags;
+	int32_t transform; // Index into the transforms, -1 for none
+	float negInverseDensity; // Of a medium
+	float params[11];
+};
+
+static_assert(sizeof(scene_primitive) == 64, "scene_primitive should fill a cache line");
+
+struct scene_transform
+{
+	affine_transform objectToWorld;
+	affine_transform worldToObject;
+};
+
+struct scene_camera
+{
+	point3 lookfrom, lookat;
+	vec3 vup;
+	float vfov, aperture, focus;
+};
+
+// A scene as read from text, before its BVH is built
+struct scene_source
+{
+	std::vector<scene_texture> textures;
+	std::vector<scene_material> materials;
+	std::vector<scene_primitive> primitives;
+	std::vector<scene_transform> transforms;
+	std::string strings;
+	bool hasCamera = false;
+	scene_camera camera;
+	color background = color(0.0f);
+};
+
+namespace scene_file
+{
+	static const char s_Magic[8] = { 'R', 'T', 'S', 'C', 'E', 'N', 'E', '\0' };
+	static const uint32_t s_Version = 1;
+	static const uint32_t s_ByteOrder = 0x01020304;
+
+	struct section
+	{
+		uint64_t offset;
+		uint64_t count;
+	};
+
+	struct header
+	{
+		char magic[8];
+		uint32_t version;
+		uint32_t byteOrder;
+		uint32_t bvhWidth;
+		uint32_t primitiveSize;
+		uint32_t nodeSize;
+		uint32_t hasCamera;
+		float camera[12];
+		float background[3];
+		float bounds[6];
+		section textures, materials, primitives, transforms, lights, nodes, strings;
+	};
+
+	// Calls fn with the shape of p, in its own space, as a temporary object
+	template<typename Fn>
+	bool with_shape(const scene_primitive& p, Fn&& fn)
+	{
+		const float* v = p.params;
+		switch (p.type)
+		{
+		case scene_primitive::sphere:
+			return fn(::sphere(point3(v[0], v[1], v[2]), v[3], p.material));
+		case scene_primitive::moving_sphere:
+			return fn(::moving_sphere(point3(v[0], v[1], v[2]), point3(v[3], v[4], v[5]), v[6], v[7], v[8], p.material));
+		case scene_primitive::xy_rect:
+			return fn(::xy_rect(v[0], v[1], v[2], v[3], v[4], p.material));
+		case scene_primitive::xz_rect:
+			return fn(::xz_rect(v[0], v[1], v[2], v[3], v[4], p.material));
+		case scene_primitive::yz_rect:
+			return fn(::yz_rect(v[0], v[1], v[2], v[3], v[4], p.material));
+		case scene_primitive::box:
+			return fn(::box(point3(v[0], v[1], v[2]), point3(v[3], v[4], v[5]), p.material));
+		}
+		return false;
+	}
+
+	// The primitive as an ordinary hittable, for the lights
+	inline std::shared_ptr<hittable> make_hittable(const scene_primitive& p)
+	{
+		const float* v = p.params;
+		std::shared_ptr<hittable> shape;
+		switch (p.type)
+		{
+		case scene_primitive::sphere:
+			shape = std::make_shared<::sphere>(point3(v[0], v[1], v[2]), v[3], p.material);
+			break;
+		case scene_primitive::moving_sphere:
+			shape = std::make_shared<::moving_sphere>(point3(v[0], v[1], v[2]), point3(v[3], v[4], v[5]), v[6], v[7], v[8], p.material);
+			break;
+		case scene_primitive::xy_rect:
+			shape = std::make_shared<::xy_rect>(v[0], v[1], v[2], v[3], v[4], p.material);
+			break;
+		case scene_primitive::xz_rect:
+			shape = std::make_shared<::xz_rect>(v[0], v[1], v[2], v[3], v[4], p.material);
+			break;
+		case scene_primitive::yz_rect:
+			shape = std::make_shared<::yz_rect>(v[0], v[1], v[2], v[3], v[4], p.material);
+			break;
+		case scene_primitive::box:
+			shape = std::make_shared<::box>(point3(v[0], v[1], v[2]), point3(v[3], v[4], v[5]), p.material);
+			break;
+		}
+
+		if (shape && (p.flags & scene_primitive::flipped))
+			shape = std::make_shared<flip_face>(shape);
+		return shape;
+	}
+
+	inline bool fail(const std::string& path, int line, const std::string& message)
+	{
+		std::cerr << "ERROR: " << path << ':' << line << ": " << message << '\n';
+		return false;
+	}
+
+	inline bool parse_floats(const std::vector<std::string>& tokens, size_t first, int count, float* out)
+	{
+		if (tokens.size() < first + count)
+			return false;
+
+		for (int i = 0; i < count; i++)
+		{
+			const char* text = tokens[first + i].c_str();
+			char* end = nullptr;
+			out[i] = std::strtof(text, &end);
+			if (end == text || *end != '\0')
+				return false;
+		}
+		return true;
+	}
+}
+
+// Reads the text format into source. Problems are reported with their line
+// and make it return false.
+inline bool parse_scene(const std::string& path, scene_source& source)
+{
+	using namespace scene_file;
+
+	std::ifstream in(path);
+	if (!in)
+	{
+		std::cerr << "ERROR: Could not open scene file '" << path << "'.\n";
+		return false;
+	}
+
+	std::unordered_map<std::string, uint32_t> textures, materials;
+	std::unordered_map<std::string, int32_t> transforms; // Keyed by their matrix, so shapes share them
+
+	auto lookup = [](const std::unordered_map<std::string, uint32_t>& names, const std::string& name, uint32_t& id) {
+		auto found = names.find(name);
+		if (found == names.end())
+			return false;
+		id = found->second;
+		return true;
+	};
+
+	std::string text;
+	int line = 0;
+	while (std::getline(in, text))
+	{
+		line++;
+		text = text.substr(0, text.find('#'));
+
+		std::istringstream words(text);
+		std::vector<std::string> tokens;
+		for (std::string word; words >> word;)
+			tokens.push_back(word);
+		if (tokens.empty())
+			continue;
+
+		const std::string& keyword = tokens[0];
+		if (keyword == "camera")
+		{
+			float v[12];
+			if (tokens.size() != 13 || !parse_floats(tokens, 1, 12, v))
+				return fail(path, line, "camera takes 12 numbers");
+			source.hasCamera = true;
+			source.camera = { point3(v[0], v[1], v[2]), point3(v[3], v[4], v[5]), vec3(v[6], v[7], v[8]), v[9], v[10], v[11] };
+		}
+		else if (keyword == "background")
+		{
+			float v[3];
+			if (tokens.size() != 4 || !parse_floats(tokens, 1, 3, v))
+				return fail(path, line, "background takes 3 numbers");
+			source.background = color(v[0], v[1], v[2]);
+		}
+		else if (keyword == "texture")
+		{
+			if (tokens.size() < 3)
+				return fail(path, line, "texture needs a name and a kind");
+
+			scene_texture t = {};
+			const std::string& kind = tokens[2];
+			if (kind == "solid" && tokens.size() == 6 && parse_floats(tokens, 3, 3, t.values))
+				t.type = scene_texture::solid;
+			else if (kind == "checker" && tokens.size() == 5)
+			{
+				t.type = scene_texture::checker;
+				if (!lookup(textures, tokens[3], t.refs[0]) || !lookup(textures, tokens[4], t.refs[1]))
+					return fail(path, line, "unknown texture in checker");
+			}
+			else if (kind == "noise" && tokens.size() == 4 && parse_floats(tokens, 3, 1, t.values))
+				t.type = scene_texture::noise;
+			else if (kind == "image" && tokens.size() == 4)
+			{
+				t.type = scene_texture::image;
+				t.path = static_cast<uint32_t>(source.strings.size());
+				source.strings += tokens[3];
+				source.strings += '\0';
+			}
+			else
+				return fail(path, line, "bad texture '" + kind + "'");
+
+			textures[tokens[1]] = static_cast<uint32_t>(source.textures.size());
+			source.textures.push_back(t);
+		}
+		else if (keyword == "material")
+		{
+			if (tokens.size() < 3)
+				return fail(path, line, "material needs a name and a kind");
+
+			scene_material m = {};
+			const std::string& kind = tokens[2];
+			bool textured = kind == "lambertian" || kind == "diffuse_light" || kind == "isotropic";
+			if (textured && tokens.size() == 4)
+			{
+				m.type = kind == "lambertian" ? scene_material::lambertian : kind == "diffuse_light" ? scene_material::diffuse_light : scene_material::isotropic;
+				if (!lookup(textures, tokens[3], m.texture))
+					return fail(path, line, "unknown texture '" + tokens[3] + "'");
+			}
+			else if ((kind == "metal" || kind == "dielectric") && tokens.size() == 7 && parse_floats(tokens, 3, 4, m.values))
+				m.type = kind == "metal" ? scene_material::metal : scene_material::dielectric;
+			else
+				return fail(path, line, "bad material '" + kind + "'");
+
+			materials[tokens[1]] = static_cast<uint32_t>(source.materials.size());
+			source.materials.push_back(m);
+		}
+		else
+		{
+			// A shape behind its modifiers
+			scene_primitive p = {};
+			p.transform = -1;
+			affine_transform objectToWorld;
+			bool transformed = false;
+
+			size_t k = 0;
+			for (; k < tokens.size(); k++)
+			{
+				float v[3];
+				if (tokens[k] == "light")
+					p.flags |= scene_primitive::light;
+				else if (tokens[k] == "flip")
+					p.flags |= scene_primitive::flipped;
+				else if (tokens[k] == "medium" && parse_floats(tokens, k + 1, 1, v))
+				{
+					p.flags |= scene_primitive::medium;
+					p.negInverseDensity = -1 / v[0];
+					k += 1;
+				}
+				else if (tokens[k] == "translate" && parse_floats(tokens, k + 1, 3, v))
+				{
+					objectToWorld = objectToWorld * affine_transform::translation(vec3(v[0], v[1], v[2]));
+					transformed = true;
+					k += 3;
+				}
+				else if (tokens[k] == "rotate_y" && parse_floats(tokens, k + 1, 1, v))
+				{
+					objectToWorld = objectToWorld * affine_transform::rotation_y(v[0]);
+					transformed = true;
+					k += 1;
+				}
+				else
+					break;
+			}
+
+			if (k + 1 >= tokens.size())
+				return fail(path, line, "expected a shape and its material");
+
+			static const char* shapes[] = { "sphere", "moving_sphere", "xy_rect", "xz_rect", "yz_rect", "box" };
+			static const int params[] = { 4, 9, 5, 5, 5, 6 };
+			int shape = -1;
+			for (int s = 0; s < 6; s++)
+				if (tokens[k] == shapes[s])
+					shape = s;
+
+			if (shape < 0)
+				return fail(path, line, "unknown statement '" + tokens[k] + "'");
+			if (tokens.size() != k + 2 + params[shape] || !parse_floats(tokens, k + 2, params[shape], p.params))
+				return fail(path, line, std::string(shapes[shape]) + " takes a material and " + std::to_string(params[shape]) + " numbers");
+			if (!lookup(materials, tokens[k + 1], p.material))
+				return fail(path, line, "unknown material '" + tokens[k + 1] + "'");
+			if ((p.flags & scene_primitive::light) && (transformed || (p.flags & scene_primitive::medium)))
+				return fail(path, line, "lights cannot be transformed or be media");
+
+			p.type = static_cast<uint32_t>(shape);
+
+			if (transformed)
+			{
+				std::string key(reinterpret_cast<const char*>(&objectToWorld), sizeof(objectToWorld));
+				auto found = transforms.find(key);
+				if (found == transforms.end())
+				{
+					found = transforms.emplace(key, static_cast<int32_t>(source.transforms.size())).first;
+					source.transforms.push_back({ objectToWorld, objectToWorld.inverse() });
+				}
+				p.transform = found->second;
+			}
+
+			source.primitives.push_back(p);
+		}
+	}
+
+	return true;
+}
+
+// Builds the BVH of source and lays everything out the way compiled_scene
+// reads it.
+inline std::vector<uint8_t> compile_scene(const scene_source& source)
+{
+	using namespace scene_file;
+
+	std::vector<bvh_primitive_info> info;
+	info.reserve(source.primitives.size());
+	for (size_t i = 0; i < source.primitives.size(); i++)
+	{
+		const scene_primitive& p = source.primitives[i];
+		aabb box;
+		with_shape(p, [&](const hittable& shape) { return shape.bounding_box(0, 1, box); });
+		if (p.transform >= 0)
+			box = source.transforms[p.transform].objectToWorld.apply_box(box);
+		info.push_back({ i, box, 0.5f * (box.GetMin() + box.GetMax()) });
+	}
+
+	bvh_tree tree;
+	tree.build(info, bvh_node::s_MaxLeafSize);
+
+	// Primitives in leaf order, with the lights' indices following them
+	std::vector<scene_primitive> primitives;
+	std::vector<uint32_t> lights;
+	primitives.reserve(info.size());
+	for (const auto& prim : info)
+	{
+		if (source.primitives[prim.index].flags & scene_primitive::light)
+			lights.push_back(static_cast<uint32_t>(primitives.size()));
+		primitives.push_back(source.primitives[prim.index]);
+	}
+
+	header h = {};
+	std::memcpy(h.magic, s_Magic, sizeof(s_Magic));
+	h.version = s_Version;
+	h.byteOrder = s_ByteOrder;
+	h.bvhWidth = RT_BVH_WIDTH;
+	h.primitiveSize = sizeof(scene_primitive);
+	h.nodeSize = sizeof(wide_bvh_node);
+	h.hasCamera = source.hasCamera;
+	const scene_camera& c = source.camera;
+	float camera[12] = { c.lookfrom.x(), c.lookfrom.y(), c.lookfrom.z(), c.lookat.x(), c.lookat.y(), c.lookat.z(),
+		c.vup.x(), c.vup.y(), c.vup.z(), c.vfov, c.aperture, c.focus };
+	std::memcpy(h.camera, camera, sizeof(camera));
+	for (int a = 0; a < 3; a++)
+	{
+		h.background[a] = source.background[a];
+		h.bounds[a] = tree.bounds().GetMin()[a];
+		h.bounds[3 + a] = tree.bounds().GetMax()[a];
+	}
+
+	std::vector<uint8_t> blob(sizeof(header));
+	auto append = [&](section& s, const void* data, size_t count, size_t size) {
+		// Every section starts on a cache line, which the BVH nodes need
+		blob.resize((blob.size() + 63) & ~size_t(63));
+		s.offset = blob.size();
+		s.count = count;
+		const uint8_t* bytes = static_cast<const uint8_t*>(data);
+		blob.insert(blob.end(), bytes, bytes + count * size);
+	};
+	append(h.textures, source.textures.data(), source.textures.size(), sizeof(scene_texture));
+	append(h.materials, source.materials.data(), source.materials.size(), sizeof(scene_material));
+	append(h.primitives, primitives.data(), primitives.size(), sizeof(scene_primitive));
+	append(h.transforms, source.transforms.data(), source.transforms.size(), sizeof(scene_transform));
+	append(h.lights, lights.data(), lights.size(), sizeof(uint32_t));
+	append(h.nodes, tree.nodes(), tree.node_count(), sizeof(wide_bvh_node));
+	append(h.strings, source.strings.data(), source.strings.size(), 1);
+
+	std::memcpy(blob.data(), &h, sizeof(h));
+	return blob;
+}
+
+// Compiles the text scene at input into the binary file output
+inline bool compile_scene_file(const std::string& input, const std::string& output)
+{
+	scene_source source;
+	if (!parse_scene(input, source))
+		return false;
+
+	std::vector<uint8_t> blob = compile_scene(source);
+	std::ofstream out(output, std::ios::binary);
+	if (!out || !out.write(reinterpret_cast<const char*>(blob.data()), blob.size()))
+	{
+		std::cerr << "ERROR: Could not write '" << output << "'.\n";
+		return false;
+	}
+	return true;
+}
+
+// A compiled scene, traced straight from the file's memory. Its primitives
+// are tested through temporary shape objects built from their records.
+class compiled_scene : public hittable
+{
+public:
+	compiled_scene() {}
+	compiled_scene(const compiled_scene&) = delete;
+	compiled_scene& operator=(const compiled_scene&) = delete;
+
+	// Maps a compiled file, or compiles a text one in memory. Its textures and
+	// materials are added to materials and its lights to lights, so it must be
+	// the only scene in that table.
+	bool open(const std::string& path, material_table& materials, light_list& lights)
+	{
+		mapped_file file(path.c_str());
+		if (!file.valid())
+		{
+			std::cerr << "ERROR: Could not open scene file '" << path << "'.\n";
+			return false;
+		}
+
+		if (file.size() >= sizeof(scene_file::s_Magic) && std::memcmp(file.data(), scene_file::s_Magic, sizeof(scene_file::s_Magic)) == 0)
+		{
+			m_File = std::move(file);
+			return attach(m_File.data(), m_File.size(), path, materials, lights);
+		}
+
+		scene_source source;
+		if (!parse_scene(path, source))
+			return false;
+
+		// Copied into storage aligned like the nodes
+		std::vector<uint8_t> blob = compile_scene(source);
+		m_Memory.resize(blob.size() / sizeof(wide_bvh_node) + 1);
+		std::memcpy(m_Memory.data(), blob.data(), blob.size());
+		return attach(reinterpret_cast<const uint8_t*>(m_Memory.data()), blob.size(), path, materials, lights);
+	}
+
+	bool has_camera() const { return m_Header && m_Header->hasCamera; }
+
+	scene_camera GetCamera() const
+	{
+		const float* c = m_Header->camera;
+		return { point3(c[0], c[1], c[2]), point3(c[3], c[4], c[5]), vec3(c[6], c[7], c[8]), c[9], c[10], c[11] };
+	}
+
+	color GetBackground() const
+	{
+		return m_Header ? color(m_Header->background[0], m_Header->background[1], m_Header->background[2]) : color(0.0f);
+	}
+
+	size_t size() const { return m_PrimitiveCount; }
+
+	virtual bool hit(const ray& r, float t_min, float t_max, hit_record& rec) const override
+	{
+		return m_Tree.traverse(r, t_min, t_max, [&](int first, int count, float& closest) {
+			bool hit_anything = false;
+			for (int i = first; i < first + count; i++)
+			{
+				if (hit_primitive(m_Primitives[i], r, t_min, closest, rec))
+				{
+					hit_anything = true;
+					closest = rec.t;
+				}
+			}
+			return hit_anything;
+		});
+	}
+
+	virtual int hit_packet(const ray_packet& packet, int mask, float t_min, float* t_max, hit_record* recs) const override
+	{
+		return m_Tree.traverse_packet(packet, mask, t_min, t_max, [&](int first, int count, int rays, float* closest) {
+			int hits = 0;
+			for (int i = first; i < first + count; i++)
+			{
+				for (int k = 0; k < packet.count; k++)
+				{
+					if ((rays & (1 << k)) && hit_primitive(m_Primitives[i], packet.rays[k], t_min, closest[k], recs[k]))
+					{
+						hits |= 1 << k;
+						closest[k] = recs[k].t;
+					}
+				}
+			}
+			return hits;
+		});
+	}
+
+	virtual bool bounding_box(float t0, float t1, aabb& output_box) const override
+	{
+		if (m_Tree.empty())
+			return false;
+
+		output_box = m_Tree.bounds();
+		return true;
+	}
+
+private:
+	bool attach(const uint8_t* data, size_t size, const std::string& path, material_table& materials, light_list& lights)
+	{
+		using namespace scene_file;
+
+		auto invalid = [&](const char* reason) {
+			std::cerr << "ERROR: Scene file '" << path << "' " << reason << ".\n";
+			return false;
+		};
+
+		if (size < sizeof(header))
+			return invalid("is too short");
+
+		const header* h = reinterpret_cast<const header*>(data);
+		if (h->version != s_Version || h->byteOrder != s_ByteOrder || h->primitiveSize != sizeof(scene_primitive))
+			return invalid("is of another version");
+		if (h->bvhWidth != RT_BVH_WIDTH || h->nodeSize != sizeof(wide_bvh_node))
+			return invalid("was compiled for another BVH width, compile it again");
+
+		auto fits = [&](const section& s, size_t element) { return s.offset <= size && s.count <= (size - s.offset) / element; };
+		if (!fits(h->textures, sizeof(scene_texture)) || !fits(h->materials, sizeof(scene_material)) || !fits(h->primitives, sizeof(scene_primitive))
+			|| !fits(h->transforms, sizeof(scene_transform)) || !fits(h->lights, sizeof(uint32_t)) || !fits(h->nodes, sizeof(wide_bvh_node))
+			|| !fits(h->strings, 1) || h->nodes.offset % alignof(wide_bvh_node) != 0)
+			return invalid("is truncated");
+
+		m_Header = h;
+		m_Primitives = reinterpret_cast<const scene_primitive*>(data + h->primitives.offset);
+		m_PrimitiveCount = h->primitives.count;
+		m_Transforms = reinterpret_cast<const scene_transform*>(data + h->transforms.offset);
+		m_Tree.attach(reinterpret_cast<const wide_bvh_node*>(data + h->nodes.offset), h->nodes.count,
+			aabb(point3(h->bounds[0], h->bounds[1], h->bounds[2]), point3(h->bounds[3], h->bounds[4], h->bounds[5])));
+
+		// Ids are assigned in order, the ones in the file refer to that order
+		const scene_texture* textures = reinterpret_cast<const scene_texture*>(data + h->textures.offset);
+		const char* strings = reinterpret_cast<const char*>(data + h->strings.offset);
+		for (size_t i = 0; i < h->textures.count; i++)
+		{
+			const scene_texture& t = textures[i];
+			switch (t.type)
+			{
+			case scene_texture::solid:
+				materials.add_texture(std::make_shared<solid_color>(t.values[0], t.values[1], t.values[2]));
+				break;
+			case scene_texture::checker:
+				materials.add_texture(std::make_shared<checker_texture>(t.refs[0], t.refs[1]));
+				break;
+			case scene_texture::noise:
+				materials.add_texture(std::make_shared<noise_texture>(t.values[0]));
+				break;
+			default:
+				materials.add_texture(std::make_shared<image_texture>(t.path < h->strings.count ? strings + t.path : ""));
+				break;
+			}
+		}
+
+		const scene_material* records = reinterpret_cast<const scene_material*>(data + h->materials.offset);
+		for (size_t i = 0; i < h->materials.count; i++)
+		{
+			const scene_material& m = records[i];
+			color albedo(m.values[0], m.values[1], m.values[2]);
+			switch (m.type)
+			{
+			case scene_material::lambertian:
+				materials.add(std::make_shared<lambertian>(m.texture));
+				break;
+			case scene_material::metal:
+				materials.add(std::make_shared<metal>(albedo, m.values[3]));
+				break;
+			case scene_material::dielectric:
+				materials.add(std::make_shared<dielectric>(albedo, m.values[3]));
+				break;
+			case scene_material::diffuse_light:
+				materials.add(std::make_shared<diffuse_light>(m.texture));
+				break;
+			default:
+				materials.add(std::make_shared<isotropic>(m.texture));
+				break;
+			}
+		}
+
+		const uint32_t* lightIndices = reinterpret_cast<const uint32_t*>(data + h->lights.offset);
+		for (size_t i = 0; i < h->lights.count; i++)
+		{
+			if (lightIndices[i] < m_PrimitiveCount)
+				lights.add(make_hittable(m_Primitives[lightIndices[i]]));
+		}
+
+		return true;
+	}
+
+	// Tests one record like the hittables it stands for would: the medium or
+	// shape inside its instance transform, with its face flipped if asked.
+	bool hit_primitive(const scene_primitive& p, const ray& r, float t_min, float t_max, hit_record& rec) const
+	{
+		const scene_transform* transform = p.transform >= 0 ? &m_Transforms[p.transform] : nullptr;
+		ray local = transform
+			? ray(transform->worldToObject.apply_point(r.GetOrigin()), transform->worldToObject.apply_vector(r.GetDirection()), r.GetTime(), r.GetSeed())
+			: r;
+
+		bool found = scene_file::with_shape(p, [&](const hittable& shape) {
+			if (p.flags & scene_primitive::medium)
+				return constant_medium::hit_medium(shape, p.negInverseDensity, p.material, local, t_min, t_max, rec);
+			return shape.hit(local, t_min, t_max, rec);
+		});
+
+		if (!found)
+			return false;
+
+		if (p.flags & scene_primitive::flipped)
+			rec.front_face = !rec.front_face;
+
+		if (transform)
+		{
+			rec.p = transform->objectToWorld.apply_point(rec.p);
+			rec.normal = unit_vector(transform->worldToObject.apply_transposed(rec.normal));
+		}
+		return true;
+	}
+
+	mapped_file m_File;
+	std::vector<wide_bvh_node> m_Memory; // A text scene compiled on load
+	const scene_file::header* m_Header = nullptr;
+	const scene_primitive* m_Primitives = nullptr;
+	size_t m_PrimitiveCount = 0;
+	const scene_transform* m_Transforms = nullptr;
+	bvh_tree m_Tree;
+};
+
+#endif
@@ -4,17 +4,51 @@
 #define SPHERE_H
 
 #include "hittable.h"
+#include "onb.h"
 #include "vec3.h"
 
+// Moves p onto the sphere and returns the outward normal there. A hit point
+// computed as origin + t * direction carries the rounding error of t, which
+// for rays from far away is enough to put it visibly inside the sphere, where
+// rays leaving the surface hit it again.
+inline vec3 snap_to_sphere(point3& p, const point3& center, float radius)
+{
+	vec3 normal = unit_vector(p - center);
+	p = center + radius * normal;
+	return normal;
+}
+
+// Both roots of the sphere's quadratic that lie in (t_min, t_max), computed
+// the way hit computes them so they agree with it exactly.
+inline void sphere_crossings(const ray& r, const point3& center, float radius, float t_min, float t_max, crossing_list& out)
+{
+	vec3 oc = r.GetOrigin() - center;
+	float a = r.GetDirection().length_squared();
+	float halfB = dot(oc, r.GetDirection());
+	float c = oc.length_squared() - radius * radius;
+	float discriminant = halfB * halfB - a * c;
+	if (discriminant <= 0)
+		return;
+
+	float root = sqrt(discriminant);
+	float tNear = (-halfB - root) / a;
+	float tFar = (-halfB + root) / a;
+	if (tNear < t_max && tNear > t_min)
+		out.insert(tNear);
+	if (tFar < t_max && tFar > t_min)
+		out.insert(tFar);
+}
+
 class sphere : public hittable
 {
 public:
 	sphere() {}
-	sphere(point3 center, float r, std::shared_ptr<material> m)
-		: m_Center(center), m_Radius(r), m_MatPtr(m) {};
+	sphere(point3 center, float r, material_id m)
+		: m_Center(center), m_Radius(r), m_Material(m) {};
 
 	virtual bool hit(const ray& r, float t_min, float t_max, hit_record& rec) const override
 	{
+		RT_STAT(render_stats::local().tests[render_stats::prim_sphere]++);
 		vec3 oc = r.GetOrigin() - m_Center;
 		float a = r.GetDirection().length_squared();
 		float halfB = dot(oc, r.GetDirection());
@@ -30,9 +64,12 @@ public:
 			{
 				rec.t = temp;
 				rec.p = r.at(rec.t);
-				vec3 outward_normal = (rec.p - m_Center) / m_Radius;
+				vec3 outward_normal = snap_to_sphere(rec.p, m_Center, m_Radius);
 				rec.set_face_normal(r, outward_normal);
-				rec.matPtr = m_MatPtr;
+				get_sphere_uv(outward_normal, rec.u, rec.v);
+				rec.footprint = 1.0f / (PI * m_Radius);
+				rec.matId = m_Material;
+				rec.primId = 0;
 				return true;
 			}
 
@@ -41,21 +78,63 @@ public:
 			{
 				rec.t = temp;
 				rec.p = r.at(rec.t);
-				vec3 outward_normal = (rec.p - m_Center) / m_Radius;
+				vec3 outward_normal = snap_to_sphere(rec.p, m_Center, m_Radius);
 				rec.set_face_normal(r, outward_normal);
-				rec.matPtr = m_MatPtr;
+				get_sphere_uv(outward_normal, rec.u, rec.v);
+				rec.footprint = 1.0f / (PI * m_Radius);
+				rec.matId = m_Material;
+				rec.primId = 0;
 				return true;
 			}
 		}
 		return false;
 	}
 
+	virtual void crossings(const ray& r, float t_min, float t_max, crossing_list& out) const override
+	{
+		sphere_crossings(r, m_Center, m_Radius, t_min, t_max, out);
+	}
+
 	virtual bool bounding_box(float t0, float t1, aabb& output_box) const override {
 		output_box = aabb(m_Center - vec3(m_Radius, m_Radius, m_Radius), m_Center + vec3(m_Radius, m_Radius, m_Radius));
 		return true;
 	}
 
-	void get_sphere_uv(const vec3& p, float& u, float& v)
+	// Directions are drawn uniformly from the cone the sphere subtends at o.
+	// From inside the sphere every direction hits it and is drawn uniformly.
+	virtual float pdf_value(const point3& o, const vec3& v) const override
+	{
+		hit_record rec;
+		if (!hit(ray(o, v), 0.001f, INF, rec))
+			return 0.0f;
+
+		float distance_squared = (m_Center - o).length_squared();
+		if (distance_squared <= m_Radius * m_Radius)
+			return 1.0f / (4.0f * PI);
+
+		float cos_theta_max = sqrt(1.0f - m_Radius * m_Radius / distance_squared);
+		return 1.0f / (2.0f * PI * (1.0f - cos_theta_max));
+	}
+
+	virtual vec3 random(const point3& o, sampler& s) const override
+	{
+		vec3 direction = m_Center - o;
+		float distance_squared = direction.length_squared();
+		if (distance_squared <= m_Radius * m_Radius)
+			return random_unit_vector(s);
+
+		float r1 = s.next();
+		float r2 = s.next();
+		float z = 1.0f + r2 * (sqrt(1.0f - m_Radius * m_Radius / distance_squared) - 1.0f);
+		float phi = 2.0f * PI * r1;
+		float sin_theta = sqrt(fmax(0.0f, 1.0f - z * z));
+		return onb(direction).local(cos(phi) * sin_theta, sin(phi) * sin_theta, z);
+	}
+
+	// Texture coords of the point p on the unit sphere. v runs from pole to
+	// pole, so along it u and v change by 1 / (pi r) per unit of distance, and
+	// u changes at most that fast away from the poles.
+	static void get_sphere_uv(const vec3& p, float& u, float& v)
 	{
 		auto phi = atan2(p.y(), p.x());
 		auto theta = asin(p.z());
@@ -66,19 +145,20 @@ public:
 private:
 	point3 m_Center;
 	float m_Radius;
-	std::shared_ptr<material> m_MatPtr;
+	material_id m_Material;
 };
 
 class moving_sphere : public hittable
 {
 public:
 	moving_sphere() {}
-	moving_sphere(point3 center0, point3 center1, float t0, float t1, float r, std::shared_ptr<material> m)
-		: m_Center0(center0), m_Center1(center1), m_T0(t0), m_T1(t1), m_Radius(r), m_MatPtr(m) {
+	moving_sphere(point3 center0, point3 center1, float t0, float t1, float r, material_id m)
+		: m_Center0(center0), m_Center1(center1), m_T0(t0), m_T1(t1), m_Radius(r), m_Material(m) {
 	};
 
 	virtual bool hit(const ray& r, float t_min, float t_max, hit_record& rec) const override
 	{
+		RT_STAT(render_stats::local().tests[render_stats::prim_moving_sphere]++);
 		vec3 oc = r.GetOrigin() - GetCenter(r.GetTime());
 		float a = r.GetDirection().length_squared();
 		float halfB = dot(oc, r.GetDirection());
@@ -94,9 +174,12 @@ public:
 			{
 				rec.t = temp;
 				rec.p = r.at(rec.t);
-				vec3 outward_normal = (rec.p - GetCenter(r.GetTime())) / m_Radius;
+				vec3 outward_normal = snap_to_sphere(rec.p, GetCenter(r.GetTime()), m_Radius);
 				rec.set_face_normal(r, outward_normal);
-				rec.matPtr = m_MatPtr;
+				sphere::get_sphere_uv(outward_normal, rec.u, rec.v);
+				rec.footprint = 1.0f / (PI * m_Radius);
+				rec.matId = m_Material;
+				rec.primId = 0;
 				return true;
 			}
 
@@ -105,15 +188,23 @@ public:
 			{
 				rec.t = temp;
 				rec.p = r.at(rec.t);
-				vec3 outward_normal = (rec.p - GetCenter(r.GetTime())) / m_Radius;
+				vec3 outward_normal = snap_to_sphere(rec.p, GetCenter(r.GetTime()), m_Radius);
 				rec.set_face_normal(r, outward_normal);
-				rec.matPtr = m_MatPtr;
+				sphere::get_sphere_uv(outward_normal, rec.u, rec.v);
+				rec.footprint = 1.0f / (PI * m_Radius);
+				rec.matId = m_Material;
+				rec.primId = 0;
 				return true;
 			}
 		}
 		return false;
 	}
 
+	virtual void crossings(const ray& r, float t_min, float t_max, crossing_list& out) const override
+	{
+		sphere_crossings(r, GetCenter(r.GetTime()), m_Radius, t_min, t_max, out);
+	}
+
 	virtual bool bounding_box(float t0, float t1, aabb& output_box) const override {
 		aabb box0 = aabb(m_Center0 - vec3(m_Radius, m_Radius, m_Radius), m_Center0 + vec3(m_Radius, m_Radius, m_Radius));
 		aabb box1 = aabb(m_Center1 - vec3(m_Radius, m_Radius, m_Radius), m_Center1 + vec3(m_Radius, m_Radius, m_Radius));
@@ -130,7 +221,7 @@ private:
 	point3 m_Center0, m_Center1;
 	float m_T0, m_T1;
 	float m_Radius;
-	std::shared_ptr<material> m_MatPtr;
+	material_id m_Material;
 };
 
 
@@ -0,0 +1,285 @@
+#pragma once
+
+#ifndef SPHERE_SET_H
+#define SPHERE_SET_H
+
+#include "bvh.h"
+#include "sphere.h"
+
+#include <cstdint>
+#include <vector>
+
+// Many static spheres behind a single hittable, for particle and point cloud
+// scenes. Centers and radii are kept in SoA arrays in the order of an internal
+// BVH whose leaves hold up to s_LeafSize spheres, so a leaf is intersected
+// with one SIMD pass over contiguous memory. Records are only filled in for
+// the closest hit, with the index add returned for it as the primitive id.
+class sphere_set : public hittable
+{
+public:
+	static const int s_LeafSize = 8;
+
+	sphere_set() {}
+
+	// Adds a sphere and returns its index
+	uint32_t add(const point3& center, float radius, material_id material)
+	{
+		m_Spheres.push_back({ center, radius, material });
+		return static_cast<uint32_t>(m_Spheres.size() - 1);
+	}
+
+	// Builds the BVH and the SoA arrays. Needs to be called after the last add
+	// and before the set is traced.
+	void build()
+	{
+		std::vector<bvh_primitive_info> info;
+		info.reserve(m_Spheres.size());
+
+		for (size_t i = 0; i < m_Spheres.size(); i++)
+		{
+			const pending& s = m_Spheres[i];
+			vec3 extent(s.radius, s.radius, s.radius);
+			info.push_back({ i, aabb(s.center - extent, s.center + extent), s.center });
+		}
+
+		m_Tree.build(info, s_LeafSize);
+
+		// Leaves index into info, which the build left in leaf order. The arrays are
+		// padded so the last leaf can load a full s_LeafSize lanes.
+		size_t padded = info.size() + s_LeafSize;
+		for (auto* array : { &m_CenterX, &m_CenterY, &m_CenterZ, &m_Radius })
+			array->assign(padded, 0.0f);
+		m_Material.assign(padded, 0);
+		m_PrimId.assign(padded, 0);
+
+		for (size_t i = 0; i < info.size(); i++)
+		{
+			const pending& s = m_Spheres[info[i].index];
+			m_CenterX[i] = s.center.x();
+			m_CenterY[i] = s.center.y();
+			m_CenterZ[i] = s.center.z();
+			m_Radius[i] = s.radius;
+			m_Material[i] = s.material;
+			m_PrimId[i] = static_cast<uint32_t>(info[i].index);
+		}
+
+		m_Spheres.clear();
+		m_Spheres.shrink_to_fit();
+	}
+
+	size_t size() const { return m_Material.empty() ? 0 : m_Material.size() - s_LeafSize; }
+
+	virtual bool hit(const ray& r, float t_min, float t_max, hit_record& rec) const override
+	{
+		int closest = -1;
+		float closestT = t_max;
+		bool found = m_Tree.traverse(r, t_min, t_max, [&](int first, int count, float& t) {
+			int lane = intersect_leaf(r, first, count, t_min, t);
+			if (lane < 0)
+				return false;
+
+			closest = first + lane;
+			closestT = t;
+			return true;
+		});
+
+		if (!found)
+			return false;
+
+		// The leaf test only returned the distance, the rest of the record is
+		// computed once for the sphere that ended up closest. The distance is
+		// not solved for again: a compiler contracting the scalar quadratic into
+		// fused multiply-adds can round a grazing hit's discriminant below zero.
+		point3 center(m_CenterX[closest], m_CenterY[closest], m_CenterZ[closest]);
+		float radius = m_Radius[closest];
+
+		rec.t = closestT;
+		rec.p = r.at(rec.t);
+		vec3 outward_normal = snap_to_sphere(rec.p, center, radius);
+		rec.set_face_normal(r, outward_normal);
+		rec.u = rec.v = 0.0f; // Particles have no surface parameterisation
+		rec.footprint = 0.0f;
+		rec.matId = m_Material[closest];
+		rec.primId = m_PrimId[closest];
+		return true;
+	}
+
+	// Both crossings of every sphere in the leaves the ray passes through
+	virtual void crossings(const ray& r, float t_min, float t_max, crossing_list& out) const override
+	{
+		m_Tree.traverse(r, t_min, t_max, [&](int first, int count, float&) {
+			for (int i = first; i < first + count; i++)
+				sphere_crossings(r, point3(m_CenterX[i], m_CenterY[i], m_CenterZ[i]), m_Radius[i], t_min, t_max, out);
+			return false;
+		});
+	}
+
+	virtual bool bounding_box(float t0, float t1, aabb& output_box) const override
+	{
+		if (m_Tree.empty())
+			return false;
+
+		output_box = m_Tree.bounds();
+		return true;
+	}
+
+private:
+	struct pending
+	{
+		point3 center;
+		float radius;
+		material_id material;
+	};
+
+	// Intersects the count spheres starting at first and returns the lane of the
+	// closest one hit within (t_min, t_max), shrinking t_max to its distance, or
+	// -1 if none is hit. Uses the same arithmetic as sphere::hit per lane.
+	int intersect_leaf(const ray& r, int first, int count, float t_min, float& t_max) const
+	{
+		RT_STAT(render_stats::local().tests[render_stats::prim_sphere_set] += count);
+		const vec3& o = r.GetOrigin();
+		const vec3& d = r.GetDirection();
+		float a = d.length_squared();
+
+#if defined(RT_BVH_AVX)
+		__m256 ox = _mm256_sub_ps(_mm256_set1_ps(o.x()), _mm256_loadu_ps(&m_CenterX[first]));
+		__m256 oy = _mm256_sub_ps(_mm256_set1_ps(o.y()), _mm256_loadu_ps(&m_CenterY[first]));
+		__m256 oz = _mm256_sub_ps(_mm256_set1_ps(o.z()), _mm256_loadu_ps(&m_CenterZ[first]));
+		__m256 radius = _mm256_loadu_ps(&m_Radius[first]);
+
+		__m256 halfB = _mm256_add_ps(_mm256_add_ps(
+			_mm256_mul_ps(ox, _mm256_set1_ps(d.x())), _mm256_mul_ps(oy, _mm256_set1_ps(d.y()))),
+			_mm256_mul_ps(oz, _mm256_set1_ps(d.z())));
+		__m256 c = _mm256_sub_ps(_mm256_add_ps(_mm256_add_ps(
+			_mm256_mul_ps(ox, ox), _mm256_mul_ps(oy, oy)), _mm256_mul_ps(oz, oz)),
+			_mm256_mul_ps(radius, radius));
+
+		__m256 va = _mm256_set1_ps(a);
+		__m256 discriminant = _mm256_sub_ps(_mm256_mul_ps(halfB, halfB), _mm256_mul_ps(va, c));
+
+		// Most leaves the ray reaches are missed entirely, which is known before
+		// the square root and divisions.
+		__m256 used = _mm256_cmp_ps(_mm256_setr_ps(0, 1, 2, 3, 4, 5, 6, 7), _mm256_set1_ps(static_cast<float>(count)), _CMP_LT_OQ);
+		__m256 valid = _mm256_and_ps(used, _mm256_cmp_ps(discriminant, _mm256_setzero_ps(), _CMP_GT_OQ));
+		if (_mm256_movemask_ps(valid) == 0)
+			return -1;
+
+		__m256 root = _mm256_sqrt_ps(discriminant);
+		__m256 negB = _mm256_sub_ps(_mm256_setzero_ps(), halfB);
+		__m256 tnear = _mm256_div_ps(_mm256_sub_ps(negB, root), va);
+		__m256 tfar = _mm256_div_ps(_mm256_add_ps(negB, root), va);
+
+		__m256 lo = _mm256_set1_ps(t_min);
+		__m256 hi = _mm256_set1_ps(t_max);
+		__m256 nearOk = _mm256_and_ps(valid, _mm256_and_ps(_mm256_cmp_ps(tnear, hi, _CMP_LT_OQ), _mm256_cmp_ps(tnear, lo, _CMP_GT_OQ)));
+		__m256 farOk = _mm256_and_ps(valid, _mm256_and_ps(_mm256_cmp_ps(tfar, hi, _CMP_LT_OQ), _mm256_cmp_ps(tfar, lo, _CMP_GT_OQ)));
+
+		__m256 inf = _mm256_set1_ps(INF);
+		__m256 t = _mm256_blendv_ps(_mm256_blendv_ps(inf, tfar, farOk), tnear, nearOk);
+
+		// Closest lane through a horizontal minimum
+		__m256 m = _mm256_min_ps(t, _mm256_permute2f128_ps(t, t, 1));
+		m = _mm256_min_ps(m, _mm256_shuffle_ps(m, m, _MM_SHUFFLE(1, 0, 3, 2)));
+		m = _mm256_min_ps(m, _mm256_shuffle_ps(m, m, _MM_SHUFFLE(2, 3, 0, 1)));
+		float best = _mm256_cvtss_f32(m);
+		if (!(best < INF))
+			return -1;
+
+		int lanes = _mm256_movemask_ps(_mm256_cmp_ps(t, m, _CMP_EQ_OQ));
+		int lane = 0;
+		while (!(lanes & (1 << lane)))
+			lane++;
+
+		t_max = best;
+		return lane;
+#elif defined(RT_BVH_SSE)
+		// Two passes of four lanes, then a scalar pick of the closest
+		alignas(16) float dist[s_LeafSize];
+		__m128 va = _mm_set1_ps(a);
+		__m128 lo = _mm_set1_ps(t_min);
+		__m128 hi = _mm_set1_ps(t_max);
+		__m128 inf = _mm_set1_ps(INF);
+
+		for (int half = 0; half < count; half += 4)
+		{
+			__m128 ox = _mm_sub_ps(_mm_set1_ps(o.x()), _mm_loadu_ps(&m_CenterX[first + half]));
+			__m128 oy = _mm_sub_ps(_mm_set1_ps(o.y()), _mm_loadu_ps(&m_CenterY[first + half]));
+			__m128 oz = _mm_sub_ps(_mm_set1_ps(o.z()), _mm_loadu_ps(&m_CenterZ[first + half]));
+			__m128 radius = _mm_loadu_ps(&m_Radius[first + half]);
+
+			__m128 halfB = _mm_add_ps(_mm_add_ps(
+				_mm_mul_ps(ox, _mm_set1_ps(d.x())), _mm_mul_ps(oy, _mm_set1_ps(d.y()))),
+				_mm_mul_ps(oz, _mm_set1_ps(d.z())));
+			__m128 c = _mm_sub_ps(_mm_add_ps(_mm_add_ps(
+				_mm_mul_ps(ox, ox), _mm_mul_ps(oy, oy)), _mm_mul_ps(oz, oz)),
+				_mm_mul_ps(radius, radius));
+
+			__m128 discriminant = _mm_sub_ps(_mm_mul_ps(halfB, halfB), _mm_mul_ps(va, c));
+			__m128 valid = _mm_cmpgt_ps(discriminant, _mm_setzero_ps());
+			if (_mm_movemask_ps(valid) == 0)
+			{
+				_mm_store_ps(dist + half, inf);
+				continue;
+			}
+
+			__m128 root = _mm_sqrt_ps(discriminant);
+			__m128 negB = _mm_sub_ps(_mm_setzero_ps(), halfB);
+			__m128 tnear = _mm_div_ps(_mm_sub_ps(negB, root), va);
+			__m128 tfar = _mm_div_ps(_mm_add_ps(negB, root), va);
+
+			__m128 nearOk = _mm_and_ps(valid, _mm_and_ps(_mm_cmplt_ps(tnear, hi), _mm_cmpgt_ps(tnear, lo)));
+			__m128 farOk = _mm_and_ps(valid, _mm_and_ps(_mm_cmplt_ps(tfar, hi), _mm_cmpgt_ps(tfar, lo)));
+
+			__m128 t = _mm_or_ps(_mm_and_ps(farOk, tfar), _mm_andnot_ps(farOk, inf));
+			t = _mm_or_ps(_mm_and_ps(nearOk, tnear), _mm_andnot_ps(nearOk, t));
+			_mm_store_ps(dist + half, t);
+		}
+
+		int lane = -1;
+		for (int i = 0; i < count; i++)
+		{
+			if (dist[i] < t_max)
+			{
+				t_max = dist[i];
+				lane = i;
+			}
+		}
+		return lane;
+#else
+		int lane = -1;
+		for (int i = 0; i < count; i++)
+		{
+			float ox = o.x() - m_CenterX[first + i];
+			float oy = o.y() - m_CenterY[first + i];
+			float oz = o.z() - m_CenterZ[first + i];
+			float radius = m_Radius[first + i];
+
+			float halfB = ox * d.x() + oy * d.y() + oz * d.z();
+			float c = (ox * ox + oy * oy + oz * oz) - radius * radius;
+			float discriminant = halfB * halfB - a * c;
+			if (discriminant <= 0)
+				continue;
+
+			float root = sqrt(discriminant);
+			float t = (-halfB - root) / a;
+			if (!(t < t_max && t > t_min))
+				t = (-halfB + root) / a;
+
+			if (t < t_max && t > t_min)
+			{
+				t_max = t;
+				lane = i;
+			}
+		}
+		return lane;
+#endif
+	}
+
+	bvh_tree m_Tree;
+	std::vector<float> m_CenterX, m_CenterY, m_CenterZ, m_Radius;
+	std::vector<material_id> m_Material;
+	std::vector<uint32_t> m_PrimId; // Index the sphere was added with
+	std::vector<pending> m_Spheres;
+};
+
+#endif
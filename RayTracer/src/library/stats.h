@@ -0,0 +1,155 @@
+#pragma once
+
+#ifndef STATS_H
+#define STATS_H
+
+#include <cstdint>
+#include <fstream>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+// Render statistics are only counted when RT_ENABLE_STATS is defined.
+// RT_STAT(statement) compiles to the statement then, and to nothing otherwise,
+// so the counting sites cost nothing in a normal build.
+#if defined(RT_ENABLE_STATS)
+	#define RT_STAT(...) __VA_ARGS__
+#else
+	#define RT_STAT(...)
+#endif
+
+// What a render spent its work on. Every thread counts into its own copy,
+// found with local(), so counting is a plain increment. The copies are kept
+// after their threads end and summed by total() once the render is done.
+struct render_stats
+{
+	static const int s_MaxDepth = 64;
+
+	enum primitive { prim_sphere, prim_moving_sphere, prim_rect, prim_box, prim_sphere_set, prim_triangle, prim_medium, prim_instance, primitive_count };
+	enum material_class { mat_lambertian, mat_metal, mat_dielectric, mat_diffuse_light, mat_isotropic, material_count };
+	enum texture_class { tex_solid, tex_checker, tex_noise, tex_image, texture_count };
+	enum path_end { end_escaped, end_absorbed, end_roulette, end_max_depth, end_count };
+
+	uint64_t rays[s_MaxDepth] = {}; // Traced at each bounce, the last entry also counts deeper ones
+	uint64_t shadowRays = 0;
+	uint64_t nodes = 0; // BVH nodes whose children were tested, a packet's shared visit counts once
+	uint64_t tests[primitive_count] = {};
+	uint64_t scatters[material_count] = {};
+	uint64_t lookups[texture_count] = {};
+	uint64_t ends[end_count] = {};
+
+	void count_rays(int depth, uint64_t n = 1)
+	{
+		rays[depth < s_MaxDepth ? depth : s_MaxDepth - 1] += n;
+	}
+
+	void add(const render_stats& other)
+	{
+		for (int i = 0; i < s_MaxDepth; i++)
+			rays[i] += other.rays[i];
+		shadowRays += other.shadowRays;
+		nodes += other.nodes;
+		for (int i = 0; i < primitive_count; i++)
+			tests[i] += other.tests[i];
+		for (int i = 0; i < material_count; i++)
+			scatters[i] += other.scatters[i];
+		for (int i = 0; i < texture_count; i++)
+			lookups[i] += other.lookups[i];
+		for (int i = 0; i < end_count; i++)
+			ends[i] += other.ends[i];
+	}
+
+	// The counters of the calling thread
+	static render_stats& local()
+	{
+		thread_local render_stats* mine = nullptr;
+		if (!mine)
+		{
+			registry& all = get_registry();
+			std::lock_guard<std::mutex> lock(all.mutex);
+			all.counters.emplace_back(new render_stats());
+			mine = all.counters.back().get();
+		}
+		return *mine;
+	}
+
+	// The sum over every thread. Not to be called while threads still count.
+	static render_stats total()
+	{
+		registry& all = get_registry();
+		std::lock_guard<std::mutex> lock(all.mutex);
+		render_stats sum;
+		for (const auto& counters : all.counters)
+			sum.add(*counters);
+		return sum;
+	}
+
+	static void reset()
+	{
+		registry& all = get_registry();
+		std::lock_guard<std::mutex> lock(all.mutex);
+		for (auto& counters : all.counters)
+			*counters = render_stats();
+	}
+
+	uint64_t all_rays() const
+	{
+		uint64_t sum = shadowRays;
+		for (int i = 0; i < s_MaxDepth; i++)
+			sum += rays[i];
+		return sum;
+	}
+
+	bool write_json(const std::string& path) const
+	{
+		static const char* primitiveNames[primitive_count] = { "sphere", "moving_sphere", "rect", "box", "sphere_set", "triangle", "constant_medium", "instance" };
+		static const char* materialNames[material_count] = { "lambertian", "metal", "dielectric", "diffuse_light", "isotropic" };
+		static const char* textureNames[texture_count] = { "solid_color", "checker_texture", "noise_texture", "image_texture" };
+		static const char* endNames[end_count] = { "escaped", "absorbed", "russian_roulette", "max_depth" };
+
+		std::ofstream out(path);
+		if (!out)
+			return false;
+
+		int depths = s_MaxDepth;
+		while (depths > 1 && rays[depths - 1] == 0)
+			depths--;
+
+		uint64_t traced = all_rays();
+		out << "{\n  \"rays_by_depth\": [";
+		for (int i = 0; i < depths; i++)
+			out << (i ? ", " : "") << rays[i];
+		out << "],\n  \"shadow_rays\": " << shadowRays << ",\n  \"rays\": " << traced << ",\n";
+		out << "  \"bvh_nodes\": " << nodes << ",\n";
+		out << "  \"bvh_nodes_per_ray\": " << (traced ? static_cast<double>(nodes) / traced : 0.0) << ",\n";
+
+		auto object = [&](const char* name, const uint64_t* values, const char* const* names, int count, bool last) {
+			out << "  \"" << name << "\": {";
+			for (int i = 0; i < count; i++)
+				out << (i ? ", " : "") << '"' << names[i] << "\": " << values[i];
+			out << (last ? "}\n" : "},\n");
+		};
+		object("primitive_tests", tests, primitiveNames, primitive_count, false);
+		object("material_scatters", scatters, materialNames, material_count, false);
+		object("texture_lookups", lookups, textureNames, texture_count, false);
+		object("path_ends", ends, endNames, end_count, true);
+		out << "}\n";
+		return static_cast<bool>(out);
+	}
+
+private:
+	struct registry
+	{
+		std::mutex mutex;
+		std::vector<std::unique_ptr<render_stats>> counters;
+	};
+
+	static registry& get_registry()
+	{
+		static registry all;
+		return all;
+	}
+};
+
+#endif
@@ -2,14 +2,61 @@
 
 #include "math.h"
 #include "noise.h"
+#include "stats.h"
+#include "texture_cache.h"
 
-#include "stb_image.h"
-#include <iostream>
+#include <cmath>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+// Index of a texture in a texture_table
+using texture_id = uint32_t;
+
+class texture_table;
 
 class texture
 {
 public:
 	virtual color value(float u, float v, const point3& p) const = 0;
+
+	// Same as value, averaged over a footprint about this wide in texture
+	// coords. Textures that do not filter ignore it.
+	virtual color value(float u, float v, const point3& p, float footprint) const { return value(u, v, p); }
+
+protected:
+	// The table the texture was added to, for textures built from others
+	const texture_table* m_Table = nullptr;
+
+	friend class texture_table;
+};
+
+// Owns the textures of a scene. Textures and materials refer to each other by
+// id and look them up here, so shading only follows plain pointers. Entries
+// keep a pointer back to the table, which therefore cannot be copied or moved.
+// Image textures share the table's tile cache.
+class texture_table
+{
+public:
+	texture_table() {}
+	texture_table(const texture_table&) = delete;
+	texture_table& operator=(const texture_table&) = delete;
+
+	texture_id add(std::shared_ptr<texture> t)
+	{
+		t->m_Table = this;
+		m_Textures.push_back(t);
+		return static_cast<texture_id>(m_Textures.size() - 1);
+	}
+
+	const texture& operator[](texture_id id) const { return *m_Textures[id]; }
+	size_t size() const { return m_Textures.size(); }
+
+	texture_cache& GetCache() const { return m_Cache; }
+
+private:
+	std::vector<std::shared_ptr<texture>> m_Textures;
+	mutable texture_cache m_Cache;
 };
 
 class solid_color : public texture
@@ -23,6 +70,7 @@ public:
 
 	virtual color value(float u, float v, const point3& p) const override
 	{
+		RT_STAT(render_stats::local().lookups[render_stats::tex_solid]++);
 		return m_Color;
 	}
 
@@ -33,21 +81,22 @@ private:
 class checker_texture : public texture
 {
 public:
-	checker_texture() {}
-	checker_texture(std::shared_ptr<texture> t0, std::shared_ptr<texture> t1)
+	// Both textures must be in the table the checker is added to
+	checker_texture(texture_id t0, texture_id t1)
 		: m_Even(t0), m_Odd(t1) {}
 
 	virtual color value(float u, float v, const point3& p) const override
 	{
+		RT_STAT(render_stats::local().lookups[render_stats::tex_checker]++);
 		auto sines = sin(10 * p.x()) * sin(10 * p.y()) * sin(10 * p.z());
 		if (sines < 0)
-			return m_Odd->value(u, v, p);
+			return (*m_Table)[m_Odd].value(u, v, p);
 		else
-			return m_Even->value(u, v, p);
+			return (*m_Table)[m_Even].value(u, v, p);
 	}
 
 private:
-	std::shared_ptr<texture> m_Even, m_Odd;
+	texture_id m_Even, m_Odd;
 };
 
 class noise_texture : public texture
@@ -58,6 +107,7 @@ public:
 
 	virtual color value(float u, float v, const point3& p) const override
 	{
+		RT_STAT(render_stats::local().lookups[render_stats::tex_noise]++);
 		return color(1, 1, 1) * 0.5 * (1.0 + sin(m_Scale * p.z() + 10 * m_Noise.turbulence(m_Scale * p))); // Prevent negative numbers from noise
 		//return color(1, 1, 1) * 0.5 * (1.0 + m_Noise.noise(m_Scale * p)); // Prevent negative numbers from noise
 	}
@@ -67,60 +117,82 @@ private:
 	float m_Scale;
 };
 
+// A texture read from an image file. Lookups are filtered bilinearly within
+// the mip level whose texels best match the footprint and blended between the
+// two nearest levels. Texels are read through the table's tile cache, so only
+// the tiles in use are held as floats however large the image is.
 class image_texture : public texture
 {
 public:
-	const static int s_BytesPerPixel = 3;
-
-	image_texture() 
-		: m_Data(nullptr), m_Width(0), m_Height(0), m_BytesPerLine(0) {}
+	image_texture() {}
+	image_texture(const char* filename) : m_Image(filename) {}
 
-	image_texture(const char* filename)
+	virtual color value(float u, float v, const point3& p) const override
 	{
-		auto components_per_pixel = s_BytesPerPixel;
-
-		m_Data = stbi_load(filename, &m_Width, &m_Height, &components_per_pixel, components_per_pixel);
-
-		if (!m_Data)
-		{
-			std::cerr << "ERROR: Could not load texture image file '" << filename << "'.\n";
-			m_Width = m_Height = 0;
-		}
-		
-		m_BytesPerLine = s_BytesPerPixel * m_Width;
+		return value(u, v, p, 0.0f);
 	}
 
-	~image_texture()
+	virtual color value(float u, float v, const point3& p, float footprint) const override
 	{
-		delete m_Data;
-	}
+		RT_STAT(render_stats::local().lookups[render_stats::tex_image]++);
 
-	virtual color value(float u, float v, const point3& p) const override
-	{
 		// If we have no texture data, then return solid cyan as a debugging aid.
-		if (m_Data == nullptr)
+		if (m_Image.empty())
 			return color(0, 1, 1);
-		
+
 		// Clamp input texture coordinates to [0,1] x [1,0]
 		u = clamp(u, 0.0, 1.0);
 		v = 1.0 - clamp(v, 0.0, 1.0);  // Flip V to image coordinates
 
-		auto i = static_cast<int>(u * m_Width);
-		auto j = static_cast<int>(v * m_Height);
+		const tiled_image::level& finest = m_Image.GetLevel(0);
+		float texels = footprint * std::max(finest.width, finest.height);
+		float lod = texels > 1.0f ? std::min(std::log2(texels), static_cast<float>(m_Image.level_count() - 1)) : 0.0f;
+		int level = static_cast<int>(lod);
+		float blend = lod - level;
+
+		tile_ref ref;
+		color result = bilinear(level, u, v, ref);
+		if (blend > 0.0f)
+			result = (1.0f - blend) * result + blend * bilinear(level + 1, u, v, ref);
+		return result;
+	}
 
-		// Clamp integer mapping, since actual coordinates should be less than 1.0
-		if (i >= m_Width)  i = m_Width - 1;
-		if (j >= m_Height) j = m_Height - 1;
+private:
+	// The tile the last texel came from, kept while neighbouring texels are read
+	struct tile_ref
+	{
+		uint32_t index = UINT32_MAX;
+		std::shared_ptr<const texture_cache::tile> data;
+	};
 
-		const auto color_scale = 1.0 / 255.0;
-		auto pixel = m_Data + j * m_BytesPerLine + i * s_BytesPerPixel;
+	color bilinear(int level, float u, float v, tile_ref& ref) const
+	{
+		const tiled_image::level& l = m_Image.GetLevel(level);
+		float x = u * l.width - 0.5f;
+		float y = v * l.height - 0.5f;
+		float fx = floor(x), fy = floor(y);
+		float tx = x - fx, ty = y - fy;
+		int x0 = static_cast<int>(fx), y0 = static_cast<int>(fy);
+
+		return (1.0f - ty) * ((1.0f - tx) * texel(l, x0, y0, ref) + tx * texel(l, x0 + 1, y0, ref))
+			+ ty * ((1.0f - tx) * texel(l, x0, y0 + 1, ref) + tx * texel(l, x0 + 1, y0 + 1, ref));
+	}
 
-		std::cerr << m_Data << " " << j << " " << "\n";
-		return color(color_scale * pixel[0], color_scale * pixel[1], color_scale * pixel[2]);
+	// Texel (x, y) of level l, clamped to the edge of the image
+	color texel(const tiled_image::level& l, int x, int y, tile_ref& ref) const
+	{
+		x = std::min(std::max(x, 0), l.width - 1);
+		y = std::min(std::max(y, 0), l.height - 1);
+
+		uint32_t index = l.firstTile + (y / tiled_image::s_TileSize) * l.tilesX + x / tiled_image::s_TileSize;
+		if (index != ref.index)
+		{
+			ref.data = m_Table->GetCache().get(m_Image, index);
+			ref.index = index;
+		}
+
+		return ref.data->texels[morton_index(x % tiled_image::s_TileSize, y % tiled_image::s_TileSize)];
 	}
 
-private:
-	unsigned char* m_Data;
-	int m_Width, m_Height;
-	int m_BytesPerLine;
-};
\ No newline at end of file
+	tiled_image m_Image;
+};
@@ -0,0 +1,108 @@
+#pragma once
+
+#ifndef TEXTURE_CACHE_H
+#define TEXTURE_CACHE_H
+
+#include "tiled_image.h"
+#include "vec3.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+
+// Tiles of tiled_images converted to float colors, shared by every render
+// thread. It holds at most about budget bytes; when full, the least recently
+// used tile goes. Misses are converted from the image's mapped tile file, so
+// together with the pages the OS keeps of that, memory stays bounded however
+// many and large the images are. Tiles are handed out by shared_ptr, so one
+// that is evicted while a thread still reads it stays alive until that thread
+// lets go. The cache is split into shards with a lock each, picked by tile,
+// so threads working on different parts of an image rarely wait on each other.
+class texture_cache
+{
+public:
+	static const size_t s_DefaultBudget = size_t(64) << 20;
+	static const int s_ShardCount = 16;
+
+	struct tile
+	{
+		color texels[tiled_image::s_TileTexels]; // Morton order
+	};
+
+	explicit texture_cache(size_t budget = s_DefaultBudget)
+	{
+		set_budget(budget);
+	}
+
+	texture_cache(const texture_cache&) = delete;
+	texture_cache& operator=(const texture_cache&) = delete;
+
+	// Not safe while other threads use the cache
+	void set_budget(size_t budget)
+	{
+		m_TilesPerShard = std::max<size_t>(1, budget / sizeof(tile) / s_ShardCount);
+	}
+
+	std::shared_ptr<const tile> get(const tiled_image& image, uint32_t index)
+	{
+		uint64_t key = (static_cast<uint64_t>(image.id()) << 32) | index;
+		shard& s = m_Shards[(index ^ image.id() * 0x9e3779b9u) % s_ShardCount];
+
+		{
+			std::lock_guard<std::mutex> lock(s.mutex);
+			auto found = s.index.find(key);
+			if (found != s.index.end())
+			{
+				s.order.splice(s.order.begin(), s.order, found->second);
+				return found->second->data;
+			}
+		}
+
+		// Converted outside the lock. Two threads missing the same tile both
+		// convert it, and the second keeps the first one's copy.
+		auto converted = std::make_shared<tile>();
+		const uint8_t* texels = image.tile_texels(index);
+		const float scale = 1.0f / 255.0f;
+		for (int i = 0; i < tiled_image::s_TileTexels; i++, texels += tiled_image::s_BytesPerPixel)
+			converted->texels[i] = color(scale * texels[0], scale * texels[1], scale * texels[2]);
+
+		std::lock_guard<std::mutex> lock(s.mutex);
+		auto found = s.index.find(key);
+		if (found != s.index.end())
+		{
+			s.order.splice(s.order.begin(), s.order, found->second);
+			return found->second->data;
+		}
+
+		s.order.push_front({ key, converted });
+		s.index.emplace(key, s.order.begin());
+		while (s.order.size() > m_TilesPerShard)
+		{
+			s.index.erase(s.order.back().key);
+			s.order.pop_back();
+		}
+		return converted;
+	}
+
+private:
+	struct entry
+	{
+		uint64_t key;
+		std::shared_ptr<const tile> data;
+	};
+
+	struct shard
+	{
+		std::mutex mutex;
+		std::list<entry> order; // Most recently used first
+		std::unordered_map<uint64_t, std::list<entry>::iterator> index;
+	};
+
+	shard m_Shards[s_ShardCount];
+	size_t m_TilesPerShard;
+};
+
+#endif
@@ -0,0 +1,332 @@
+#pragma once
+
+#ifndef TILED_IMAGE_H
+#define TILED_IMAGE_H
+
+#include "mapped_file.h"
+
+#include "stb_image.h"
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <string>
+#include <vector>
+
+// Interleaves the bits of x and y, both below 2^8
+inline uint32_t morton_index(uint32_t x, uint32_t y)
+{
+	auto spread = [](uint32_t a) {
+		a = (a | (a << 4)) & 0x0f0f;
+		a = (a | (a << 2)) & 0x3333;
+		a = (a | (a << 1)) & 0x5555;
+		return a;
+	};
+	return spread(x) | (spread(y) << 1);
+}
+
+// An 8 bit RGB image with its full mip chain. Every level is cut into square
+// tiles of s_TileSize, numbered consecutively with coarser levels after finer
+// ones, and the texels of a tile are stored in Morton (Z) order, so the 2x2
+// neighbourhood of a filtered lookup sits in one or two cache lines whichever
+// way the image is walked.
+//
+// The tiles are kept in a file in the cache directory, written the first
+// time the image is loaded and mapped from then on, so only the pages of
+// tiles in use are resident and the OS drops them again under memory
+// pressure. A JPEG or PNG still has to be decoded in full once to write the
+// file. An image whose tiles cannot be written is reported and left empty.
+class tiled_image
+{
+public:
+	static const int s_BytesPerPixel = 3;
+	static const int s_TileSize = 32;
+	static const int s_TileTexels = s_TileSize * s_TileSize;
+	static const int s_TileBytes = s_TileTexels * s_BytesPerPixel;
+
+	struct level
+	{
+		int32_t width, height;
+		int32_t tilesX, tilesY;
+		uint32_t firstTile;
+	};
+
+	tiled_image() {}
+
+	// Maps the tile file of filename, writing it first if it is missing or
+	// older than the image. An image that cannot be read is reported and
+	// left empty.
+	explicit tiled_image(const char* filename)
+	{
+		std::string tilesPath = tiles_path(filename);
+		std::error_code error;
+		uint64_t sourceSize = std::filesystem::file_size(filename, error);
+		if (!error && is_current(filename, tilesPath) && attach(tilesPath, sourceSize))
+			return;
+
+		mapped_file file(filename);
+		int width = 0, height = 0, components = 0;
+		unsigned char* pixels = file.valid()
+			? stbi_load_from_memory(file.data(), static_cast<int>(file.size()), &width, &height, &components, s_BytesPerPixel)
+			: nullptr;
+
+		if (!pixels)
+		{
+			std::cerr << "ERROR: Could not load texture image file '" << filename << "'.\n";
+			return;
+		}
+
+		std::vector<level> levels = level_chain(width, height);
+		if (!write(tilesPath, pixels, levels, file.size()) || !attach(tilesPath, file.size()))
+			std::cerr << "ERROR: Could not write '" << tilesPath << "' for texture image file '" << filename << "'.\n";
+		stbi_image_free(pixels);
+	}
+
+	tiled_image(const tiled_image&) = delete;
+	tiled_image& operator=(const tiled_image&) = delete;
+
+	bool empty() const { return m_Levels.empty(); }
+	int level_count() const { return static_cast<int>(m_Levels.size()); }
+	const level& GetLevel(int l) const { return m_Levels[l]; }
+
+	// Tells the tiles of different images apart in a shared cache
+	uint32_t id() const { return m_Id; }
+
+	const uint8_t* tile_texels(uint32_t tile) const { return m_Texels + static_cast<size_t>(tile) * s_TileBytes; }
+
+	// Where tile files are written, a directory of their own below the
+	// system's temporary directory unless set. Not safe while images load.
+	static const std::string& GetCacheDirectory() { return cache_directory(); }
+	static void SetCacheDirectory(const std::string& directory) { cache_directory() = directory; }
+
+private:
+	static constexpr char s_Magic[8] = { 'R', 'T', 'T', 'I', 'L', 'E', 'S', '\0' };
+	static const uint32_t s_Version = 1;
+	static const uint32_t s_ByteOrder = 0x01020304;
+	static const size_t s_DataOffset = 4096; // Tiles start on a page of their own
+
+	struct header
+	{
+		char magic[8];
+		uint32_t version;
+		uint32_t byteOrder;
+		uint32_t tileSize;
+		uint32_t levelCount;
+		uint64_t sourceSize; // Bytes of the image the tiles were built from
+	};
+
+	// Writes the tiles of each level in order, as rows of tiles
+	using sink = std::function<bool(const uint8_t*, size_t)>;
+
+	// Sizes and tile numbering of every level down to 1x1
+	static std::vector<level> level_chain(int width, int height)
+	{
+		std::vector<level> levels;
+		uint32_t tiles = 0;
+		while (true)
+		{
+			level l = { width, height, (width + s_TileSize - 1) / s_TileSize, (height + s_TileSize - 1) / s_TileSize, tiles };
+			levels.push_back(l);
+			tiles += l.tilesX * l.tilesY;
+			if (width == 1 && height == 1)
+				return levels;
+
+			width = std::max(1, width / 2);
+			height = std::max(1, height / 2);
+		}
+	}
+
+	static std::string& cache_directory()
+	{
+		static std::string directory = [] {
+			std::error_code error;
+			std::filesystem::path temporary = std::filesystem::temp_directory_path(error);
+			return ((error ? std::filesystem::path(".") : temporary) / "RayTracer-tiles").string();
+		}();
+		return directory;
+	}
+
+	// Images of the same name in different places get different files
+	static std::string tiles_path(const char* filename)
+	{
+		std::error_code error;
+		std::filesystem::path source = std::filesystem::weakly_canonical(filename, error);
+		if (error)
+			source = filename;
+
+		char hash[17];
+		std::snprintf(hash, sizeof(hash), "%016llx", static_cast<unsigned long long>(std::hash<std::string>()(source.string())));
+		std::string name = source.filename().string() + "-" + hash + ".tiles";
+		return (std::filesystem::path(cache_directory()) / name).string();
+	}
+
+	static bool is_current(const char* filename, const std::string& tilesPath)
+	{
+		std::error_code error;
+		auto image = std::filesystem::last_write_time(filename, error);
+		if (error)
+			return false;
+		auto tiles = std::filesystem::last_write_time(tilesPath, error);
+		return !error && tiles >= image;
+	}
+
+	bool attach(const std::string& tilesPath, uint64_t sourceSize)
+	{
+		mapped_file file(tilesPath.c_str());
+		if (file.size() < s_DataOffset)
+			return false;
+
+		const header* h = reinterpret_cast<const header*>(file.data());
+		if (std::memcmp(h->magic, s_Magic, sizeof(s_Magic)) != 0 || h->version != s_Version || h->byteOrder != s_ByteOrder
+			|| h->sourceSize != sourceSize || h->tileSize != s_TileSize || h->levelCount == 0 || sizeof(header) + h->levelCount * sizeof(level) > s_DataOffset)
+			return false;
+
+		const level* levels = reinterpret_cast<const level*>(file.data() + sizeof(header));
+		const level& last = levels[h->levelCount - 1];
+		uint64_t tiles = static_cast<uint64_t>(last.firstTile) + static_cast<uint64_t>(last.tilesX) * last.tilesY;
+		if (file.size() - s_DataOffset < tiles * s_TileBytes)
+			return false;
+
+		m_Levels.assign(levels, levels + h->levelCount);
+		m_File = std::move(file);
+		m_Texels = m_File.data() + s_DataOffset;
+		return true;
+	}
+
+	// Unique among the processes and threads writing the same tile file
+	static std::string temporary_path(const std::string& tilesPath)
+	{
+		static std::atomic<uint32_t> counter(0);
+#if defined(_WIN32)
+		unsigned long process = GetCurrentProcessId();
+#else
+		long process = static_cast<long>(getpid());
+#endif
+		return tilesPath + "." + std::to_string(process) + "." + std::to_string(counter++) + ".tmp";
+	}
+
+	// Writes to a temporary name and renames it, so a file that is being
+	// written is never mapped
+	static bool write(const std::string& tilesPath, const uint8_t* pixels, const std::vector<level>& levels, uint64_t sourceSize)
+	{
+		if (sizeof(header) + levels.size() * sizeof(level) > s_DataOffset)
+			return false;
+
+		std::error_code error;
+		std::filesystem::create_directories(std::filesystem::path(tilesPath).parent_path(), error);
+
+		std::string temporary = temporary_path(tilesPath);
+		{
+			std::ofstream out(temporary, std::ios::binary | std::ios::trunc);
+			if (!out)
+				return false;
+
+			std::vector<uint8_t> head(s_DataOffset, 0);
+			header h;
+			std::memcpy(h.magic, s_Magic, sizeof(s_Magic));
+			h.version = s_Version;
+			h.byteOrder = s_ByteOrder;
+			h.tileSize = s_TileSize;
+			h.levelCount = static_cast<uint32_t>(levels.size());
+			h.sourceSize = sourceSize;
+			std::memcpy(head.data(), &h, sizeof(h));
+			std::memcpy(head.data() + sizeof(h), levels.data(), levels.size() * sizeof(level));
+
+			bool ok = out.write(reinterpret_cast<const char*>(head.data()), head.size())
+				&& build(pixels, levels, [&](const uint8_t* bytes, size_t size) {
+					return static_cast<bool>(out.write(reinterpret_cast<const char*>(bytes), size));
+				});
+			if (!ok || !out.flush())
+			{
+				out.close();
+				std::remove(temporary.c_str());
+				return false;
+			}
+		}
+
+		// Replaces the file of another process that got there first. Windows
+		// does not rename over an existing file, so it is removed first there.
+		if (std::rename(temporary.c_str(), tilesPath.c_str()) != 0)
+		{
+			std::remove(tilesPath.c_str());
+			if (std::rename(temporary.c_str(), tilesPath.c_str()) != 0)
+			{
+				std::remove(temporary.c_str());
+				return false;
+			}
+		}
+		return true;
+	}
+
+	// Tiles every level of the chain, box filtering each from the one before,
+	// and hands them to out one row of tiles at a time
+	static bool build(const uint8_t* pixels, const std::vector<level>& levels, const sink& out)
+	{
+		int width = levels[0].width, height = levels[0].height;
+		std::vector<uint8_t> current(pixels, pixels + static_cast<size_t>(width) * height * s_BytesPerPixel);
+		std::vector<uint8_t> row;
+
+		for (size_t i = 0; i < levels.size(); i++)
+		{
+			const level& l = levels[i];
+			row.resize(static_cast<size_t>(l.tilesX) * s_TileBytes);
+			for (int tileY = 0; tileY < l.tilesY; tileY++)
+			{
+				// Texels past the edge of the image stay black
+				std::fill(row.begin(), row.end(), uint8_t(0));
+				for (int y = tileY * s_TileSize; y < std::min(height, (tileY + 1) * s_TileSize); y++)
+					for (int x = 0; x < width; x++)
+					{
+						uint8_t* texel = &row[(static_cast<size_t>(x / s_TileSize) * s_TileTexels + morton_index(x % s_TileSize, y % s_TileSize)) * s_BytesPerPixel];
+						const uint8_t* pixel = &current[(static_cast<size_t>(y) * width + x) * s_BytesPerPixel];
+						std::copy(pixel, pixel + s_BytesPerPixel, texel);
+					}
+
+				if (!out(row.data(), row.size()))
+					return false;
+			}
+
+			if (i + 1 == levels.size())
+				break;
+
+			// Odd sizes repeat their last row or column
+			int nextWidth = levels[i + 1].width, nextHeight = levels[i + 1].height;
+			std::vector<uint8_t> next(static_cast<size_t>(nextWidth) * nextHeight * s_BytesPerPixel);
+			for (int y = 0; y < nextHeight; y++)
+				for (int x = 0; x < nextWidth; x++)
+				{
+					int x0 = 2 * x, x1 = std::min(2 * x + 1, width - 1);
+					int y0 = 2 * y, y1 = std::min(2 * y + 1, height - 1);
+					for (int c = 0; c < s_BytesPerPixel; c++)
+					{
+						int sum = current[(static_cast<size_t>(y0) * width + x0) * s_BytesPerPixel + c] + current[(static_cast<size_t>(y0) * width + x1) * s_BytesPerPixel + c]
+							+ current[(static_cast<size_t>(y1) * width + x0) * s_BytesPerPixel + c] + current[(static_cast<size_t>(y1) * width + x1) * s_BytesPerPixel + c];
+						next[(static_cast<size_t>(y) * nextWidth + x) * s_BytesPerPixel + c] = static_cast<uint8_t>((sum + 2) / 4);
+					}
+				}
+
+			current.swap(next);
+			width = nextWidth;
+			height = nextHeight;
+		}
+		return true;
+	}
+
+	static uint32_t next_id()
+	{
+		static std::atomic<uint32_t> counter(0);
+		return counter++;
+	}
+
+	uint32_t m_Id = next_id();
+	std::vector<level> m_Levels;
+	const uint8_t* m_Texels = nullptr;
+	mapped_file m_File;
+};
+
+#endif
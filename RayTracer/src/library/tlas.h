@@ -0,0 +1,176 @@
+#pragma once
+
+#ifndef TLAS_H
+#define TLAS_H
+
+#include "bvh.h"
+#include "transform.h"
+
+#include <cstdint>
+#include <unordered_map>
+#include <vector>
+
+// Two level acceleration structure. Bottom level structures (BLAS), such as
+// a bvh_node or sphere_set, are built once and shared read-only. This top
+// level (TLAS) keeps a flat array of instances referring to them by index,
+// each with a transform and an optional material override, and a small
+// bvh_tree over the instance bounds. An instance costs about 120 bytes
+// whatever the size of its geometry, and moving instances only rebuilds the
+// top level tree.
+class tlas : public hittable
+{
+public:
+	static const int s_MaxLeafSize = 2;
+
+	tlas() {}
+
+	// Adds an instance of blas and returns its index. Passing no_material keeps
+	// the materials of the geometry. build() needs to be called before tracing.
+	size_t add(std::shared_ptr<hittable> blas, const affine_transform& objectToWorld,
+		material_id override = no_material)
+	{
+		instance_record record;
+		record.objectToWorld = objectToWorld;
+		record.worldToObject = objectToWorld.inverse();
+		record.blas = intern(blas);
+		record.material = override;
+		m_Instances.push_back(record);
+		return m_Instances.size() - 1;
+	}
+
+	void set_transform(size_t index, const affine_transform& objectToWorld)
+	{
+		m_Instances[index].objectToWorld = objectToWorld;
+		m_Instances[index].worldToObject = objectToWorld.inverse();
+	}
+
+	const affine_transform& GetTransform(size_t index) const { return m_Instances[index].objectToWorld; }
+	size_t size() const { return m_Instances.size(); }
+
+	// Builds the top level tree over the current instance transforms. Bottom
+	// level structures are only asked for their bounds, once each.
+	void build(float time0 = 0.0f, float time1 = 1.0f)
+	{
+		m_BlasBounds.resize(m_Blas.size());
+		m_BlasHasBounds.resize(m_Blas.size());
+		for (size_t b = 0; b < m_Blas.size(); b++)
+			m_BlasHasBounds[b] = m_Blas[b]->bounding_box(time0, time1, m_BlasBounds[b]);
+
+		std::vector<bvh_primitive_info> info;
+		info.reserve(m_Instances.size());
+		for (size_t i = 0; i < m_Instances.size(); i++)
+		{
+			const instance_record& record = m_Instances[i];
+			if (!m_BlasHasBounds[record.blas])
+			{
+				std::cerr << "No bounding box in tlas::build.\n";
+				continue;
+			}
+
+			aabb box = record.objectToWorld.apply_box(m_BlasBounds[record.blas]);
+			info.push_back({ i, box, 0.5f * (box.GetMin() + box.GetMax()) });
+		}
+
+		m_Tree.build(info, s_MaxLeafSize);
+
+		// Leaves index into info, which the build left in leaf order
+		m_Order.resize(info.size());
+		for (size_t i = 0; i < info.size(); i++)
+			m_Order[i] = static_cast<uint32_t>(info[i].index);
+	}
+
+	virtual bool hit(const ray& r, float t_min, float t_max, hit_record& rec) const override
+	{
+		// The record is left in the local space of whichever instance hit last,
+		// which is the closest one, and only moved to world space at the end.
+		const instance_record* closest = nullptr;
+
+		m_Tree.traverse(r, t_min, t_max, [&](int first, int count, float& t) {
+			bool hit_anything = false;
+			for (int i = first; i < first + count; i++)
+			{
+				const instance_record& record = m_Instances[m_Order[i]];
+				RT_STAT(render_stats::local().tests[render_stats::prim_instance]++);
+				ray local(record.worldToObject.apply_point(r.GetOrigin()), record.worldToObject.apply_vector(r.GetDirection()),
+					r.GetTime(), r.GetSeed());
+
+				if (m_Blas[record.blas]->hit(local, t_min, t, rec))
+				{
+					hit_anything = true;
+					closest = &record;
+					t = rec.t;
+				}
+			}
+			return hit_anything;
+		});
+
+		if (!closest)
+			return false;
+
+		// Same mapping as instance, the normal keeps facing the ray
+		rec.p = closest->objectToWorld.apply_point(rec.p);
+		rec.normal = unit_vector(closest->worldToObject.apply_transposed(rec.normal));
+		if (closest->material != no_material)
+			rec.matId = closest->material;
+
+		return true;
+	}
+
+	virtual void crossings(const ray& r, float t_min, float t_max, crossing_list& out) const override
+	{
+		m_Tree.traverse(r, t_min, t_max, [&](int first, int count, float&) {
+			for (int i = first; i < first + count; i++)
+			{
+				const instance_record& record = m_Instances[m_Order[i]];
+				RT_STAT(render_stats::local().tests[render_stats::prim_instance]++);
+				ray local(record.worldToObject.apply_point(r.GetOrigin()), record.worldToObject.apply_vector(r.GetDirection()),
+					r.GetTime(), r.GetSeed());
+				m_Blas[record.blas]->crossings(local, t_min, t_max, out);
+			}
+			return false;
+		});
+	}
+
+	virtual bool bounding_box(float t0, float t1, aabb& output_box) const override
+	{
+		if (m_Tree.empty())
+			return false;
+
+		output_box = m_Tree.bounds();
+		return true;
+	}
+
+private:
+	struct instance_record
+	{
+		affine_transform objectToWorld;
+		affine_transform worldToObject;
+		uint32_t blas;
+		material_id material; // no_material keeps the geometry's materials
+	};
+
+	// Index of blas in m_Blas, appending it the first time it is seen
+	uint32_t intern(const std::shared_ptr<hittable>& blas)
+	{
+		auto found = m_BlasIndex.find(blas.get());
+		if (found != m_BlasIndex.end())
+			return found->second;
+
+		uint32_t id = static_cast<uint32_t>(m_Blas.size());
+		m_Blas.push_back(blas);
+		m_BlasIndex.emplace(blas.get(), id);
+		return id;
+	}
+
+	std::vector<instance_record> m_Instances;
+	std::vector<uint32_t> m_Order; // Instance of every tree primitive
+
+	std::vector<std::shared_ptr<hittable>> m_Blas;
+	std::unordered_map<const hittable*, uint32_t> m_BlasIndex;
+	std::vector<aabb> m_BlasBounds;
+	std::vector<bool> m_BlasHasBounds;
+
+	bvh_tree m_Tree;
+};
+
+#endif
@@ -0,0 +1,135 @@
+#pragma once
+
+#ifndef TRANSFORM_H
+#define TRANSFORM_H
+
+#include "math.h"
+#include "vec3.h"
+#include "aabb.h"
+
+// Affine map stored as the top three rows of a 4x4 matrix, the last row is
+// always (0, 0, 0, 1). Points pick up the translation column, vectors do not.
+class affine_transform
+{
+public:
+	affine_transform()
+		: m{ { 1, 0, 0, 0 }, { 0, 1, 0, 0 }, { 0, 0, 1, 0 } } {}
+
+	static affine_transform translation(const vec3& offset)
+	{
+		affine_transform t;
+		for (int r = 0; r < 3; r++)
+			t.m[r][3] = offset[r];
+		return t;
+	}
+
+	static affine_transform rotation_y(float angle)
+	{
+		float radians = degrees_to_radians(angle);
+		float sinTheta = sin(radians);
+		float cosTheta = cos(radians);
+
+		affine_transform t;
+		t.m[0][0] = cosTheta;
+		t.m[0][2] = sinTheta;
+		t.m[2][0] = -sinTheta;
+		t.m[2][2] = cosTheta;
+		return t;
+	}
+
+	static affine_transform scaling(const vec3& factors)
+	{
+		affine_transform t;
+		for (int r = 0; r < 3; r++)
+			t.m[r][r] = factors[r];
+		return t;
+	}
+
+	// The transform applying b first, then this one
+	affine_transform operator*(const affine_transform& b) const
+	{
+		affine_transform t;
+		for (int r = 0; r < 3; r++)
+		{
+			for (int c = 0; c < 4; c++)
+			{
+				float sum = c == 3 ? m[r][3] : 0.0f;
+				for (int k = 0; k < 3; k++)
+					sum += m[r][k] * b.m[k][c];
+				t.m[r][c] = sum;
+			}
+		}
+		return t;
+	}
+
+	point3 apply_point(const point3& p) const
+	{
+		return point3(
+			m[0][0] * p.x() + m[0][1] * p.y() + m[0][2] * p.z() + m[0][3],
+			m[1][0] * p.x() + m[1][1] * p.y() + m[1][2] * p.z() + m[1][3],
+			m[2][0] * p.x() + m[2][1] * p.y() + m[2][2] * p.z() + m[2][3]);
+	}
+
+	vec3 apply_vector(const vec3& v) const
+	{
+		return vec3(
+			m[0][0] * v.x() + m[0][1] * v.y() + m[0][2] * v.z(),
+			m[1][0] * v.x() + m[1][1] * v.y() + m[1][2] * v.z(),
+			m[2][0] * v.x() + m[2][1] * v.y() + m[2][2] * v.z());
+	}
+
+	// Multiplies by the transpose of the linear part. Called on the inverse
+	// transform this maps normals, which stay perpendicular to the surface.
+	vec3 apply_transposed(const vec3& n) const
+	{
+		return vec3(
+			m[0][0] * n.x() + m[1][0] * n.y() + m[2][0] * n.z(),
+			m[0][1] * n.x() + m[1][1] * n.y() + m[2][1] * n.z(),
+			m[0][2] * n.x() + m[1][2] * n.y() + m[2][2] * n.z());
+	}
+
+	// Inverse through the adjugate of the linear part. The transform must not
+	// be singular.
+	affine_transform inverse() const
+	{
+		float det = m[0][0] * (m[1][1] * m[2][2] - m[1][2] * m[2][1])
+			- m[0][1] * (m[1][0] * m[2][2] - m[1][2] * m[2][0])
+			+ m[0][2] * (m[1][0] * m[2][1] - m[1][1] * m[2][0]);
+		float invDet = 1.0f / det;
+
+		affine_transform t;
+		t.m[0][0] = (m[1][1] * m[2][2] - m[1][2] * m[2][1]) * invDet;
+		t.m[0][1] = (m[0][2] * m[2][1] - m[0][1] * m[2][2]) * invDet;
+		t.m[0][2] = (m[0][1] * m[1][2] - m[0][2] * m[1][1]) * invDet;
+		t.m[1][0] = (m[1][2] * m[2][0] - m[1][0] * m[2][2]) * invDet;
+		t.m[1][1] = (m[0][0] * m[2][2] - m[0][2] * m[2][0]) * invDet;
+		t.m[1][2] = (m[0][2] * m[1][0] - m[0][0] * m[1][2]) * invDet;
+		t.m[2][0] = (m[1][0] * m[2][1] - m[1][1] * m[2][0]) * invDet;
+		t.m[2][1] = (m[0][1] * m[2][0] - m[0][0] * m[2][1]) * invDet;
+		t.m[2][2] = (m[0][0] * m[1][1] - m[0][1] * m[1][0]) * invDet;
+
+		// The translation of the inverse undoes the original one
+		vec3 offset = t.apply_vector(vec3(m[0][3], m[1][3], m[2][3]));
+		for (int r = 0; r < 3; r++)
+			t.m[r][3] = -offset[r];
+		return t;
+	}
+
+	// Exact bounds of the transformed box, from all eight of its corners
+	aabb apply_box(const aabb& box) const
+	{
+		aabb result = aabb::empty();
+		for (int corner = 0; corner < 8; corner++)
+		{
+			point3 p((corner & 1) ? box.GetMax().x() : box.GetMin().x(),
+				(corner & 2) ? box.GetMax().y() : box.GetMin().y(),
+				(corner & 4) ? box.GetMax().z() : box.GetMin().z());
+			result.expand(apply_point(p));
+		}
+		return result;
+	}
+
+	float m[3][4];
+};
+
+#endif
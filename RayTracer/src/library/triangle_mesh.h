@@ -0,0 +1,657 @@
+#pragma once
+
+#ifndef TRIANGLE_MESH_H
+#define TRIANGLE_MESH_H
+
+#include "bvh.h"
+
+#include <cmath>
+#include <cstdint>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+// An indexed triangle mesh behind a single hittable, for scanned and modelled
+// assets. Vertices are shared between triangles through an index buffer, and
+// normals and texture coords, when the mesh has them, are kept per vertex
+// alongside. The only other memory is the BVH, whose leaves hold up to
+// s_LeafSize triangles: the index buffer is reordered into leaf order, so a
+// leaf is a contiguous run of triangles that is intersected in one SIMD pass.
+//
+// Rays are tested with the watertight algorithm of Woop, Benthin and Wald,
+// "Watertight Ray/Triangle Intersection" (JCGT 2013). It never lets a ray
+// slip through the shared edge of two triangles, which a closed mesh needs to
+// work as the boundary of a constant_medium.
+//
+// Triangles wind counter clockwise around their outward normal. The primId of
+// a hit is the triangle's position in leaf order.
+class triangle_mesh : public hittable
+{
+public:
+	static const int s_LeafSize = 8;
+
+	// Cost of a triangle relative to a BVH node for the builder. A full leaf is
+	// one SIMD pass, about as much work as the slab test of a node.
+	static constexpr float s_IntersectionCost = 1.0f / s_LeafSize;
+
+	triangle_mesh(material_id material) : m_Material(material) {}
+
+	// Adds a vertex and returns its index. Normals and texture coords are
+	// optional, but if a mesh has any it needs one for every vertex.
+	uint32_t add_vertex(const point3& p)
+	{
+		m_Positions.push_back(p);
+		return static_cast<uint32_t>(m_Positions.size() - 1);
+	}
+
+	void add_normal(const vec3& n) { m_Normals.push_back(n); }
+
+	void add_uv(float u, float v)
+	{
+		m_UVs.push_back(u);
+		m_UVs.push_back(v);
+	}
+
+	void add_triangle(uint32_t a, uint32_t b, uint32_t c)
+	{
+		m_Indices.push_back(a);
+		m_Indices.push_back(b);
+		m_Indices.push_back(c);
+	}
+
+	// Reads a Wavefront OBJ file: its vertices, texture coords, normals and
+	// faces, with polygons split into fans. Everything else is ignored, the
+	// whole mesh uses the material it was made with. Builds the mesh, which
+	// must be empty before. Returns false if the file cannot be read.
+	bool load_obj(const std::string& path)
+	{
+		std::ifstream in(path);
+		if (!in)
+		{
+			std::cerr << "ERROR: Could not open mesh file '" << path << "'.\n";
+			return false;
+		}
+
+		std::vector<point3> positions;
+		std::vector<vec3> normals;
+		std::vector<float> uvs;
+
+		// A corner that names a texture coord or normal besides its position is
+		// a vertex of its own, shared by every corner naming the same three.
+		struct corner
+		{
+			long p, t, n;
+			bool operator==(const corner& other) const { return p == other.p && t == other.t && n == other.n; }
+		};
+		struct corner_hash
+		{
+			size_t operator()(const corner& c) const
+			{
+				return std::hash<long>()(c.p) ^ (std::hash<long>()(c.t) * 31) ^ (std::hash<long>()(c.n) * 131);
+			}
+		};
+		std::unordered_map<corner, uint32_t, corner_hash> corners;
+		bool attributes = false, plain = false;
+
+		auto resolve = [](long index, size_t count) {
+			// Negative indices count back from the last element read
+			long resolved = index < 0 ? static_cast<long>(count) + index : index - 1;
+			return resolved >= 0 && resolved < static_cast<long>(count) ? resolved : -1L;
+		};
+
+		std::string line;
+		std::vector<uint32_t> face;
+		int lineNumber = 0;
+		while (std::getline(in, line))
+		{
+			lineNumber++;
+			const char* s = line.c_str();
+			while (*s == ' ' || *s == '\t')
+				s++;
+
+			char* end;
+			if (s[0] == 'v' && (s[1] == ' ' || s[1] == '\t'))
+			{
+				float x = std::strtof(s + 2, &end);
+				float y = std::strtof(end, &end);
+				float z = std::strtof(end, &end);
+				positions.push_back(point3(x, y, z));
+			}
+			else if (s[0] == 'v' && s[1] == 'n')
+			{
+				float x = std::strtof(s + 2, &end);
+				float y = std::strtof(end, &end);
+				float z = std::strtof(end, &end);
+				normals.push_back(vec3(x, y, z));
+			}
+			else if (s[0] == 'v' && s[1] == 't')
+			{
+				float u = std::strtof(s + 2, &end);
+				float v = std::strtof(end, &end);
+				uvs.push_back(u);
+				uvs.push_back(v);
+			}
+			else if (s[0] == 'f' && (s[1] == ' ' || s[1] == '\t'))
+			{
+				face.clear();
+				s += 2;
+				while (true)
+				{
+					long v = std::strtol(s, &end, 10);
+					if (end == s)
+						break;
+					s = end;
+
+					long vt = 0, vn = 0;
+					if (*s == '/')
+					{
+						vt = std::strtol(s + 1, &end, 10);
+						s = end;
+						if (*s == '/')
+						{
+							vn = std::strtol(s + 1, &end, 10);
+							s = end;
+						}
+					}
+
+					long p = resolve(v, positions.size());
+					long t = vt ? resolve(vt, uvs.size() / 2) : -1;
+					long n = vn ? resolve(vn, normals.size()) : -1;
+					if (p < 0 || (vt && t < 0) || (vn && n < 0))
+					{
+						std::cerr << "ERROR: " << path << ':' << lineNumber << ": face refers to a missing vertex.\n";
+						return false;
+					}
+
+					if (t < 0 && n < 0)
+					{
+						plain = true;
+						face.push_back(static_cast<uint32_t>(p));
+						continue;
+					}
+
+					// Positions keep their own index, the split vertices go after them
+					attributes = true;
+					auto found = corners.emplace(corner{ p, t, n }, 0);
+					if (found.second)
+					{
+						found.first->second = static_cast<uint32_t>(m_Positions.size());
+						m_Positions.push_back(positions[p]);
+						m_Normals.push_back(n >= 0 ? normals[n] : vec3(0.0f));
+						m_UVs.push_back(t >= 0 ? uvs[2 * t] : 0.0f);
+						m_UVs.push_back(t >= 0 ? uvs[2 * t + 1] : 0.0f);
+					}
+					face.push_back(found.first->second | 0x80000000u);
+				}
+
+				for (size_t k = 2; k < face.size(); k++)
+					add_triangle(face[0], face[k - 1], face[k]);
+			}
+		}
+
+		// Corners with attributes were numbered apart from plain positions, which
+		// come first once the file is read if there are any.
+		if (attributes && !plain)
+		{
+			for (uint32_t& index : m_Indices)
+				index &= 0x7fffffffu;
+			if (normals.empty())
+				m_Normals.clear();
+			if (uvs.empty())
+				m_UVs.clear();
+		}
+		else if (attributes)
+		{
+			uint32_t offset = static_cast<uint32_t>(positions.size());
+			for (uint32_t& index : m_Indices)
+				index = index & 0x80000000u ? (index & 0x7fffffffu) + offset : index;
+
+			std::vector<point3> split;
+			split.swap(m_Positions);
+			m_Positions = std::move(positions);
+			m_Positions.insert(m_Positions.end(), split.begin(), split.end());
+
+			// Plain positions have no normal or texture coord of their own
+			bool hasNormals = !normals.empty(), hasUVs = !uvs.empty();
+			m_Normals.insert(m_Normals.begin(), offset, vec3(0.0f));
+			m_UVs.insert(m_UVs.begin(), 2 * static_cast<size_t>(offset), 0.0f);
+			if (!hasNormals)
+				m_Normals.clear();
+			if (!hasUVs)
+				m_UVs.clear();
+		}
+		else
+		{
+			m_Positions = std::move(positions);
+		}
+
+		build();
+		return true;
+	}
+
+	// Builds the BVH and puts the triangles in its leaf order. Needs to be
+	// called after the last add and before the mesh is traced.
+	void build()
+	{
+		if (m_Normals.size() != m_Positions.size())
+			m_Normals.clear();
+		if (m_UVs.size() != 2 * m_Positions.size())
+			m_UVs.clear();
+
+		size_t count = m_Indices.size() / 3;
+		std::vector<bvh_primitive_info> info;
+		info.reserve(count);
+
+		for (size_t i = 0; i < count; i++)
+		{
+			const point3& a = m_Positions[m_Indices[3 * i]];
+			const point3& b = m_Positions[m_Indices[3 * i + 1]];
+			const point3& c = m_Positions[m_Indices[3 * i + 2]];
+			point3 lo(fmin(a.x(), fmin(b.x(), c.x())), fmin(a.y(), fmin(b.y(), c.y())), fmin(a.z(), fmin(b.z(), c.z())));
+			point3 hi(fmax(a.x(), fmax(b.x(), c.x())), fmax(a.y(), fmax(b.y(), c.y())), fmax(a.z(), fmax(b.z(), c.z())));
+
+			// Triangles in an axis plane have flat bounds, which the slab test
+			// misses. The margin also keeps the bounds conservative against the
+			// rounding of the slab test, a ray reaching a leaf is what makes the
+			// triangle test watertight.
+			vec3 margin = 1e-5f * (vec3(fabs(lo.x()), fabs(lo.y()), fabs(lo.z())) + vec3(fabs(hi.x()), fabs(hi.y()), fabs(hi.z())) + (hi - lo)) + vec3(1e-6f);
+			info.push_back({ i, aabb(lo - margin, hi + margin), 0.5f * (lo + hi) });
+		}
+
+		m_Tree.build(info, s_LeafSize, s_IntersectionCost);
+
+		std::vector<uint32_t> ordered(m_Indices.size());
+		for (size_t i = 0; i < info.size(); i++)
+		{
+			for (int k = 0; k < 3; k++)
+				ordered[3 * i + k] = m_Indices[3 * info[i].index + k];
+		}
+		m_Indices.swap(ordered);
+
+		m_Positions.shrink_to_fit();
+		m_Normals.shrink_to_fit();
+		m_UVs.shrink_to_fit();
+	}
+
+	size_t size() const { return m_Indices.size() / 3; }
+	size_t vertex_count() const { return m_Positions.size(); }
+
+	// Bytes held by the vertex and index buffers, and by the BVH
+	size_t buffer_bytes() const
+	{
+		return m_Positions.capacity() * sizeof(point3) + m_Normals.capacity() * sizeof(vec3)
+			+ m_UVs.capacity() * sizeof(float) + m_Indices.capacity() * sizeof(uint32_t);
+	}
+
+	size_t bvh_bytes() const { return m_Tree.node_count() * sizeof(wide_bvh_node); }
+
+	virtual bool hit(const ray& r, float t_min, float t_max, hit_record& rec) const override
+	{
+		const shear s(r.GetDirection());
+		int closest = -1;
+		float closestT = t_max;
+		float b1 = 0.0f, b2 = 0.0f;
+		bool found = m_Tree.traverse(r, t_min, t_max, [&](int first, int count, float& t) {
+			int lane = intersect_leaf(r, s, first, count, t_min, t, b1, b2);
+			if (lane < 0)
+				return false;
+
+			closest = first + lane;
+			closestT = t;
+			return true;
+		});
+
+		if (!found)
+			return false;
+
+		// Only the closest triangle's record is filled in, from its barycentrics.
+		// The point is interpolated rather than taken along the ray, so it lies
+		// on the triangle's plane as closely as floats allow.
+		uint32_t i0 = m_Indices[3 * closest], i1 = m_Indices[3 * closest + 1], i2 = m_Indices[3 * closest + 2];
+		const point3& p0 = m_Positions[i0];
+		const point3& p1 = m_Positions[i1];
+		const point3& p2 = m_Positions[i2];
+		float b0 = 1.0f - b1 - b2;
+
+		vec3 e1 = p1 - p0;
+		vec3 e2 = p2 - p0;
+		vec3 geometric = cross(e1, e2);
+
+		rec.t = closestT;
+		rec.p = b0 * p0 + b1 * p1 + b2 * p2;
+		rec.set_face_normal(r, unit_vector(geometric));
+
+		if (!m_Normals.empty())
+		{
+			// The shading normal is kept on the side the ray arrived from, as
+			// the materials expect of rec.normal.
+			vec3 shading = b0 * m_Normals[i0] + b1 * m_Normals[i1] + b2 * m_Normals[i2];
+			if (shading.length_squared() > 0.0f)
+			{
+				shading = unit_vector(shading);
+				rec.normal = dot(shading, rec.normal) < 0.0f ? -shading : shading;
+			}
+		}
+
+		if (!m_UVs.empty())
+		{
+			float u0 = m_UVs[2 * i0], v0 = m_UVs[2 * i0 + 1];
+			float u1 = m_UVs[2 * i1], v1 = m_UVs[2 * i1 + 1];
+			float u2 = m_UVs[2 * i2], v2 = m_UVs[2 * i2 + 1];
+			rec.u = b0 * u0 + b1 * u1 + b2 * u2;
+			rec.v = b0 * v0 + b1 * v1 + b2 * v2;
+
+			// Texture area over surface area, as a length
+			float uvArea = fabs((u1 - u0) * (v2 - v0) - (u2 - u0) * (v1 - v0));
+			float area = geometric.length();
+			rec.footprint = area > 0.0f ? sqrt(uvArea / area) : 0.0f;
+		}
+		else
+		{
+			rec.u = b1;
+			rec.v = b2;
+			rec.footprint = 0.0f;
+		}
+
+		rec.matId = m_Material;
+		rec.primId = static_cast<uint32_t>(closest);
+		return true;
+	}
+
+	// Every triangle the ray passes through. The test is watertight, so a ray
+	// through a shared edge crosses a closed mesh exactly once there.
+	virtual void crossings(const ray& r, float t_min, float t_max, crossing_list& out) const override
+	{
+		const shear s(r.GetDirection());
+		m_Tree.traverse(r, t_min, t_max, [&](int first, int count, float&) {
+			alignas(32) float dist[s_LeafSize], V[s_LeafSize], W[s_LeafSize];
+			leaf_distances(r, s, first, count, t_min, t_max, dist, V, W);
+			for (int i = 0; i < count; i++)
+			{
+				if (dist[i] < INF)
+					out.insert(dist[i]);
+			}
+			return false;
+		});
+	}
+
+	virtual bool bounding_box(float t0, float t1, aabb& output_box) const override
+	{
+		if (m_Tree.empty())
+			return false;
+
+		output_box = m_Tree.bounds();
+		return true;
+	}
+
+private:
+	// The ray's direction permuted so its largest component is z, and the
+	// shear that turns it into the unit z axis. Computed once per ray.
+	struct shear
+	{
+		int kx, ky, kz;
+		float sx, sy, sz;
+
+		shear(const vec3& d)
+		{
+			float ax = fabs(d.x()), ay = fabs(d.y()), az = fabs(d.z());
+			kz = ax > ay ? (ax > az ? 0 : 2) : (ay > az ? 1 : 2);
+			kx = kz == 2 ? 0 : kz + 1;
+			ky = kx == 2 ? 0 : kx + 1;
+
+			// Keeps the winding of the triangles as seen along the ray
+			if (d[kz] < 0.0f)
+				std::swap(kx, ky);
+
+			sx = d[kx] / d[kz];
+			sy = d[ky] / d[kz];
+			sz = 1.0f / d[kz];
+		}
+	};
+
+	// A product as rounded on its own. Watertightness needs the edge function of
+	// a shared edge to come out as the exact negation in both triangles, which
+	// a compiler fusing one product into the subtraction as a multiply-add
+	// breaks. The empty asm hides the value so it cannot.
+	template<typename T>
+	static T rounded(T product)
+	{
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+		asm("" : "+x"(product));
+#elif defined(__GNUC__) && defined(__aarch64__)
+		asm("" : "+w"(product));
+#endif
+		return product;
+	}
+
+	// The edge functions of one lane again in double precision. Woop et al.
+	// fall back to them when a float result is exactly zero, where the sign
+	// that decides between two neighbouring triangles is lost.
+	static void edges_exact(float ax, float ay, float bx, float by, float cx, float cy, float& u, float& v, float& w)
+	{
+		u = static_cast<float>(static_cast<double>(cx) * by - static_cast<double>(cy) * bx);
+		v = static_cast<float>(static_cast<double>(ax) * cy - static_cast<double>(ay) * cx);
+		w = static_cast<float>(static_cast<double>(bx) * ay - static_cast<double>(by) * ax);
+	}
+
+	// Intersects the count triangles starting at first and returns the lane of
+	// the closest one hit within (t_min, t_max), shrinking t_max to its
+	// distance and setting the barycentrics of its second and third vertex, or
+	// -1 if none is hit.
+	int intersect_leaf(const ray& r, const shear& s, int first, int count, float t_min, float& t_max, float& b1, float& b2) const
+	{
+		alignas(32) float dist[s_LeafSize], V[s_LeafSize], W[s_LeafSize];
+		leaf_distances(r, s, first, count, t_min, t_max, dist, V, W);
+
+		int lane = -1;
+		for (int i = 0; i < count; i++)
+		{
+			if (dist[i] < t_max)
+			{
+				t_max = dist[i];
+				lane = i;
+			}
+		}
+
+		if (lane >= 0)
+		{
+			b1 = V[lane];
+			b2 = W[lane];
+		}
+		return lane;
+	}
+
+	// Sets dist to the distance at which the ray hits each of the count
+	// triangles starting at first, or INF if it misses it or the hit is not in
+	// (t_min, t_max). V and W get the barycentrics of the hits' second and
+	// third vertices.
+	void leaf_distances(const ray& r, const shear& s, int first, int count, float t_min, float t_max, float* dist, float* V, float* W) const
+	{
+		RT_STAT(render_stats::local().tests[render_stats::prim_triangle] += count);
+		const vec3& o = r.GetOrigin();
+
+		// Vertices relative to the origin, gathered into lanes in the ray's
+		// permuted axes. Unused lanes stay zero, a degenerate triangle.
+		alignas(32) float g[9][s_LeafSize] = {};
+		for (int i = 0; i < count; i++)
+		{
+			for (int k = 0; k < 3; k++)
+			{
+				const point3& p = m_Positions[m_Indices[3 * (first + i) + k]];
+				g[3 * k][i] = p[s.kx] - o[s.kx];
+				g[3 * k + 1][i] = p[s.ky] - o[s.ky];
+				g[3 * k + 2][i] = p[s.kz] - o[s.kz];
+			}
+		}
+
+		alignas(32) float ex[3][s_LeafSize], ey[3][s_LeafSize]; // Sheared x and y of a, b and c
+
+#if defined(RT_BVH_AVX)
+		alignas(32) float U[s_LeafSize]; // Edge functions redone exactly, with V and W
+		__m256 sx = _mm256_set1_ps(s.sx), sy = _mm256_set1_ps(s.sy);
+		for (int k = 0; k < 3; k++)
+		{
+			__m256 z = _mm256_load_ps(g[3 * k + 2]);
+			_mm256_store_ps(ex[k], _mm256_sub_ps(_mm256_load_ps(g[3 * k]), _mm256_mul_ps(sx, z)));
+			_mm256_store_ps(ey[k], _mm256_sub_ps(_mm256_load_ps(g[3 * k + 1]), _mm256_mul_ps(sy, z)));
+		}
+
+		__m256 ax = _mm256_load_ps(ex[0]), ay = _mm256_load_ps(ey[0]);
+		__m256 bx = _mm256_load_ps(ex[1]), by = _mm256_load_ps(ey[1]);
+		__m256 cx = _mm256_load_ps(ex[2]), cy = _mm256_load_ps(ey[2]);
+		__m256 u = _mm256_sub_ps(rounded(_mm256_mul_ps(cx, by)), rounded(_mm256_mul_ps(cy, bx)));
+		__m256 v = _mm256_sub_ps(rounded(_mm256_mul_ps(ax, cy)), rounded(_mm256_mul_ps(ay, cx)));
+		__m256 w = _mm256_sub_ps(rounded(_mm256_mul_ps(bx, ay)), rounded(_mm256_mul_ps(by, ax)));
+
+		__m256 zero = _mm256_setzero_ps();
+		__m256 used = _mm256_cmp_ps(_mm256_setr_ps(0, 1, 2, 3, 4, 5, 6, 7), _mm256_set1_ps(static_cast<float>(count)), _CMP_LT_OQ);
+		__m256 exact = _mm256_or_ps(_mm256_or_ps(_mm256_cmp_ps(u, zero, _CMP_EQ_OQ), _mm256_cmp_ps(v, zero, _CMP_EQ_OQ)), _mm256_cmp_ps(w, zero, _CMP_EQ_OQ));
+		int redo = _mm256_movemask_ps(_mm256_and_ps(used, exact));
+		if (redo)
+		{
+			_mm256_store_ps(U, u);
+			_mm256_store_ps(V, v);
+			_mm256_store_ps(W, w);
+			for (int i = 0; i < count; i++)
+			{
+				if (redo & (1 << i))
+					edges_exact(ex[0][i], ey[0][i], ex[1][i], ey[1][i], ex[2][i], ey[2][i], U[i], V[i], W[i]);
+			}
+			u = _mm256_load_ps(U);
+			v = _mm256_load_ps(V);
+			w = _mm256_load_ps(W);
+		}
+
+		// Inside when the edge functions agree in sign
+		__m256 negative = _mm256_or_ps(_mm256_or_ps(_mm256_cmp_ps(u, zero, _CMP_LT_OQ), _mm256_cmp_ps(v, zero, _CMP_LT_OQ)), _mm256_cmp_ps(w, zero, _CMP_LT_OQ));
+		__m256 positive = _mm256_or_ps(_mm256_or_ps(_mm256_cmp_ps(u, zero, _CMP_GT_OQ), _mm256_cmp_ps(v, zero, _CMP_GT_OQ)), _mm256_cmp_ps(w, zero, _CMP_GT_OQ));
+		__m256 det = _mm256_add_ps(_mm256_add_ps(u, v), w);
+		__m256 valid = _mm256_andnot_ps(_mm256_and_ps(negative, positive), used);
+		valid = _mm256_and_ps(valid, _mm256_cmp_ps(det, zero, _CMP_NEQ_OQ));
+		if (_mm256_movemask_ps(valid) == 0)
+		{
+			_mm256_store_ps(dist, _mm256_set1_ps(INF));
+			return;
+		}
+
+		__m256 sz = _mm256_set1_ps(s.sz);
+		__m256 T = _mm256_add_ps(_mm256_add_ps(
+			_mm256_mul_ps(u, _mm256_mul_ps(sz, _mm256_load_ps(g[2])))
+			, _mm256_mul_ps(v, _mm256_mul_ps(sz, _mm256_load_ps(g[5])))),
+			_mm256_mul_ps(w, _mm256_mul_ps(sz, _mm256_load_ps(g[8]))));
+		__m256 t = _mm256_div_ps(T, det);
+		valid = _mm256_and_ps(valid, _mm256_and_ps(_mm256_cmp_ps(t, _mm256_set1_ps(t_min), _CMP_GT_OQ), _mm256_cmp_ps(t, _mm256_set1_ps(t_max), _CMP_LT_OQ)));
+
+		_mm256_store_ps(dist, _mm256_blendv_ps(_mm256_set1_ps(INF), t, valid));
+		_mm256_store_ps(V, _mm256_div_ps(v, det));
+		_mm256_store_ps(W, _mm256_div_ps(w, det));
+#elif defined(RT_BVH_SSE)
+		// Two passes of four lanes
+		alignas(16) float U[s_LeafSize]; // Edge functions redone exactly, with V and W
+		__m128 sx = _mm_set1_ps(s.sx), sy = _mm_set1_ps(s.sy), sz = _mm_set1_ps(s.sz);
+		__m128 zero = _mm_setzero_ps();
+		__m128 lo = _mm_set1_ps(t_min), hi = _mm_set1_ps(t_max), inf = _mm_set1_ps(INF);
+
+		for (int half = 0; half < count; half += 4)
+		{
+			for (int k = 0; k < 3; k++)
+			{
+				__m128 z = _mm_load_ps(g[3 * k + 2] + half);
+				_mm_store_ps(ex[k] + half, _mm_sub_ps(_mm_load_ps(g[3 * k] + half), _mm_mul_ps(sx, z)));
+				_mm_store_ps(ey[k] + half, _mm_sub_ps(_mm_load_ps(g[3 * k + 1] + half), _mm_mul_ps(sy, z)));
+			}
+
+			__m128 ax = _mm_load_ps(ex[0] + half), ay = _mm_load_ps(ey[0] + half);
+			__m128 bx = _mm_load_ps(ex[1] + half), by = _mm_load_ps(ey[1] + half);
+			__m128 cx = _mm_load_ps(ex[2] + half), cy = _mm_load_ps(ey[2] + half);
+			__m128 u = _mm_sub_ps(rounded(_mm_mul_ps(cx, by)), rounded(_mm_mul_ps(cy, bx)));
+			__m128 v = _mm_sub_ps(rounded(_mm_mul_ps(ax, cy)), rounded(_mm_mul_ps(ay, cx)));
+			__m128 w = _mm_sub_ps(rounded(_mm_mul_ps(bx, ay)), rounded(_mm_mul_ps(by, ax)));
+
+			__m128 used = _mm_cmplt_ps(_mm_setr_ps(0, 1, 2, 3), _mm_set1_ps(static_cast<float>(count - half)));
+			__m128 exact = _mm_or_ps(_mm_or_ps(_mm_cmpeq_ps(u, zero), _mm_cmpeq_ps(v, zero)), _mm_cmpeq_ps(w, zero));
+			int redo = _mm_movemask_ps(_mm_and_ps(used, exact));
+			if (redo)
+			{
+				_mm_store_ps(U + half, u);
+				_mm_store_ps(V + half, v);
+				_mm_store_ps(W + half, w);
+				for (int i = 0; i < 4; i++)
+				{
+					int lane = half + i;
+					if (redo & (1 << i))
+						edges_exact(ex[0][lane], ey[0][lane], ex[1][lane], ey[1][lane], ex[2][lane], ey[2][lane], U[lane], V[lane], W[lane]);
+				}
+				u = _mm_load_ps(U + half);
+				v = _mm_load_ps(V + half);
+				w = _mm_load_ps(W + half);
+			}
+
+			__m128 negative = _mm_or_ps(_mm_or_ps(_mm_cmplt_ps(u, zero), _mm_cmplt_ps(v, zero)), _mm_cmplt_ps(w, zero));
+			__m128 positive = _mm_or_ps(_mm_or_ps(_mm_cmpgt_ps(u, zero), _mm_cmpgt_ps(v, zero)), _mm_cmpgt_ps(w, zero));
+			__m128 det = _mm_add_ps(_mm_add_ps(u, v), w);
+			__m128 valid = _mm_andnot_ps(_mm_and_ps(negative, positive), used);
+			valid = _mm_and_ps(valid, _mm_cmpneq_ps(det, zero));
+			if (_mm_movemask_ps(valid) == 0)
+			{
+				_mm_store_ps(dist + half, inf);
+				continue;
+			}
+
+			__m128 T = _mm_add_ps(_mm_add_ps(
+				_mm_mul_ps(u, _mm_mul_ps(sz, _mm_load_ps(g[2] + half))),
+				_mm_mul_ps(v, _mm_mul_ps(sz, _mm_load_ps(g[5] + half)))),
+				_mm_mul_ps(w, _mm_mul_ps(sz, _mm_load_ps(g[8] + half))));
+			__m128 t = _mm_div_ps(T, det);
+			valid = _mm_and_ps(valid, _mm_and_ps(_mm_cmpgt_ps(t, lo), _mm_cmplt_ps(t, hi)));
+
+			_mm_store_ps(dist + half, _mm_or_ps(_mm_and_ps(valid, t), _mm_andnot_ps(valid, inf)));
+			_mm_store_ps(V + half, _mm_div_ps(v, det));
+			_mm_store_ps(W + half, _mm_div_ps(w, det));
+		}
+#else
+		for (int i = 0; i < count; i++)
+		{
+			dist[i] = INF;
+			for (int k = 0; k < 3; k++)
+			{
+				ex[k][i] = g[3 * k][i] - s.sx * g[3 * k + 2][i];
+				ey[k][i] = g[3 * k + 1][i] - s.sy * g[3 * k + 2][i];
+			}
+
+			float u = rounded(ex[2][i] * ey[1][i]) - rounded(ey[2][i] * ex[1][i]);
+			float v = rounded(ex[0][i] * ey[2][i]) - rounded(ey[0][i] * ex[2][i]);
+			float w = rounded(ex[1][i] * ey[0][i]) - rounded(ey[1][i] * ex[0][i]);
+			if (u == 0.0f || v == 0.0f || w == 0.0f)
+				edges_exact(ex[0][i], ey[0][i], ex[1][i], ey[1][i], ex[2][i], ey[2][i], u, v, w);
+
+			if ((u < 0.0f || v < 0.0f || w < 0.0f) && (u > 0.0f || v > 0.0f || w > 0.0f))
+				continue;
+
+			float det = u + v + w;
+			if (det == 0.0f)
+				continue;
+
+			float t = (u * (s.sz * g[2][i]) + v * (s.sz * g[5][i]) + w * (s.sz * g[8][i])) / det;
+			if (t > t_min && t < t_max)
+			{
+				dist[i] = t;
+				V[i] = v / det;
+				W[i] = w / det;
+			}
+		}
+#endif
+	}
+
+	bvh_tree m_Tree;
+	material_id m_Material;
+	std::vector<point3> m_Positions;
+	std::vector<vec3> m_Normals; // Empty, or one per position
+	std::vector<float> m_UVs; // Empty, or two per position
+	std::vector<uint32_t> m_Indices; // Three per triangle, in leaf order once built
+};
+
+#endif
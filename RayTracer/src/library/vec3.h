@@ -132,35 +132,35 @@ vec3 refract(const vec3& uv, const vec3& normal, float factor)
 //////////////////////////////////////////////////////////////////
 /// Random ///////////////////////////////////////////////////////
 //////////////////////////////////////////////////////////////////
-vec3 random_in_unit_disk()
+vec3 random_in_unit_disk(sampler& s)
 {
 	while (true)
 	{
-		vec3 p = vec3(random_float(-1, 1), random_float(-1, 1), 0);
+		vec3 p = vec3(s.next(-1, 1), s.next(-1, 1), 0);
 		if (p.length_squared() < 1)
 			return p;
 	}
 }
 
-vec3 random_in_unit_sphere() {
+vec3 random_in_unit_sphere(sampler& s) {
 	while (true) {
-		vec3 p = vec3::random(-1, 1);
+		vec3 p = vec3(s.next(-1, 1), s.next(-1, 1), s.next(-1, 1));
 		if (p.length_squared() < 1)
 			return p;
 	}
 }
 
-vec3 random_unit_vector()
+vec3 random_unit_vector(sampler& s)
 {
-	float a = random_float(0, 2 * PI);
-	float z = random_float(-1, 1);
+	float a = s.next(0, 2 * PI);
+	float z = s.next(-1, 1);
 	float r = sqrt(1 - z * z);
 	return vec3(r * cos(a), r * sin(a), z);
 }
 
-vec3 random_in_hemisphere(const vec3& nornal)
+vec3 random_in_hemisphere(const vec3& nornal, sampler& s)
 {
-	vec3 in_unit_sphere = random_in_unit_sphere();
+	vec3 in_unit_sphere = random_in_unit_sphere(s);
 	if (dot(in_unit_sphere, nornal) > 0.0)
 		return in_unit_sphere;
 	else
@@ -0,0 +1,250 @@
+#pragma once
+
+#ifndef WAVEFRONT_H
+#define WAVEFRONT_H
+
+#include "integrator.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <utility>
+#include <vector>
+
+// Rays waiting for a stage, one array per component, each tagged with the
+// path it belongs to.
+struct ray_queue
+{
+	std::vector<float> originX, originY, originZ;
+	std::vector<float> directionX, directionY, directionZ;
+	std::vector<float> time;
+	std::vector<uint32_t> seed;
+	std::vector<uint32_t> path;
+
+	size_t size() const { return path.size(); }
+
+	void resize(size_t n)
+	{
+		for (auto* array : { &originX, &originY, &originZ, &directionX, &directionY, &directionZ, &time })
+			array->resize(n);
+		seed.resize(n);
+		path.resize(n);
+	}
+
+	void set(size_t i, const ray& r, uint32_t p)
+	{
+		point3 o = r.GetOrigin();
+		vec3 d = r.GetDirection();
+		originX[i] = o.x();
+		originY[i] = o.y();
+		originZ[i] = o.z();
+		directionX[i] = d.x();
+		directionY[i] = d.y();
+		directionZ[i] = d.z();
+		time[i] = r.GetTime();
+		seed[i] = r.GetSeed();
+		path[i] = p;
+	}
+
+	ray get(size_t i) const
+	{
+		return ray(point3(originX[i], originY[i], originZ[i]), vec3(directionX[i], directionY[i], directionZ[i]), time[i], seed[i]);
+	}
+};
+
+// Traces a batch of paths a bounce at a time instead of one path at a time.
+// Each bounce runs four stages over the queue of live rays:
+//  extend   intersects every ray with the scene
+//  shade    evaluates the hits grouped by material, so runs of the same
+//           scatter and texture code execute back to back, and samples the
+//           lights
+//  shadow   traces the shadow rays towards the light samples
+//  scatter  applies Russian roulette and compacts the surviving rays, in
+//           path order, into the queue of the next bounce
+// The per path steps are the ones tracePath uses, so the radiance of every
+// path is the same as the megakernel's.
+class wavefront_integrator
+{
+public:
+	wavefront_integrator(const hittable& world, const material_table& materials, const light_list* lights, const color& background,
+		int max_depth, int rr_depth, float spread)
+		: m_World(world), m_Materials(materials), m_Lights(lights), m_Background(background), m_MaxDepth(max_depth), m_RrDepth(rr_depth),
+		m_Spread(spread) {}
+
+	// Traces count paths. generate(k, s) sets up the sampler of path k and
+	// returns its camera ray. The radiance of path k is written to out[k], and
+	// if aovs is not null, aovs[k] receives its first hit.
+	template<typename GenerateFn>
+	void trace(size_t count, GenerateFn&& generate, color* out, pixel_aov* aovs)
+	{
+		m_Samplers.resize(count);
+		m_Throughput.assign(count, color(1.0f));
+		m_Pdf.assign(count, 0.0f);
+		m_Distance.assign(count, 0.0f);
+		m_Queue.resize(count);
+
+		for (size_t k = 0; k < count; k++)
+		{
+			m_Queue.set(k, generate(k, m_Samplers[k]), static_cast<uint32_t>(k));
+			out[k] = color(0.0f);
+		}
+
+		for (int depth = 0; depth < m_MaxDepth && m_Queue.size() > 0; depth++)
+		{
+			RT_STAT(render_stats::local().count_rays(depth, m_Queue.size()));
+			extend(depth == 0);
+			shade(out, depth == 0 ? aovs : nullptr);
+			shadow(out);
+			scatter(depth);
+			std::swap(m_Queue, m_Next);
+		}
+
+		// Paths still going when the depth ran out
+		RT_STAT(render_stats::local().ends[render_stats::end_max_depth] += m_Queue.size());
+	}
+
+private:
+	// Camera rays are queued pixel by pixel, so runs of them are coherent
+	// enough to be traced as packets.
+	void extend(bool coherent)
+	{
+		size_t n = m_Queue.size();
+		m_Hits.resize(n);
+		m_Found.resize(n);
+
+		if (!coherent)
+		{
+			for (size_t i = 0; i < n; i++)
+				m_Found[i] = m_World.hit(m_Queue.get(i), 0.001f, INF, m_Hits[i]);
+			return;
+		}
+
+		ray_packet packet;
+		float t_max[ray_packet::s_Size];
+		for (size_t first = 0; first < n; first += ray_packet::s_Size)
+		{
+			packet.count = static_cast<int>(std::min<size_t>(ray_packet::s_Size, n - first));
+			for (int k = 0; k < packet.count; k++)
+			{
+				packet.rays[k] = m_Queue.get(first + k);
+				t_max[k] = INF;
+			}
+
+			int hits = m_World.hit_packet(packet, packet.mask(), 0.001f, t_max, &m_Hits[first]);
+			for (int k = 0; k < packet.count; k++)
+				m_Found[first + k] = (hits >> k) & 1;
+		}
+	}
+
+	void shade(color* out, pixel_aov* aovs)
+	{
+		size_t n = m_Queue.size();
+		m_Scatters.assign(n, 0);
+		m_Lit.assign(n, 0);
+		m_Attenuation.resize(n);
+		m_Scattered.resize(n);
+		m_Shadow.resize(n);
+		m_ShadowWeight.resize(n);
+
+		// Counting sort of the hits by material, misses only pick up the background
+		m_Bins.assign(m_Materials.size() + 1, 0);
+		for (size_t i = 0; i < n; i++)
+		{
+			if (m_Found[i])
+				m_Bins[m_Hits[i].matId + 1]++;
+			else
+			{
+				out[m_Queue.path[i]] += m_Throughput[m_Queue.path[i]] * m_Background;
+				RT_STAT(render_stats::local().ends[render_stats::end_escaped]++);
+			}
+		}
+
+		for (size_t b = 1; b < m_Bins.size(); b++)
+			m_Bins[b] += m_Bins[b - 1];
+
+		m_Order.resize(m_Bins.back());
+		for (size_t i = 0; i < n; i++)
+			if (m_Found[i])
+				m_Order[m_Bins[m_Hits[i].matId]++] = static_cast<uint32_t>(i);
+
+		for (uint32_t i : m_Order)
+		{
+			uint32_t p = m_Queue.path[i];
+			hit_record& rec = m_Hits[i];
+			shade_result shaded;
+
+			m_Distance[p] += rec.t * m_Queue.get(i).GetDirection().length();
+			widen_footprint(rec, m_Spread, m_Distance[p]);
+
+			m_Scatters[i] = shade_hit(m_Materials[rec.matId], m_Queue.get(i), rec, m_Pdf[p], m_Lights, m_Throughput[p], out[p],
+				m_Samplers[p], aovs ? &aovs[p] : nullptr, shaded);
+			if (m_Scatters[i])
+			{
+				m_Attenuation[i] = shaded.attenuation;
+				m_Scattered.set(i, shaded.scattered, p);
+				m_Pdf[p] = shaded.scatteredPdf;
+			}
+
+			m_Lit[i] = shaded.lit;
+			if (shaded.lit)
+			{
+				m_Shadow.set(i, shaded.light.shadow, p);
+				m_ShadowWeight[i] = shaded.light.weight;
+			}
+		}
+	}
+
+	void shadow(color* out)
+	{
+		for (size_t i = 0; i < m_Queue.size(); i++)
+		{
+			if (m_Lit[i])
+				out[m_Queue.path[i]] += connect_light({ m_Shadow.get(i), m_ShadowWeight[i] }, m_World, m_Materials);
+		}
+	}
+
+	void scatter(int depth)
+	{
+		size_t n = m_Queue.size();
+		size_t live = 0;
+		m_Next.resize(n);
+		for (size_t i = 0; i < n; i++)
+		{
+			uint32_t p = m_Queue.path[i];
+			RT_STAT(if (m_Found[i] && !m_Scatters[i]) render_stats::local().ends[render_stats::end_absorbed]++);
+			if (m_Scatters[i] && continue_path(m_Throughput[p], m_Attenuation[i], depth, m_RrDepth, m_Samplers[p]))
+				m_Next.set(live++, m_Scattered.get(i), p);
+		}
+		m_Next.resize(live);
+	}
+
+	const hittable& m_World;
+	const material_table& m_Materials;
+	const light_list* m_Lights;
+	color m_Background;
+	int m_MaxDepth;
+	int m_RrDepth;
+	float m_Spread;
+
+	// Per path
+	std::vector<sampler> m_Samplers;
+	std::vector<color> m_Throughput;
+	std::vector<float> m_Pdf; // Density the path's current ray was scattered with
+	std::vector<float> m_Distance; // Travelled so far, for texture footprints
+
+	// Per entry of the current queue
+	ray_queue m_Queue;
+	std::vector<hit_record> m_Hits;
+	std::vector<uint8_t> m_Found;
+	std::vector<uint8_t> m_Scatters;
+	std::vector<color> m_Attenuation;
+	ray_queue m_Scattered;
+	std::vector<uint8_t> m_Lit;
+	ray_queue m_Shadow;
+	std::vector<color> m_ShadowWeight;
+
+	std::vector<uint32_t> m_Bins;
+	std::vector<uint32_t> m_Order; // Indices of the hits sorted by material
+	ray_queue m_Next;
+};
+
+#endif